@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <linux/types.h>
+#include <pthread.h>
 
 #include "partclone.h"
 #include "apfsclone.h"
@@ -38,6 +39,8 @@
 #define MAX_APFS_SPACEMAN_SIZE (1ULL << 20) // Max 1MB for spaceman struct
 #define MAX_APFS_CHUNK_INFO_COUNT (1ULL << 24) // Max 16 million chunk info blocks/arrays
 #define MAX_APFS_CHUNK_PER_CIB (1ULL << 16) // Max 65536 chunks per chunk info block
+#define CIB_THREADS_MAX 8 // chunk info blocks translated at once
+#define APFS_READ_BLOCKS 256 // bitmap blocks fetched by one pread
 
 
 static void *get_spaceman_buf(int fd, const struct nx_superblock_t *nxsb)
@@ -298,6 +301,172 @@ static void fs_close(){
     close(APFSDEV);
 }
 
+/// one entry of the spaceman chunk info (address) block array
+typedef struct {
+    uint64_t paddr;	/// physical block of the chunk info block
+    uint64_t cnt;	/// index in the array of its spaceman device
+    int other;		/// not a chunk info block
+} cib_job;
+
+/// a chunk which free space is described by a bitmap block
+typedef struct {
+    uint64_t bitmap_addr;
+    uint64_t addr;
+    uint32_t count;
+} chunk_job;
+
+static cib_job *cib_jobs;
+static uint64_t cib_job_count;
+static uint64_t next_cib;
+static uint64_t cib_done;
+static int cib_error;
+static pthread_mutex_t cib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long *apfs_bitmap;
+static unsigned long long apfs_totalblock;
+static uint32_t apfs_block_size;
+static uint64_t apfs_blocks_per_chunk;
+static progress_bar prog;
+
+static int compare_cib_job(const void *a, const void *b)
+{
+    const cib_job *x = a, *y = b;
+
+    return (x->paddr > y->paddr) - (x->paddr < y->paddr);
+}
+
+static int compare_chunk_job(const void *a, const void *b)
+{
+    const chunk_job *x = a, *y = b;
+
+    return (x->bitmap_addr > y->bitmap_addr) - (x->bitmap_addr < y->bitmap_addr);
+}
+
+/// read the bitmap blocks of @count chunks in address order, adjacent blocks with one pread
+static int read_chunk_bitmaps(chunk_job *chunks, uint32_t count, char *buf)
+{
+    uint32_t i, j, n;
+    size_t size;
+    ssize_t read_size;
+
+    qsort(chunks, count, sizeof(chunk_job), compare_chunk_job);
+    for (i = 0; i < count; i += n) {
+	for (n = 1; n < APFS_READ_BLOCKS && i + n < count; n++)
+	    if (chunks[i + n].bitmap_addr != chunks[i].bitmap_addr + n)
+		break;
+	size = (size_t)n * apfs_block_size;
+	read_size = pread(APFSDEV, buf, size, chunks[i].bitmap_addr * apfs_block_size);
+	if (read_size != (ssize_t)size) {
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: pread error reading bitmap entry from %llu (%zd bytes, expected %zu): %s\n", __FILE__, chunks[i].bitmap_addr * apfs_block_size, read_size, size, strerror(errno));
+	    return -1;
+	}
+	/// a set bit of the spaceman bitmap is a used block, like ours
+	for (j = 0; j < n; j++)
+	    pc_copy_bits_le(chunks[i + j].addr, (unsigned char *)buf + (size_t)j * apfs_block_size,
+		    chunks[i + j].count, apfs_bitmap, apfs_totalblock);
+    }
+    return 0;
+}
+
+/// translate the chunks of one chunk info block
+static int scan_cib(cib_job *job, char *cib_buf, chunk_job *chunks, char *bitmap_buf)
+{
+    struct chunk_info_block_t chunk_info_block;
+    struct chunk_info_t chunk_info;
+    ssize_t read_size;
+    uint64_t chunk;
+    uint32_t count = 0;
+
+    read_size = pread(APFSDEV, cib_buf, apfs_block_size, job->paddr * apfs_block_size);
+    if (read_size != apfs_block_size) {
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: pread error reading chunk info block from %llu (%zd bytes, expected %u): %s\n", __FILE__, job->paddr * apfs_block_size, read_size, apfs_block_size, strerror(errno));
+	return -1;
+    }
+    memcpy(&chunk_info_block, cib_buf, sizeof(chunk_info_block));
+
+    log_mesg(2, 0, 0, fs_opt.debug, "%s: chunk_info_count %x\n", __FILE__, chunk_info_block.cib_chunk_info_count);
+    log_mesg(2, 0, 0, fs_opt.debug, "%s: block type %x\n", __FILE__, chunk_info_block.cib_o.o_type);
+
+    if (chunk_info_block.cib_chunk_info_count == 0 || chunk_info_block.cib_chunk_info_count > MAX_APFS_CHUNK_PER_CIB) {
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero cib_chunk_info_count: %u (Max allowed: %llu).\n", __FILE__, chunk_info_block.cib_chunk_info_count, MAX_APFS_CHUNK_PER_CIB);
+	return -1;
+    }
+
+    if (chunk_info_block.cib_o.o_type != 0x40000007ULL) {
+	job->other = 1;
+	return 0;
+    }
+
+    log_mesg(3, 0, 0, fs_opt.debug, "%s: get addr %llx\n", __FILE__, job->paddr);
+    for (chunk = 0; chunk < chunk_info_block.cib_chunk_info_count; chunk++) {
+	if (sizeof(chunk_info_block) + chunk*(uint64_t)sizeof(chunk_info) > apfs_block_size - sizeof(chunk_info)) {
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in chunk_info memcpy offset or OOB access for chunk %llu.\n", __FILE__, chunk);
+	    return -1;
+	}
+	memcpy(&chunk_info, cib_buf + sizeof(chunk_info_block) + chunk*(uint64_t)sizeof(chunk_info), sizeof(chunk_info));
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: xid = %x, offset = %llx, bitTot = %llx, bit avl = %llx, block = %llx\n", __FILE__, chunk_info.ci_xid, chunk_info.ci_addr, chunk_info.ci_block_count, chunk_info.ci_free_count, chunk_info.ci_bitmap_addr);
+
+	if (chunk_info.ci_block_count == 0 || (uint64_t)chunk_info.ci_block_count > (uint64_t)apfs_block_size * 8 ||
+		chunk_info.ci_addr > apfs_totalblock - chunk_info.ci_block_count) {
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Malicious chunk %llu+%u out of %llu blocks.\n", __FILE__, chunk_info.ci_addr, chunk_info.ci_block_count, apfs_totalblock);
+	    return -1;
+	}
+
+	if ((chunk_info.ci_bitmap_addr == 0) && (chunk_info.ci_free_count == apfs_blocks_per_chunk)) { // 0x8000, all free
+	    pc_clear_range(chunk_info.ci_addr, chunk_info.ci_block_count, apfs_bitmap, apfs_totalblock);
+	    continue;
+	}
+	if (chunk_info.ci_bitmap_addr > ULLONG_MAX / apfs_block_size) {
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Malicious physical address for bitmap entry: %llu.\n", __FILE__, chunk_info.ci_bitmap_addr);
+	    return -1;
+	}
+	chunks[count].bitmap_addr = chunk_info.ci_bitmap_addr;
+	chunks[count].addr = chunk_info.ci_addr;
+	chunks[count].count = chunk_info.ci_block_count;
+	count++;
+    }
+    return read_chunk_bitmaps(chunks, count, bitmap_buf);
+}
+
+/// take the next chunk info block not translated yet until there is none left
+static void *scan_cib_thread(void *arg)
+{
+    char *cib_buf = malloc(apfs_block_size);
+    char *bitmap_buf = malloc((size_t)APFS_READ_BLOCKS * apfs_block_size);
+    chunk_job *chunks = malloc(apfs_block_size / sizeof(chunk_info_t) * sizeof(chunk_job));
+    cib_job *job;
+    int err = 0;
+
+    if (!cib_buf || !bitmap_buf || !chunks) {
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for chunk info buffers: %s\n", __FILE__, strerror(errno));
+	err = 1;
+    }
+    while (!err) {
+	pthread_mutex_lock(&cib_lock);
+	job = (!cib_error && next_cib < cib_job_count) ? &cib_jobs[next_cib++] : NULL;
+	pthread_mutex_unlock(&cib_lock);
+	if (!job)
+	    break;
+
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: check chunk %llu\n", __FILE__, job->cnt);
+	err = scan_cib(job, cib_buf, chunks, bitmap_buf);
+
+	pthread_mutex_lock(&cib_lock);
+	cib_done++;
+	update_pui(&prog, cib_done * apfs_totalblock / cib_job_count, cib_done * apfs_totalblock / cib_job_count, 0);
+	pthread_mutex_unlock(&cib_lock);
+    }
+    if (err) {
+	pthread_mutex_lock(&cib_lock);
+	cib_error = 1;
+	pthread_mutex_unlock(&cib_lock);
+    }
+    free(chunks);
+    free(bitmap_buf);
+    free(cib_buf);
+    return NULL;
+}
+
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
     int start = 0;
@@ -309,24 +478,19 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     void *spaceman_buf;
     uint64_t sm_offset = 0;
 
-    char *chunk_info_block_buf = NULL;
-    struct obj_phys_t obj_phys_t;
-    struct chunk_info_block_t chunk_info_block;
-    struct chunk_info_t chunk_info;
-    ssize_t  read_size = 0;
     uint64_t  addr;
     uint64_t  addr_data;
     uint64_t cnt = 0;
     uint64_t cnt_count = 0;
-    uint64_t chunk = 0;
     uint64_t blocks_per_chunk = 0;
+    uint64_t job;
+    uint64_t bitmap_block = 0;
 
+    pthread_t scan_threads[CIB_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads, t;
     int sd = 0;
 
-    uint64_t block = 0;
-    uint64_t bitmap_block = 0;
-    char *bitmap_entry_buf = NULL;
-
     if (fs_open(device) != 0) {
         return; // Abort
     }
@@ -334,7 +498,6 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
 
     /// init progress
-    progress_bar   prog;    /// progress_bar structure defined in progress.h
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
 
     spaceman_buf = get_spaceman_buf(APFSDEV, &nxsb);
@@ -349,210 +512,123 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     blocks_per_chunk = spaceman.sm_blocks_per_chunk;
     if (blocks_per_chunk == 0 || blocks_per_chunk > fs_info.totalblock) {
         log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero blocks_per_chunk: %llu.\n", __FILE__, blocks_per_chunk);
-        fs_close();
-        return;
-    }
-
-
-    chunk_info_block_buf = (char *)malloc(block_size);
-    if (!chunk_info_block_buf) {
-        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for chunk_info_block_buf: %s\n", __FILE__, strerror(errno));
-        fs_close();
-        return;
-    }
-    bitmap_entry_buf = (char *)malloc(block_size);
-    if (!bitmap_entry_buf) {
-        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for bitmap_entry_buf: %s\n", __FILE__, strerror(errno));
-        free(chunk_info_block_buf);
+        free(spaceman_buf);
         fs_close();
         return;
     }
 
     if (SD_COUNT == 0 || SD_COUNT > 1024) {
         log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero SD_COUNT detected: %u.\n", __FILE__, SD_COUNT);
-        free(chunk_info_block_buf); free(bitmap_entry_buf);
+        free(spaceman_buf);
         fs_close();
         return;
     }
 
+    /// collect the chunk info blocks of every device first
+    cib_job_count = 0;
     for (sd = 0; sd < SD_COUNT; sd++){
-        sm_offset = spaceman.sm_dev[sd].sm_addr_offset;
-        uint32_t current_sd_cab_count = spaceman.sm_dev[sd].sm_cab_count;
-        uint32_t current_sd_cib_count = spaceman.sm_dev[sd].sm_cib_count;
-
-        if (current_sd_cab_count > 0){
-            cnt_count = current_sd_cab_count;
-        } else {
-            cnt_count = current_sd_cib_count;
-        }
+        if (spaceman.sm_dev[sd].sm_addr_offset == 0)
+            continue;
+        cnt_count = spaceman.sm_dev[sd].sm_cab_count > 0 ? spaceman.sm_dev[sd].sm_cab_count : spaceman.sm_dev[sd].sm_cib_count;
         if (cnt_count > MAX_APFS_CHUNK_INFO_COUNT) {
             log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero cnt_count for sd %d: %llu (Max allowed: %llu).\n", __FILE__, sd, cnt_count, MAX_APFS_CHUNK_INFO_COUNT);
-            // This might be non-fatal if other sd's are fine, but for now, abort
-            free(chunk_info_block_buf); free(bitmap_entry_buf);
+            free(spaceman_buf);
             fs_close();
             return;
         }
+        cib_job_count += cnt_count;
+    }
+    cib_jobs = calloc(cib_job_count ? cib_job_count : 1, sizeof(cib_job));
+    if (!cib_jobs) {
+        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for chunk info blocks: %s\n", __FILE__, strerror(errno));
+        free(spaceman_buf);
+        fs_close();
+        return;
+    }
 
+    job = 0;
+    for (sd = 0; sd < SD_COUNT; sd++){
+        sm_offset = spaceman.sm_dev[sd].sm_addr_offset;
+        cnt_count = spaceman.sm_dev[sd].sm_cab_count > 0 ? spaceman.sm_dev[sd].sm_cab_count : spaceman.sm_dev[sd].sm_cib_count;
         log_mesg(2, 0, 0, fs_opt.debug, "%s: sd %u, sm_offset %llx, cnt_count %llu\n", __FILE__, sd, sm_offset, cnt_count);
+        if (sm_offset == 0)
+            continue;
+
+        for (cnt = 0; cnt < cnt_count; cnt++){
+            addr = sm_offset + (uint64_t)sizeof(addr)*cnt;
+            memcpy(&addr_data, (char *)spaceman_buf+addr, sizeof(addr));
+            log_mesg(2, 0, 0, fs_opt.debug, "%s: bitmap addr  %llx\n", __FILE__, addr_data);
+
+            if (addr_data == 0 || addr_data > ULLONG_MAX / block_size) { // Check for zero and overflow
+                log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Malicious physical address for chunk info block: %llu.\n", __FILE__, addr_data);
+                free(cib_jobs); free(spaceman_buf);
+                fs_close();
+                return;
+            }
+            cib_jobs[job].paddr = addr_data;
+            cib_jobs[job].cnt = cnt;
+            job++;
+        }
+    }
 
-        if ((sm_offset != 0) && (cnt_count != 0)) { // Only proceed if there's actual data to process
-	    log_mesg(2, 0, 0, fs_opt.debug, "%s: check each chunk\n", __FILE__);
-
-            for (cnt = 0; cnt < cnt_count; cnt++){
-		log_mesg(2, 0, 0, fs_opt.debug, "%s: check chunk %llu\n", __FILE__, cnt);
-
-                addr = sm_offset + (uint64_t)sizeof(addr)*cnt; 
-
-                memcpy(&addr_data, (char *)spaceman_buf+addr, sizeof(addr));
-
-                log_mesg(2, 0, 0, fs_opt.debug, "%s: bitmap addr  %llx\n", __FILE__, addr_data); // use %llx for uint64_t
-
-                // Validate addr_data before pread for chunk_info_block
-                if (addr_data == 0 || addr_data > ULLONG_MAX / block_size) { // Check for zero and overflow
-                    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Malicious physical address for chunk info block: %llu.\n", __FILE__, addr_data);
-                    free(chunk_info_block_buf); free(bitmap_entry_buf);
-                    fs_close();
-                    return;
-                }
-
-                memset(chunk_info_block_buf, 0,  block_size);
-                memset(&chunk_info_block, 0, sizeof(chunk_info_block));
-                read_size = pread(APFSDEV, chunk_info_block_buf, block_size, addr_data*block_size);
-                if (read_size != block_size) {
-                    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: pread error reading chunk info block from %llu (%zd bytes, expected %u): %s\n", __FILE__, addr_data*block_size, read_size, block_size, strerror(errno));
-                    free(chunk_info_block_buf); free(bitmap_entry_buf);
-                    fs_close();
-                    return;
-                }
-                memcpy(&chunk_info_block, chunk_info_block_buf, sizeof(chunk_info_block));
-                memcpy(&obj_phys_t, chunk_info_block_buf, sizeof(obj_phys_t));
-
-                log_mesg(2, 0, 0, fs_opt.debug, "%s: chunk_info_count %x\n", __FILE__, chunk_info_block.cib_chunk_info_count);
-                log_mesg(2, 0, 0, fs_opt.debug, "%s: block type %x\n", __FILE__, obj_phys_t.o_type);
-
-                if (chunk_info_block.cib_chunk_info_count == 0 || chunk_info_block.cib_chunk_info_count > MAX_APFS_CHUNK_PER_CIB) {
-                    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero cib_chunk_info_count: %u (Max allowed: %llu).\n", __FILE__, chunk_info_block.cib_chunk_info_count, MAX_APFS_CHUNK_PER_CIB);
-                    free(chunk_info_block_buf); free(bitmap_entry_buf);
-                    fs_close();
-                    return;
-                }
-
-                if(obj_phys_t.o_type == 0x40000007ULL){ // Use ULL for constants, check against actual APFS object type defines
-
-                    log_mesg(3, 0, 0, fs_opt.debug, "%s: get addr %llx\n", __FILE__, addr_data); // use %llx for uint64_t
-                    for (chunk = 0; chunk < chunk_info_block.cib_chunk_info_count; chunk++) {
-                        if (sizeof(chunk_info_block) + chunk*(uint64_t)sizeof(chunk_info) > block_size - sizeof(chunk_info)) {
-                            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in chunk_info memcpy offset or OOB access for chunk %llu.\n", __FILE__, chunk);
-                            free(chunk_info_block_buf); free(bitmap_entry_buf);
-                            fs_close();
-                            return;
-                        }
-                        memset(&chunk_info, 0, sizeof(chunk_info));
-                        memcpy(&chunk_info, chunk_info_block_buf+(uint64_t)sizeof(chunk_info_block)+chunk*(uint64_t)sizeof(chunk_info), sizeof(chunk_info));
-                        log_mesg(2, 0, 0, fs_opt.debug, "%s: xid = %x, offset = %llx, bitTot = %llx, bit avl = %llx, block = %llx\n", __FILE__, chunk_info.ci_xid, chunk_info.ci_addr, chunk_info.ci_block_count, chunk_info.ci_free_count, chunk_info.ci_bitmap_addr ); // use %llx for uint64_t
-
-
-                                                if ((chunk_info.ci_bitmap_addr == 0) && (chunk_info.ci_free_count == blocks_per_chunk))  { // 0x8000, all free
-                                                    if (chunk_info.ci_block_count == 0 || (unsigned long long)chunk_info.ci_block_count > fs_info.totalblock) {
-                                                        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero ci_block_count: %llu.\n", __FILE__, chunk_info.ci_block_count);
-                                                        free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                                        fs_close();
-                                                        return;
-                                                    }
-                                                    for (block = 0 ; block < chunk_info.ci_block_count; block++){
-                                                        if (chunk_info.ci_addr > ULLONG_MAX - block) {
-                                                            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in block+ci_addr calculation.\n", __FILE__);
-                                                            free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                                            fs_close();
-                                                            return;
-                                                        }
-                                                        pc_clear_bit(block+chunk_info.ci_addr, bitmap, fs_info.totalblock);
-                                                    }
-                                                } else {
-                                                    if (chunk_info.ci_bitmap_addr != 0 && (chunk_info.ci_bitmap_addr > ULLONG_MAX / block_size)) {
-                                                        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Malicious physical address for bitmap entry: %llu.\n", __FILE__, chunk_info.ci_bitmap_addr);
-                                                        free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                                        fs_close();
-                                                        return;
-                                                    }                            if (chunk_info.ci_block_count == 0 || (unsigned long long)chunk_info.ci_block_count > fs_info.totalblock) {
-                                log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero ci_block_count (for pc_test_bit loop): %llu.\n", __FILE__, chunk_info.ci_block_count);
-                                free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                fs_close();
-                                return;
-                            }
-
-
-                            memset(bitmap_entry_buf, 0, block_size);
-                            read_size = pread(APFSDEV, bitmap_entry_buf, block_size, chunk_info.ci_bitmap_addr*block_size);
-                            if (read_size != block_size) {
-                                log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: pread error reading bitmap entry from %llu (%zd bytes, expected %u): %s\n", __FILE__, chunk_info.ci_bitmap_addr*block_size, read_size, block_size, strerror(errno));
-                                free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                fs_close();
-                                return;
-                            }
-
-                            for (block = 0 ; block < chunk_info.ci_block_count; block++){
-                                if (block / 8 >= block_size) {
-                                    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Block index %llu out of bounds for bitmap_entry_buf (size %u).\n", __FILE__, block, block_size);
-                                    free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                    fs_close();
-                                    return;
-                                }
-
-                                if (chunk_info.ci_addr > ULLONG_MAX - block) {
-                                    log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in block+ci_addr calculation.\n", __FILE__);
-                                    free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                    fs_close();
-                                    return;
-                                }
-
-                                if (pc_test_bit(block, (void *)bitmap_entry_buf, chunk_info.ci_block_count) == 0){
-                                    pc_clear_bit(block+chunk_info.ci_addr, bitmap, fs_info.totalblock);
-                                }
-                            }
-                        }
-    		    update_pui(&prog, chunk, chunk_info_block.cib_chunk_info_count, 0);
-                    } // end of bitmap
-                } else { // end of type check (other object type)
-                    if (spaceman.sm_blocks_per_chunk == 0 || spaceman.sm_blocks_per_chunk > MAX_APFS_TOTAL_BLOCKS) {
-                        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero spaceman.sm_blocks_per_chunk: %llu.\n", __FILE__, spaceman.sm_blocks_per_chunk);
-                        free(chunk_info_block_buf); free(bitmap_entry_buf);
-                        fs_close();
-                        return;
-                    }
-                    if (spaceman.sm_chunks_per_cib == 0 || spaceman.sm_chunks_per_cib > MAX_APFS_CHUNK_PER_CIB) {
-                        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero spaceman.sm_chunks_per_cib: %llu.\n", __FILE__, spaceman.sm_chunks_per_cib);
-                        free(chunk_info_block_buf); free(bitmap_entry_buf);
-                        fs_close();
-                        return;
-                    }
+    /// visit the chunk info blocks in disk order, each thread reads and translates whole blocks
+    qsort(cib_jobs, cib_job_count, sizeof(cib_job), compare_cib_job);
+    apfs_bitmap = bitmap;
+    apfs_totalblock = fs_info.totalblock;
+    apfs_block_size = block_size;
+    apfs_blocks_per_chunk = blocks_per_chunk;
+    next_cib = 0;
+    cib_done = 0;
+    cib_error = 0;
+
+    /// chunks only share bitmap words when a chunk is not a whole number of words
+    threads = cpus > 1 ? (cpus < CIB_THREADS_MAX ? cpus : CIB_THREADS_MAX) : 1;
+    if (blocks_per_chunk % PART_BITS_PER_LONG)
+        threads = 1;
+    if ((uint64_t)threads > cib_job_count)
+        threads = cib_job_count ? cib_job_count : 1;
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: %llu chunk info blocks, scanned with %i threads\n", __FILE__, cib_job_count, threads);
+
+    for (t = 0; t < threads; t++) {
+        if (pthread_create(&scan_threads[t], NULL, scan_cib_thread, NULL))
+            log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+    }
+    for (t = 0; t < threads; t++) {
+        if (pthread_join(scan_threads[t], NULL))
+            log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+    }
+    if (cib_error) {
+        free(cib_jobs); free(spaceman_buf);
+        fs_close();
+        return;
+    }
 
-                    for (chunk = 0; chunk < spaceman.sm_blocks_per_chunk; chunk++) {
-                        for (block = 0 ; block < spaceman.sm_chunks_per_cib; block++){
-                            if (spaceman.sm_blocks_per_chunk > ULLONG_MAX / spaceman.sm_chunks_per_cib ||
-                                spaceman.sm_blocks_per_chunk * spaceman.sm_chunks_per_cib > ULLONG_MAX / cnt ||
-                                block > ULLONG_MAX - (spaceman.sm_blocks_per_chunk * spaceman.sm_chunks_per_cib * cnt) ) {
-                                log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in bitmap_block calculation.\n", __FILE__);
-                                free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                fs_close();
-                                return;
-                            }
-                            bitmap_block = block + spaceman.sm_blocks_per_chunk*spaceman.sm_chunks_per_cib*cnt;
-                            if (bitmap_block > fs_info.totalblock){
-                                log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: bitmap_block %llu exceeds fs_info.totalblock %llu.\n", __FILE__, bitmap_block, fs_info.totalblock);
-                                free(chunk_info_block_buf); free(bitmap_entry_buf);
-                                fs_close();
-                                return;
-                            }
-                            pc_clear_bit(bitmap_block, bitmap, fs_info.totalblock);
-                        }
-                    }
-                } // end of type check
-            } // end of cnt
+    /// other object types in the array free a run of chunks_per_cib blocks
+    for (job = 0; job < cib_job_count; job++) {
+        if (!cib_jobs[job].other)
+            continue;
+        if (spaceman.sm_blocks_per_chunk == 0 || spaceman.sm_blocks_per_chunk > MAX_APFS_TOTAL_BLOCKS) {
+            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero spaceman.sm_blocks_per_chunk: %llu.\n", __FILE__, spaceman.sm_blocks_per_chunk);
+            break;
+        }
+        if (spaceman.sm_chunks_per_cib == 0 || spaceman.sm_chunks_per_cib > MAX_APFS_CHUNK_PER_CIB) {
+            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Maliciously large or zero spaceman.sm_chunks_per_cib: %llu.\n", __FILE__, spaceman.sm_chunks_per_cib);
+            break;
+        }
+        cnt = cib_jobs[job].cnt;
+        if (cnt && (uint64_t)spaceman.sm_blocks_per_chunk * spaceman.sm_chunks_per_cib > ULLONG_MAX / cnt) {
+            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: Overflow in bitmap_block calculation.\n", __FILE__);
+            break;
+        }
+        bitmap_block = (uint64_t)spaceman.sm_blocks_per_chunk * spaceman.sm_chunks_per_cib * cnt;
+        if (bitmap_block > fs_info.totalblock || spaceman.sm_chunks_per_cib > fs_info.totalblock - bitmap_block) {
+            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: bitmap_block %llu exceeds fs_info.totalblock %llu.\n", __FILE__, bitmap_block + spaceman.sm_chunks_per_cib, fs_info.totalblock);
+            break;
         }
+        pc_clear_range(bitmap_block, spaceman.sm_chunks_per_cib, bitmap, fs_info.totalblock);
     }
-    free(bitmap_entry_buf);
-    free(chunk_info_block_buf);
+    free(cib_jobs);
+    cib_jobs = NULL;
     free(spaceman_buf);
 
     fs_close();
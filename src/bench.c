@@ -0,0 +1,493 @@
+/**
+ * The part of partclone
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * Microbenchmarks of the checksum, bitmap and io primitives, run by
+ * "make bench". Every case is repeated for --time seconds and reported in
+ * MB/s, ns and TSC cycles per byte (or per block for the bitmap scans), to
+ * pick the -k and -z defaults of a machine. crc32 and io_all are swept over
+ * the -z buffer sizes, the checksum cases over the -k blocks per checksum of
+ * --block-size each.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <features.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#include "partclone.h"
+#include "checksum.h"
+
+/// cmd_opt structure defined in partclone.h
+cmd_opt opt;
+
+#define OPT_BLOCK_SIZE 1006
+#define BENCH_LIST_MAX 16
+#define BENCH_BITMAP_BLOCKS (1ULL << 24)
+#define BENCH_IO_FILE_SIZE (64ULL << 20)
+
+static double min_time = 0.2;
+static unsigned int block_size = 4096;
+static unsigned long long sizes[BENCH_LIST_MAX] = { 4096, 65536, 1048576, 4194304 };
+static int sizes_n = 4;
+static unsigned long long ks[BENCH_LIST_MAX] = { 1, 16, 64, 256, 1024 };
+static int ks_n = 5;
+static const char *only = "crc32,checksum,bitmap,load_bitmap,io";
+static const char *dir = NULL;
+
+void bench_usage(void) {
+	fprintf(stderr, "partclone v%s http://partclone.org\n"
+	                "Usage: partclone.bench [OPTIONS]\n"
+	                "\n"
+		"    -t,  --time SECONDS          Run each case for SECONDS (default: 0.2)\n"
+		"    -z,  --buffer_size LIST      Buffer sizes of crc32 and io_all (default: 4K,64K,1M,4M)\n"
+		"    -k,  --blocks_per_checksum LIST  Blocks per checksum (default: 1,16,64,256,1024)\n"
+		"         --block-size SIZE       Block size of the checksum cases (default: 4096)\n"
+		"    -n,  --only LIST             Run only these of crc32,checksum,bitmap,load_bitmap,io\n"
+		"    -D,  --dir DIR               Directory of the io_all file (default: /dev/shm or .)\n"
+		"    -L,  --logfile FILE          Log FILE (default: /dev/null)\n"
+		"    -v,  --version               Display partclone version\n"
+		"    -h,  --help                  Display this help\n"
+		, VERSION);
+	exit(1);
+}
+
+/// parse a comma separated list of sizes with an optional K, M or G suffix into @list, returns the count
+static int parse_list(const char *arg, unsigned long long *list) {
+
+	char *copy = strdup(arg), *tok, *end, *save = NULL;
+	int n = 0, shift;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < BENCH_LIST_MAX; tok = strtok_r(NULL, ",", &save)) {
+		list[n] = strtoull(tok, &end, 0);
+		switch (*end) {
+		case 'K': case 'k': shift = 10; end++; break;
+		case 'M': case 'm': shift = 20; end++; break;
+		case 'G': case 'g': shift = 30; end++; break;
+		default: shift = 0; break;
+		}
+		if (end == tok || *end != '\0' || *tok == '-' || list[n] == 0 || list[n] > (ULLONG_MAX >> shift)) {
+			fprintf(stderr, "Bad value '%s' in '%s'.\n", tok, arg);
+			bench_usage();
+		}
+		list[n++] <<= shift;
+	}
+	free(copy);
+	if (n == 0)
+		bench_usage();
+	return n;
+}
+
+void bench_options(int argc, char **argv) {
+
+	static const char *sopt = "-hvt:z:k:n:D:L:";
+	static const struct option lopt[] = {
+		{ "help",		no_argument,		NULL,	'h' },
+		{ "version",		no_argument,		NULL,	'v' },
+		{ "time",		required_argument,	NULL,	't' },
+		{ "buffer_size",	required_argument,	NULL,	'z' },
+		{ "blocks_per_checksum", required_argument,	NULL,	'k' },
+		{ "block-size",		required_argument,	NULL,	OPT_BLOCK_SIZE },
+		{ "only",		required_argument,	NULL,	'n' },
+		{ "dir",		required_argument,	NULL,	'D' },
+		{ "logfile",		required_argument,	NULL,	'L' },
+		{ NULL,			0,			NULL,	0 }
+	};
+	int c;
+
+	memset(&opt, 0, sizeof(cmd_opt));
+	opt.logfile = "/dev/null";
+	opt.buffer_size = DEFAULT_BUFFER_SIZE;
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 'v':
+			print_version();
+			break;
+		case 't':
+			min_time = atof(optarg);
+			if (min_time <= 0)
+				bench_usage();
+			break;
+		case 'z':
+			sizes_n = parse_list(optarg, sizes);
+			break;
+		case 'k':
+			ks_n = parse_list(optarg, ks);
+			break;
+		case OPT_BLOCK_SIZE:
+			block_size = atol(optarg);
+			if (block_size < 512)
+				bench_usage();
+			break;
+		case 'n':
+			only = optarg;
+			break;
+		case 'D':
+			dir = optarg;
+			break;
+		case 'L':
+			opt.logfile = optarg;
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	if (!dir)
+		dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : ".";
+}
+
+static int selected(const char *name) {
+
+	size_t len = strlen(name);
+	const char *p = only;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == only || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+/**
+ * The clocks of one case: the wall time in ns and, on x86, the TSC cycles.
+ * The TSC runs at a fixed rate on current CPUs, its cycles are those of the
+ * nominal frequency and not of the turbo one.
+ */
+typedef struct {
+	struct timespec ts;
+	unsigned long long tsc;
+} bench_clock;
+
+static void clock_now(bench_clock *c) {
+	clock_gettime(CLOCK_MONOTONIC, &c->ts);
+#ifdef HAVE_TSC
+	c->tsc = __rdtsc();
+#else
+	c->tsc = 0;
+#endif
+}
+
+static double elapsed_ns(const bench_clock *a, const bench_clock *b) {
+	return (b->ts.tv_sec - a->ts.tv_sec) * 1e9 + (b->ts.tv_nsec - a->ts.tv_nsec);
+}
+
+static void report_head(void) {
+	printf("%-12s %-22s %10s %6s %10s %10s %12s %s\n",
+	       "case", "impl", "size", "k", "MB/s", "ns", "cycles", "per");
+}
+
+/// print one case, @units is what ns and cycles are divided by, @bytes the MB/s
+static void report(const char *name, const char *impl, unsigned long long size, const char *k,
+		   const bench_clock *a, const bench_clock *b, unsigned long long units, unsigned long long bytes, const char *unit) {
+
+	double ns = elapsed_ns(a, b);
+	char cycles[32] = "-";
+
+#ifdef HAVE_TSC
+	snprintf(cycles, sizeof(cycles), "%.3f", (double)(b->tsc - a->tsc) / units);
+#endif
+	printf("%-12s %-22s %10llu %6s %10.1f %10.3f %12s %s\n",
+	       name, impl, size, k, ns > 0 ? bytes * 1e3 / ns : 0, ns / units, cycles, unit);
+	log_mesg(0, 0, 0, 0, "bench %s %s size %llu k %s: %.1f MB/s %.3f ns/%s %s cycles/%s\n",
+		 name, impl, size, k, ns > 0 ? bytes * 1e3 / ns : 0, ns / units, unit, cycles, unit);
+}
+
+/// keep the results alive so the loops are not optimized out
+static volatile unsigned long long sink;
+
+static const char *crc32_impl(void) {
+#ifdef HAVE_ISAL
+	return "isal-crc32_gzip_refl";
+#else
+	return "table";
+#endif
+}
+
+static void print_impl(void) {
+
+	printf("partclone.bench v%s\n", VERSION);
+	printf("crc32:    %s\n", crc32_impl());
+#ifdef HAVE_XXHASH
+	printf("xxhash:   libxxhash %u.%u.%u\n", XXH_versionNumber() / 10000,
+	       XXH_versionNumber() / 100 % 100, XXH_versionNumber() % 100);
+#else
+	printf("xxhash:   not built\n");
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	printf("cpu:     %s%s%s%s%s\n",
+	       __builtin_cpu_supports("sse4.2") ? " sse4.2" : "",
+	       __builtin_cpu_supports("pclmul") ? " pclmul" : "",
+	       __builtin_cpu_supports("avx2") ? " avx2" : "",
+	       __builtin_cpu_supports("avx512f") ? " avx512f" : "",
+	       __builtin_cpu_supports("vpclmulqdq") ? " vpclmulqdq" : "");
+	printf("cycles:   TSC\n");
+#else
+	printf("cycles:   not available, ns only\n");
+#endif
+	printf("\n");
+}
+
+static char *alloc_buffer(unsigned long long size) {
+
+	char *buf = NULL;
+	unsigned long long i;
+
+	if (posix_memalign((void **)&buf, 4096, size))
+		log_mesg(0, 1, 1, 0, "%s, %i, not enough memory\n", __func__, __LINE__);
+	srand(1);
+	for (i = 0; i < size; i++)
+		buf[i] = rand();
+	return buf;
+}
+
+static void bench_crc32(void) {
+
+	int i;
+
+	for (i = 0; i < sizes_n; i++) {
+		char *buf = alloc_buffer(sizes[i]);
+		unsigned long long n = 0;
+		uint32_t seed;
+		bench_clock a, b;
+
+		init_crc32(&seed);
+		clock_now(&a);
+		do {
+			seed = crc32(seed, buf, sizes[i]);
+			n++;
+			clock_now(&b);
+		} while (elapsed_ns(&a, &b) < min_time * 1e9);
+		sink += seed;
+		report("crc32", crc32_impl(), sizes[i], "-", &a, &b, n * sizes[i], n * sizes[i], "B");
+		free(buf);
+	}
+}
+
+/**
+ * The image checksum as the clone loop does it: one update per block and a
+ * finalize and reseed every k blocks.
+ */
+static void bench_checksum(void) {
+
+	static const int modes[] = {
+		CSM_CRC32,
+#ifdef HAVE_XXHASH
+		CSM_XXH64, CSM_XXH128,
+#endif
+	};
+	unsigned char checksum[32];
+	char k_str[16];
+	int m, i;
+	unsigned long long j;
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		const char *impl = modes[m] == CSM_CRC32 ? crc32_impl() : "libxxhash";
+
+		for (i = 0; i < ks_n; i++) {
+			unsigned long long bytes = ks[i] * block_size;
+			char *buf = alloc_buffer(bytes);
+			unsigned long long n = 0;
+			bench_clock a, b;
+
+			snprintf(k_str, sizeof(k_str), "%llu", ks[i]);
+			init_checksum(modes[m], checksum, 0);
+			clock_now(&a);
+			do {
+				for (j = 0; j < ks[i]; j++)
+					update_checksum(checksum, buf + j * block_size, block_size);
+				finalize_checksum(checksum);
+				init_checksum(modes[m], checksum, 0);
+				n++;
+				clock_now(&b);
+			} while (elapsed_ns(&a, &b) < min_time * 1e9);
+			sink += checksum[0];
+			report(get_checksum_str(modes[m]), impl, block_size, k_str, &a, &b, n * bytes, n * bytes, "B");
+			free(buf);
+		}
+	}
+	release_checksum();
+}
+
+/// a bitmap of runs of 1 to 64 used and free blocks
+static unsigned long *make_bitmap(unsigned long long total) {
+
+	unsigned long *bitmap = pc_alloc_bitmap(total);
+	unsigned long long nr = 0, run;
+	int used = 1;
+
+	if (!bitmap)
+		log_mesg(0, 1, 1, 0, "%s, %i, not enough memory\n", __func__, __LINE__);
+	pc_init_bitmap(bitmap, 0, total);
+	srand(1);
+	while (nr < total) {
+		run = 1 + rand() % 64;
+		if (run > total - nr)
+			run = total - nr;
+		if (used)
+			pc_set_range(nr, run, bitmap, total);
+		nr += run;
+		used = !used;
+	}
+	return bitmap;
+}
+
+/// the bitmap scans of the copy loops, a bit at a time and a word at a time
+static void bench_bitmap(void) {
+
+	const unsigned long long total = BENCH_BITMAP_BLOCKS;
+	unsigned long *bitmap = make_bitmap(total);
+	unsigned long long n, nr, used;
+	bench_clock a, b;
+
+	n = 0;
+	clock_now(&a);
+	do {
+		used = 0;
+		for (nr = 0; nr < total; nr++)
+			used += pc_test_bit(nr, bitmap, total);
+		sink += used;
+		n++;
+		clock_now(&b);
+	} while (elapsed_ns(&a, &b) < min_time * 1e9);
+	report("test_bit", "bit", total, "-", &a, &b, n * total, n * total / 8, "blk");
+
+	n = 0;
+	clock_now(&a);
+	do {
+		sink += pc_count_bits(0, total, bitmap, total);
+		n++;
+		clock_now(&b);
+	} while (elapsed_ns(&a, &b) < min_time * 1e9);
+	report("count_bits", "word", total, "-", &a, &b, n * total, n * total / 8, "blk");
+
+	free(bitmap);
+}
+
+/// open a temporary file in --dir, removed at once
+static int bench_tmpfile(void) {
+
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/partclone.bench.XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0)
+		log_mesg(0, 1, 1, 0, "bench: can't create %s: %s\n", path, strerror(errno));
+	unlink(path);
+	return fd;
+}
+
+/// the byte bitmap of image format v1 and v2 into the bit bitmap of restore
+static void bench_load_bitmap(void) {
+
+	const unsigned long long total = BENCH_BITMAP_BLOCKS;
+	unsigned long *bitmap = make_bitmap(total);
+	file_system_info fs_info;
+	unsigned long long nr, n = 0;
+	char *bytes = malloc(total);
+	int fd = bench_tmpfile();
+	bench_clock a, b;
+
+	if (!bytes)
+		log_mesg(0, 1, 1, 0, "%s, %i, not enough memory\n", __func__, __LINE__);
+	memset(&fs_info, 0, sizeof(fs_info));
+	fs_info.totalblock = total;
+	fs_info.block_size = block_size;
+	for (nr = 0; nr < total; nr++)
+		bytes[nr] = pc_test_bit(nr, bitmap, total);
+	if (write_all(&fd, bytes, total, &opt) != total ||
+	    write_all(&fd, BIT_MAGIC, BIT_MAGIC_SIZE, &opt) != BIT_MAGIC_SIZE)
+		log_mesg(0, 1, 1, 0, "bench: write bitmap error: %s\n", strerror(errno));
+	free(bytes);
+
+	clock_now(&a);
+	do {
+		lseek(fd, 0, SEEK_SET);
+		load_image_bitmap_bytes(&fd, opt, fs_info, bitmap);
+		n++;
+		clock_now(&b);
+	} while (elapsed_ns(&a, &b) < min_time * 1e9);
+	report("load_bitmap", "bytes", total, "-", &a, &b, n * total, n * total, "blk");
+
+	close(fd);
+	free(bitmap);
+}
+
+/// io_all() reads and writes of a file of the page cache, or tmpfs, in -z chunks
+static void bench_io(void) {
+
+	const unsigned long long file_size = BENCH_IO_FILE_SIZE;
+	int fd = bench_tmpfile();
+	int i, do_write;
+
+	for (i = 0; i < sizes_n; i++) {
+		unsigned long long size = sizes[i] < file_size ? sizes[i] : file_size;
+		unsigned long long chunks = file_size / size;
+		char *buf = alloc_buffer(size);
+
+		for (do_write = 1; do_write >= 0; do_write--) {
+			unsigned long long n = 0, c;
+			bench_clock a, b;
+
+			clock_now(&a);
+			do {
+				lseek(fd, 0, SEEK_SET);
+				for (c = 0; c < chunks; c++)
+					if (io_all(&fd, buf, size, do_write, &opt) != size)
+						log_mesg(0, 1, 1, 0, "bench: io_all error: %s\n", strerror(errno));
+				n++;
+				clock_now(&b);
+			} while (elapsed_ns(&a, &b) < min_time * 1e9);
+			report(do_write ? "io_write" : "io_read", dir, size, "-", &a, &b,
+			       n * chunks * size, n * chunks * size, "B");
+		}
+		free(buf);
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv) {
+
+	bench_options(argc, argv);
+	open_log(opt.logfile);
+
+	print_impl();
+	report_head();
+	if (selected("crc32"))
+		bench_crc32();
+	if (selected("checksum"))
+		bench_checksum();
+	if (selected("bitmap"))
+		bench_bitmap();
+	if (selected("load_bitmap"))
+		bench_load_bitmap();
+	if (selected("io"))
+		bench_io();
+
+	close_log();
+	return 0;
+}
@@ -74,6 +74,22 @@ pc_clear_bit(unsigned long int nr, unsigned long *bitmap,
 	bitmap[offset] &= ~(1UL << bit);
 }
 
+/// pc_set_bit() for bitmaps that several threads mark at the same time
+static inline void
+pc_set_bit_atomic(unsigned long int nr, unsigned long *bitmap,
+		  unsigned long long total)
+{
+	if (!bitmap)
+		return;
+	if (nr >= total){
+	    printf("set block %lu out of boundary(%llu)\n", nr, total);
+		exit(1);
+	}
+	unsigned long offset = nr / PART_BITS_PER_LONG;
+	unsigned long bit = nr & (PART_BITS_PER_LONG - 1);
+	__atomic_fetch_or(&bitmap[offset], 1UL << bit, __ATOMIC_RELAXED);
+}
+
 static inline unsigned long* pc_alloc_bitmap(unsigned long bits)
 {
 	unsigned long long num_longs = pc_BITS_TO_LONGS(bits);
@@ -93,3 +109,244 @@ static inline void pc_init_bitmap(unsigned long* bitmap, char value, unsigned lo
 
 	memset(bitmap, value, byte_count);
 }
+
+/*
+ * Set the @count bits starting at @nr. Whole words are filled at once, only
+ * the first and the last word of the range are masked.
+ */
+static inline void
+pc_set_range(unsigned long long nr, unsigned long long count, unsigned long *bitmap,
+	     unsigned long long total)
+{
+	if (!bitmap || !count)
+		return;
+	if (nr >= total || count > total - nr){
+	    printf("set range %llu+%llu out of boundary(%llu)\n", nr, count, total);
+		exit(1);
+	}
+	unsigned long long end = nr + count;
+	unsigned long long first = nr / PART_BITS_PER_LONG;
+	unsigned long long last = (end - 1) / PART_BITS_PER_LONG;
+	unsigned long head = ~0UL << (nr & (PART_BITS_PER_LONG - 1));
+	unsigned long tail = ~0UL >> ((PART_BITS_PER_LONG - (end & (PART_BITS_PER_LONG - 1))) & (PART_BITS_PER_LONG - 1));
+
+	if (first == last) {
+		bitmap[first] |= head & tail;
+		return;
+	}
+	bitmap[first] |= head;
+	if (last > first + 1)
+		memset(&bitmap[first + 1], 0xFF, (last - first - 1) * PART_BYTES_PER_LONG);
+	bitmap[last] |= tail;
+}
+
+/*
+ * Clear the @count bits starting at @nr, the counterpart of pc_set_range().
+ */
+static inline void
+pc_clear_range(unsigned long long nr, unsigned long long count, unsigned long *bitmap,
+	       unsigned long long total)
+{
+	if (!bitmap || !count)
+		return;
+	if (nr >= total || count > total - nr){
+	    printf("clear range %llu+%llu out of boundary(%llu)\n", nr, count, total);
+		exit(1);
+	}
+	unsigned long long end = nr + count;
+	unsigned long long first = nr / PART_BITS_PER_LONG;
+	unsigned long long last = (end - 1) / PART_BITS_PER_LONG;
+	unsigned long head = ~0UL << (nr & (PART_BITS_PER_LONG - 1));
+	unsigned long tail = ~0UL >> ((PART_BITS_PER_LONG - (end & (PART_BITS_PER_LONG - 1))) & (PART_BITS_PER_LONG - 1));
+
+	if (first == last) {
+		bitmap[first] &= ~(head & tail);
+		return;
+	}
+	bitmap[first] &= ~head;
+	if (last > first + 1)
+		memset(&bitmap[first + 1], 0x00, (last - first - 1) * PART_BYTES_PER_LONG);
+	bitmap[last] &= ~tail;
+}
+
+/*
+ * Write the @n low bits of @word at bit @nr, @n is at most one word. The
+ * bits may straddle two words of @bitmap, the caller checks the bounds.
+ */
+static inline void
+pc_put_bits(unsigned long long nr, unsigned long word, unsigned int n, unsigned long *bitmap)
+{
+	unsigned long long w = nr / PART_BITS_PER_LONG;
+	unsigned int s = nr & (PART_BITS_PER_LONG - 1);
+	unsigned long mask = n < PART_BITS_PER_LONG ? (1UL << n) - 1 : ~0UL;
+
+	word &= mask;
+	bitmap[w] = (bitmap[w] & ~(mask << s)) | (word << s);
+	if (s && s + n > PART_BITS_PER_LONG)
+		bitmap[w + 1] = (bitmap[w + 1] & ~(mask >> (PART_BITS_PER_LONG - s))) |
+			(word >> (PART_BITS_PER_LONG - s));
+}
+
+/*
+ * Load @bytes (at most one word) of a little endian byte bitmap, the first
+ * byte ends up in the low bits.
+ */
+static inline unsigned long
+pc_load_le(const unsigned char *src, unsigned int bytes)
+{
+	unsigned long word = 0;
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		word |= (unsigned long)src[i] << (i * PART_BITS_PER_BYTE);
+	return word;
+}
+
+/// source bit flags of pc_import_bits()
+#define PC_BITS_INVERT    0x1	/// a set bit marks a free block, like the UFS free maps
+#define PC_BITS_MSB_FIRST 0x2	/// bit i is bit (7 - i % 8) of byte (i / 8)
+
+/*
+ * Reverse the order of the bits inside each byte of @word.
+ */
+static inline unsigned long
+pc_reverse_byte_bits(unsigned long word)
+{
+	word = ((word >> 1) & (~0UL / 3)) | ((word & (~0UL / 3)) << 1);
+	word = ((word >> 2) & (~0UL / 5)) | ((word & (~0UL / 5)) << 2);
+	word = ((word >> 4) & (~0UL / 17)) | ((word & (~0UL / 17)) << 4);
+	return word;
+}
+
+/*
+ * Import @count bits of the native allocation bitmap @src to the bits
+ * starting at @nr, one word at a time. @src is a byte bitmap, bit i is bit
+ * (i % 8) of byte (i / 8) unless @flags has PC_BITS_MSB_FIRST, and a set bit
+ * marks a used block unless @flags has PC_BITS_INVERT. Returns how many of
+ * the imported blocks are used.
+ */
+static inline unsigned long long
+pc_import_bits(unsigned long long nr, const unsigned char *src, unsigned long long count,
+	       unsigned int flags, unsigned long *bitmap, unsigned long long total)
+{
+	unsigned long long done, used = 0;
+
+	if (!bitmap || !count)
+		return 0;
+	if (nr >= total || count > total - nr){
+	    printf("copy range %llu+%llu out of boundary(%llu)\n", nr, count, total);
+		exit(1);
+	}
+	for (done = 0; done < count; done += PART_BITS_PER_LONG) {
+		unsigned int n = count - done < PART_BITS_PER_LONG ? count - done : PART_BITS_PER_LONG;
+		unsigned long word = pc_load_le(src + done / PART_BITS_PER_BYTE,
+			(n + PART_BITS_PER_BYTE - 1) / PART_BITS_PER_BYTE);
+
+		if (flags & PC_BITS_MSB_FIRST)
+			word = pc_reverse_byte_bits(word);
+		if (flags & PC_BITS_INVERT)
+			word = ~word;
+		if (n < PART_BITS_PER_LONG)
+			word &= (1UL << n) - 1;
+		used += __builtin_popcountl(word);
+		pc_put_bits(nr + done, word, n, bitmap);
+	}
+	return used;
+}
+
+/*
+ * Copy @count bits of @src to the bits starting at @nr, one word at a time.
+ * @src is a little endian byte bitmap, bit i is bit (i % 8) of byte (i / 8),
+ * like the on-disk bitmaps of ext2/3/4 and NTFS. Returns how many of the
+ * copied bits are set.
+ */
+static inline unsigned long long
+pc_copy_bits_le(unsigned long long nr, const unsigned char *src, unsigned long long count,
+		unsigned long *bitmap, unsigned long long total)
+{
+	return pc_import_bits(nr, src, count, 0, bitmap, total);
+}
+
+/*
+ * Like pc_import_bits() for a bitmap of clusters: each of the @count bits
+ * of @src covers 1 << @shift bits starting at @nr. Words of @src that are
+ * all set or all clear become one range, the others are spread bit by bit.
+ * Bits past @total are dropped. Returns how many bits are set.
+ */
+static inline unsigned long long
+pc_spread_bits(unsigned long long nr, const unsigned char *src, unsigned long long count,
+	       unsigned int shift, unsigned int flags, unsigned long *bitmap, unsigned long long total)
+{
+	unsigned long long c, used = 0;
+
+	if (!bitmap)
+		return 0;
+	for (c = 0; c < count && nr + (c << shift) < total; c += PART_BITS_PER_LONG) {
+		unsigned int i, n = count - c < PART_BITS_PER_LONG ? count - c : PART_BITS_PER_LONG;
+		unsigned long full = n < PART_BITS_PER_LONG ? (1UL << n) - 1 : ~0UL;
+		unsigned long word = pc_load_le(src + c / PART_BITS_PER_BYTE,
+			(n + PART_BITS_PER_BYTE - 1) / PART_BITS_PER_BYTE);
+
+		if (flags & PC_BITS_MSB_FIRST)
+			word = pc_reverse_byte_bits(word);
+		if (flags & PC_BITS_INVERT)
+			word = ~word;
+		word &= full;
+		for (i = 0; i < n; i++) {
+			/// a uniform word is a single run
+			unsigned int run = (word == 0 || word == full) ? n : 1;
+			unsigned long long start = nr + ((c + i) << shift);
+			unsigned long long len = (unsigned long long)run << shift;
+
+			if (start >= total)
+				break;
+			if (len > total - start)
+				len = total - start;
+			if ((word >> i) & 1) {
+				pc_set_range(start, len, bitmap, total);
+				used += len;
+			} else
+				pc_clear_range(start, len, bitmap, total);
+			i += run - 1;
+		}
+	}
+	return used;
+}
+
+/*
+ * pc_spread_bits() of a little endian byte bitmap, like the ext4 bigalloc
+ * cluster bitmaps.
+ */
+static inline unsigned long long
+pc_spread_bits_le(unsigned long long nr, const unsigned char *src, unsigned long long count,
+		  unsigned int shift, unsigned long *bitmap, unsigned long long total)
+{
+	return pc_spread_bits(nr, src, count, shift, 0, bitmap, total);
+}
+
+/*
+ * Count the set bits among the @count bits starting at @nr, a word at a time.
+ */
+static inline unsigned long long
+pc_count_bits(unsigned long long nr, unsigned long long count, const unsigned long *bitmap,
+	      unsigned long long total)
+{
+	if (!bitmap || !count)
+		return 0;
+	if (nr >= total || count > total - nr){
+	    printf("count range %llu+%llu out of boundary(%llu)\n", nr, count, total);
+		exit(1);
+	}
+	unsigned long long end = nr + count, used = 0, w;
+	unsigned long long first = nr / PART_BITS_PER_LONG;
+	unsigned long long last = (end - 1) / PART_BITS_PER_LONG;
+	unsigned long head = ~0UL << (nr & (PART_BITS_PER_LONG - 1));
+	unsigned long tail = ~0UL >> ((PART_BITS_PER_LONG - (end & (PART_BITS_PER_LONG - 1))) & (PART_BITS_PER_LONG - 1));
+
+	if (first == last)
+		return __builtin_popcountl(bitmap[first] & head & tail);
+	used = __builtin_popcountl(bitmap[first] & head) + __builtin_popcountl(bitmap[last] & tail);
+	for (w = first + 1; w < last; w++)
+		used += __builtin_popcountl(bitmap[w]);
+	return used;
+}
@@ -25,6 +25,7 @@
 #include "btrfs/kernel-shared/ctree.h"
 #include "btrfs/kernel-shared/volumes.h"
 #include "btrfs/kernel-shared/disk-io.h"
+#include "btrfs/kernel-shared/free-space-tree.h"
 #include "btrfs/common/extent-cache.h"
 #include "kernel-shared/tree-checker.h"
 #include "btrfs/common/utils.h"
@@ -43,9 +44,12 @@ int block_size = 0;
 uint64_t dev_size = 0;
 unsigned long long total_block = 0;
 
+/// interior tree blocks already walked, snapshots share whole subtrees. A leaf
+/// is cheap to walk again and there are far more of them, so they aren't kept.
+static struct cache_tree visited;
+
 ///set useb block
 static void set_bitmap(unsigned long* bitmap, uint64_t pos, uint64_t length){
-    uint64_t block;
     uint64_t pos_block;
     uint64_t block_end;
 
@@ -61,13 +65,14 @@ static void set_bitmap(unsigned long* bitmap, uint64_t pos, uint64_t length){
     block_end = (pos+length)/block_size;
     if ((pos+length)%block_size > 0)
 	block_end++;
+    /// the tail of the device past the last whole block is not in the bitmap
+    if (block_end > total_block)
+	block_end = total_block;
+    if (pos_block >= block_end)
+	return;
 
     log_mesg(3, 0, 0, fs_opt.debug, "%s: block offset: %llu block count: %llu\n",__FILE__,  pos_block, block_end);
-
-    for(block = pos_block; block < block_end; block++){
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block %i is used\n",__FILE__,  block);
-	pc_set_bit(block, bitmap, total_block);
-    }
+    pc_set_range(pos_block, block_end - pos_block, bitmap, total_block);
 }
 
 
@@ -149,6 +154,153 @@ int check_extent_bitmap(unsigned long* bitmap, u64 bytenr, u64 *num_bytes, int t
     return 0;
 }
 
+/**
+ * Free space tree fast path
+ *
+ * When the free space tree is valid, the used space of a block group is its
+ * range minus the free extents and bitmaps the tree lists for it. That is a
+ * few items per block group instead of every tree of every snapshot.
+ */
+
+/// mark every copy of the logical range [logical, logical + len)
+static void mark_logical_range(unsigned long* bitmap, u64 logical, u64 len)
+{
+    struct btrfs_multi_bio *multi = NULL;
+    int num_copies;
+    int mirror;
+    u64 length, step;
+
+    if (!len)
+	return;
+    num_copies = get_num_copies(info, logical, len);
+    while (len) {
+	/// striped profiles map one stripe at a time
+	step = len;
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+	    length = len;
+	    if (btrfs_map_block(info, READ, logical, &length, &multi, mirror, NULL)) {
+		log_mesg(1, 0, 0, fs_opt.debug, "%s: Couldn't map the block %llu mirror %d\n", __FILE__, logical, mirror);
+		continue;
+	    }
+	    if (length > len)
+		length = len;
+	    if (length < step)
+		step = length;
+	    set_bitmap(bitmap, multi->stripes[0].physical, length);
+	    free(multi);
+	    multi = NULL;
+	}
+	logical += step;
+	len -= step;
+    }
+}
+
+/// mark the used part of one block group, returns 0 on success
+static int read_block_group_free_space(unsigned long* bitmap, struct btrfs_block_group *bg)
+{
+    struct btrfs_root *fst_root;
+    struct btrfs_path fst_path = { 0 };
+    struct btrfs_key key;
+    struct extent_buffer *leaf;
+    u8 map[BTRFS_FREE_SPACE_BITMAP_SIZE];
+    u32 sectorsize = info->sectorsize;
+    u64 end = bg->start + bg->length;
+    u64 cursor = bg->start;
+    u64 bits, i, pos;
+    int ret;
+
+    key.objectid = BTRFS_FREE_SPACE_TREE_OBJECTID;
+    key.type = BTRFS_ROOT_ITEM_KEY;
+    key.offset = btrfs_fs_incompat(info, EXTENT_TREE_V2) ? bg->global_root_id : 0;
+    fst_root = btrfs_global_root(info, &key);
+    if (!fst_root)
+	return -ENOENT;
+
+    key.objectid = bg->start;
+    key.type = BTRFS_FREE_SPACE_INFO_KEY;
+    key.offset = bg->length;
+    ret = btrfs_search_slot(NULL, fst_root, &key, &fst_path, 0, 0);
+    if (ret) {
+	log_mesg(1, 0, 0, fs_opt.debug, "%s: no free space info for block group %llu\n", __FILE__, bg->start);
+	btrfs_release_path(&fst_path);
+	return ret < 0 ? ret : -ENOENT;
+    }
+
+    while (1) {
+	ret = btrfs_next_item(fst_root, &fst_path);
+	if (ret < 0)
+	    goto out;
+	if (ret > 0)
+	    break;
+	leaf = fst_path.nodes[0];
+	btrfs_item_key_to_cpu(leaf, &key, fst_path.slots[0]);
+	if (key.objectid >= end)
+	    break;
+	if (key.type != BTRFS_FREE_SPACE_EXTENT_KEY && key.type != BTRFS_FREE_SPACE_BITMAP_KEY)
+	    continue;
+	if (key.objectid < cursor || key.offset > end - key.objectid) {
+	    log_mesg(1, 0, 0, fs_opt.debug, "%s: free space %llu+%llu out of order in block group %llu\n", __FILE__, key.objectid, key.offset, bg->start);
+	    ret = -EUCLEAN;
+	    goto out;
+	}
+
+	if (key.type == BTRFS_FREE_SPACE_EXTENT_KEY) {
+	    mark_logical_range(bitmap, cursor, key.objectid - cursor);
+	    cursor = key.objectid + key.offset;
+	    continue;
+	}
+
+	/// one bit per sector, set when the sector is free
+	bits = key.offset / sectorsize;
+	if (bits > BTRFS_FREE_SPACE_BITMAP_BITS || btrfs_item_size(leaf, fst_path.slots[0]) < DIV_ROUND_UP(bits, 8)) {
+	    log_mesg(1, 0, 0, fs_opt.debug, "%s: bad free space bitmap at %llu\n", __FILE__, key.objectid);
+	    ret = -EUCLEAN;
+	    goto out;
+	}
+	read_extent_buffer(leaf, map, btrfs_item_ptr_offset(leaf, fst_path.slots[0]), DIV_ROUND_UP(bits, 8));
+	for (i = 0; i < bits; i++) {
+	    if (!(map[i / 8] & (1 << (i % 8))))
+		continue;
+	    pos = key.objectid + i * sectorsize;
+	    mark_logical_range(bitmap, cursor, pos - cursor);
+	    cursor = pos + sectorsize;
+	}
+	if (cursor < key.objectid + key.offset) {
+	    mark_logical_range(bitmap, cursor, key.objectid + key.offset - cursor);
+	    cursor = key.objectid + key.offset;
+	}
+    }
+    mark_logical_range(bitmap, cursor, end - cursor);
+    ret = 0;
+out:
+    btrfs_release_path(&fst_path);
+    return ret;
+}
+
+/// build the bitmap from the block groups and the free space tree, returns 0 on success
+static int read_bitmap_free_space_tree(unsigned long* bitmap)
+{
+    struct btrfs_block_group *bg;
+    u64 next = 0;
+    u64 groups = 0;
+
+    if (!btrfs_fs_compat_ro(info, FREE_SPACE_TREE) ||
+	    !btrfs_fs_compat_ro(info, FREE_SPACE_TREE_VALID))
+	return -EOPNOTSUPP;
+
+    while ((bg = btrfs_lookup_first_block_group(info, next)) != NULL) {
+	if (read_block_group_free_space(bitmap, bg))
+	    return -EUCLEAN;
+	next = bg->start + bg->length;
+	groups++;
+    }
+    if (!groups)
+	return -ENOENT;
+
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: bitmap of %llu block groups read from the free space tree\n", __FILE__, groups);
+    return 0;
+}
+
 static void dump_file_extent_item(unsigned long* bitmap, struct extent_buffer *eb,
 				   int slot,
 				   struct btrfs_file_extent_item *fi)
@@ -268,11 +420,12 @@ void dump_start_leaf(unsigned long* bitmap, struct btrfs_root *root, struct exte
         return;
     }
 
+    size = (u64)root->fs_info->nodesize;
+    bytenr = (unsigned long long)btrfs_header_bytenr(eb);
+    check_extent_bitmap(bitmap, bytenr, &size, 0);
+
     if (btrfs_is_leaf(eb)) {
-	size = (u64)root->fs_info->nodesize;
 	log_mesg(3, 0, 0, fs_opt.debug, "%s: DUMP: leaf %llu\n", __FILE__, (unsigned long long)btrfs_header_bytenr(eb));
-	bytenr = (unsigned long long)btrfs_header_bytenr(eb);
-	check_extent_bitmap(bitmap, bytenr, &size, 0);
 	for (i = 0 ; i < nr ; i++) {
 	    btrfs_item_key(eb, &disk_key, i);
 	    type = btrfs_disk_key_type(&disk_key);
@@ -313,17 +466,19 @@ void dump_start_leaf(unsigned long* bitmap, struct btrfs_root *root, struct exte
     log_mesg(3, 0, 0, fs_opt.debug, "%s: follow %i\n", __FILE__, follow);
     for (i = 0; i < nr; i++) {
 	log_mesg(3, 0, 0, fs_opt.debug, "%s: follow %i\n", __FILE__, follow);
-	bytenr = (unsigned long long)btrfs_header_bytenr(eb);
-	check_extent_bitmap(bitmap, bytenr, &size, 0);
+	bytenr = btrfs_node_blockptr(eb, i);
+	/// a node reached from another snapshot already had its subtree walked
+	if (btrfs_header_level(eb) > 1 && add_cache_extent(&visited, bytenr, size) == -EEXIST) {
+	    log_mesg(3, 0, 0, fs_opt.debug, "%s: block %llu already walked\n", __FILE__, bytenr);
+	    continue;
+	}
         struct btrfs_tree_parent_check check = {
             .owner_root = btrfs_header_owner(eb),
             .transid = btrfs_node_ptr_generation(eb, i),
             .level = btrfs_header_level(eb),
         };
 	struct extent_buffer *next = read_tree_block(root->fs_info,
-		btrfs_node_blockptr(eb, i),  &check);
-	bytenr = (unsigned long long)btrfs_header_bytenr(next);
-	check_extent_bitmap(bitmap, bytenr, &size, 0);
+		bytenr,  &check);
 	if (!extent_buffer_uptodate(next)) {
 	    log_mesg(0, 0, 1, fs_opt.debug, "%s: failed to read %llu in tree %llu\n", __FILE__,
 		    (unsigned long long)btrfs_node_blockptr(eb, i),
@@ -401,6 +556,7 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     int slot;
 
     total_block = fs_info.totalblock;
+    cache_tree_init(&visited);
 
     fs_open(device);
     dev_size = fs_info.device_size;
@@ -417,6 +573,10 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
         set_bitmap(bitmap, sb_mirror_offset, block_size);
     } 
 
+    if (read_bitmap_free_space_tree(bitmap) == 0)
+	goto no_node;
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: no valid free space tree, walk all the trees\n", __FILE__);
+
     csum_root = btrfs_csum_root(info, 0);
     extent_root = btrfs_extent_root(info, 0);
     check_extent_bitmap(bitmap, btrfs_root_bytenr(&extent_root->root_item), &bsize, 0);
@@ -465,6 +625,8 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
 	    offset = btrfs_item_ptr_offset(leaf, slot);
 	    read_extent_buffer(leaf, &ri, offset, sizeof(ri));
+	    if (btrfs_root_level(&ri) > 0 && add_cache_extent(&visited, btrfs_root_bytenr(&ri), bsize) == -EEXIST)
+		goto next;
 	    buf = read_tree_block(tree_root_scan->fs_info, btrfs_root_bytenr(&ri), &check);
 	    if (!extent_buffer_uptodate(buf))
 		goto next;
@@ -477,6 +639,7 @@ next:
 no_node:
     //csum_bitmap(bitmap, root);
     btrfs_release_path(&path);
+    free_extent_cache_tree(&visited);
 }
 
 void read_super_blocks(char* device, file_system_info* fs_info)
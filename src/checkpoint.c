@@ -0,0 +1,177 @@
+/**
+ * checkpoint.c - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * save and load where an interrupted copy can be resumed
+ *
+ * Every --checkpoint-interval seconds the copy loops stop between two
+ * buffers, sync the target and save the block they are at, the number of
+ * blocks copied, the running checksum and the image offset. The file is
+ * written aside and renamed over the old one, so a crash leaves either the
+ * old or the new checkpoint, and both describe data that is on the target.
+ * A run with --resume checks that the checkpoint was made for the same
+ * source and continues from it instead of block 0.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "checkpoint.h"
+
+static time_t checkpoint_last;
+
+/// crc32 of the used bits of @bitmap, the spare bits of the last word are masked
+static uint32_t bitmap_crc(const unsigned long *bitmap, unsigned long long totalblock) {
+	unsigned long long words = totalblock / PART_BITS_PER_LONG;
+	unsigned long rest = totalblock % PART_BITS_PER_LONG;
+	uint32_t crc;
+
+	init_crc32(&crc);
+	crc = crc32(crc, (void *)bitmap, words * sizeof(unsigned long));
+	if (rest) {
+		unsigned long last = bitmap[words] & ((1UL << rest) - 1);
+
+		crc = crc32(crc, &last, sizeof(last));
+	}
+	return crc;
+}
+
+static uint32_t checkpoint_crc(const checkpoint *cp) {
+	uint32_t crc;
+
+	init_crc32(&crc);
+	return crc32(crc, (void *)cp, offsetof(checkpoint, crc));
+}
+
+void checkpoint_init(checkpoint *cp, char mode, const file_system_info *fs_info, const image_options *img_opt, const unsigned long *bitmap, cmd_opt *opt) {
+
+	memset(cp, 0, sizeof(checkpoint));
+	memcpy(cp->magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE);
+	cp->mode = mode;
+	cp->block_size = fs_info->block_size;
+	cp->device_size = fs_info->device_size;
+	cp->totalblock = fs_info->totalblock;
+	cp->usedblocks = fs_info->usedblocks;
+	cp->offset = opt->offset;
+	cp->bitmap_crc = bitmap_crc(bitmap, fs_info->totalblock);
+	if (mode != 'b') {
+		cp->checksum_mode = img_opt->checksum_mode;
+		cp->checksum_size = img_opt->checksum_size;
+		cp->blocks_per_checksum = img_opt->blocks_per_checksum;
+	}
+
+	if (cp->checksum_size > CHECKPOINT_CHECKSUM_SIZE || get_checksum_state_size() > CHECKPOINT_STATE_SIZE)
+		log_mesg(0, 1, 1, opt->debug, "%s: checksum state too large for a checkpoint\n", __func__);
+
+	checkpoint_last = time(NULL);
+}
+
+int checkpoint_load(checkpoint *cp, unsigned char *checksum, cmd_opt *opt) {
+	checkpoint saved;
+	int fd;
+
+	fd = open(opt->checkpoint, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			log_mesg(0, 1, 1, opt->debug, "open checkpoint %s error: %s\n", opt->checkpoint, strerror(errno));
+		log_mesg(0, 0, 1, opt->debug, "No checkpoint %s yet, starting from the beginning\n", opt->checkpoint);
+		return 0;
+	}
+	if (read_all(&fd, (char *)&saved, sizeof(checkpoint), opt) != sizeof(checkpoint)) {
+		log_mesg(0, 1, 1, opt->debug, "checkpoint %s is too short\n", opt->checkpoint);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	/// with --force a bad checkpoint is ignored and the copy starts over
+	if (memcmp(saved.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE) || saved.crc != checkpoint_crc(&saved)) {
+		log_mesg(0, 1, 1, opt->debug, "checkpoint %s is damaged\n", opt->checkpoint);
+		return 0;
+	}
+
+	/// everything up to the progress fields must match the copy we are doing
+	if (memcmp(&saved, cp, offsetof(checkpoint, block_id))) {
+		log_mesg(0, 1, 1, opt->debug, "checkpoint %s was made for another source, target or mode\n", opt->checkpoint);
+		return 0;
+	}
+
+	if (saved.block_id > cp->totalblock || saved.copied > cp->usedblocks) {
+		log_mesg(0, 1, 1, opt->debug, "checkpoint %s is beyond the end of the copy\n", opt->checkpoint);
+		return 0;
+	}
+
+	*cp = saved;
+	if (cp->checksum_size)
+		memcpy(checksum, cp->checksum, cp->checksum_size);
+	load_checksum_state(cp->checksum_state);
+
+	log_mesg(0, 0, 1, opt->debug, "Resuming from block %llu, %llu blocks already copied\n", cp->block_id, cp->copied);
+	return 1;
+}
+
+int checkpoint_due(cmd_opt *opt) {
+	return time(NULL) - checkpoint_last >= (time_t)opt->checkpoint_interval;
+}
+
+void checkpoint_save(checkpoint *cp, int fdw, const unsigned char *checksum, cmd_opt *opt) {
+	size_t len = strlen(opt->checkpoint);
+	char tmp[len + 5];
+	int fd;
+
+	checkpoint_last = time(NULL);
+
+	/// the checkpoint must never get ahead of the data
+	if (fsync(fdw) && errno != EINVAL) {
+		log_mesg(0, 0, 1, opt->debug, "target fsync error, checkpoint not saved: %s\n", strerror(errno));
+		return;
+	}
+
+	if (cp->checksum_size)
+		memcpy(cp->checksum, checksum, cp->checksum_size);
+	save_checksum_state(cp->checksum_state);
+	cp->crc = checkpoint_crc(cp);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opt->checkpoint);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		log_mesg(0, 0, 1, opt->debug, "open checkpoint %s error: %s\n", tmp, strerror(errno));
+		return;
+	}
+	if (write_all(&fd, (char *)cp, sizeof(checkpoint), opt) != sizeof(checkpoint) || fsync(fd)) {
+		log_mesg(0, 0, 1, opt->debug, "write checkpoint %s error: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, opt->checkpoint) == -1) {
+		log_mesg(0, 0, 1, opt->debug, "rename checkpoint %s error: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	log_mesg(1, 0, 0, opt->debug, "checkpoint at block %llu, copied %llu, image offset %llu\n",
+		cp->block_id, cp->copied, cp->image_offset);
+}
+
+void checkpoint_remove(cmd_opt *opt) {
+	if (unlink(opt->checkpoint) == -1 && errno != ENOENT)
+		log_mesg(0, 0, 1, opt->debug, "remove checkpoint %s error: %s\n", opt->checkpoint, strerror(errno));
+}
@@ -0,0 +1,81 @@
+/**
+ * checkpoint.h - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * save and load where an interrupted copy can be resumed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC "PCLCKPT1"
+#define CHECKPOINT_MAGIC_SIZE 8
+#define CHECKPOINT_CHECKSUM_SIZE 16
+#define CHECKPOINT_STATE_SIZE 1024
+
+#pragma pack(push, 1)
+
+typedef struct
+{
+    char magic[CHECKPOINT_MAGIC_SIZE];
+
+    /// what is copied, a resumed run must find the same
+    char mode;				/// 'c'lone, 'r'estore or 'b' dev-to-dev
+    char padding[3];
+    unsigned int block_size;
+    unsigned long long device_size;
+    unsigned long long totalblock;
+    unsigned long long usedblocks;
+    unsigned long long offset;		/// --offset of the target
+    uint32_t bitmap_crc;
+    int checksum_mode;
+    unsigned int checksum_size;
+    unsigned int blocks_per_checksum;
+
+    /// how far the copy went, everything before it is synced to the target
+    unsigned long long block_id;
+    unsigned long long copied;
+    unsigned int blocks_in_cs;
+    unsigned long long image_offset;	/// image bytes written (clone) or read (restore)
+    unsigned char checksum[CHECKPOINT_CHECKSUM_SIZE];
+    unsigned char checksum_state[CHECKPOINT_STATE_SIZE];
+
+    uint32_t crc;			/// crc32 of all the fields above
+} checkpoint;
+
+#pragma pack(pop)
+
+/**
+ * Describe the copy about to start in @cp and start the interval timer.
+ * @mode is 'c', 'r' or 'b' like the checkpoint field.
+ */
+extern void checkpoint_init(checkpoint *cp, char mode, const file_system_info *fs_info, const image_options *img_opt, const unsigned long *bitmap, cmd_opt *opt);
+
+/**
+ * Load the checkpoint file into @cp and the running @checksum. Returns 0
+ * when there is no checkpoint yet and exits when it belongs to another copy,
+ * or returns 0 too with --force.
+ */
+extern int checkpoint_load(checkpoint *cp, unsigned char *checksum, cmd_opt *opt);
+
+/// true once --checkpoint-interval seconds went by since the last checkpoint
+extern int checkpoint_due(cmd_opt *opt);
+
+/**
+ * Sync @fdw and replace the checkpoint file with @cp and the running
+ * @checksum. The caller sets the position fields first.
+ */
+extern void checkpoint_save(checkpoint *cp, int fdw, const unsigned char *checksum, cmd_opt *opt);
+
+/// the copy is complete, drop the checkpoint file
+extern void checkpoint_remove(cmd_opt *opt);
+
+#endif /* CHECKPOINT_H_ */
@@ -6,6 +6,7 @@
 
 #include "partclone.h" // for log_mesg() & cmd_opt
 #ifdef HAVE_XXHASH
+#define XXH_STATIC_LINKING_ONLY		/// the states are copied by save_checksum_state()
 #include "xxhash.h"
 #endif
 
@@ -271,6 +272,73 @@ void finalize_checksum(unsigned char* checksum) {
 
 }
 
+/**
+ * Size of the running state that lives in the library instead of the
+ * caller's checksum buffer, 0 when the buffer holds the whole state.
+ */
+unsigned get_checksum_state_size(void) {
+
+	switch(cs_mode)
+	{
+#ifdef HAVE_XXHASH
+	case CSM_XXH64:
+		return sizeof(XXH64_state_t);
+
+	case CSM_XXH128:
+		return sizeof(XXH3_state_t);
+#endif
+
+	default:
+		return 0;
+	}
+}
+
+/// copy the running state out, @state must hold get_checksum_state_size() bytes
+void save_checksum_state(void* state) {
+
+	switch(cs_mode)
+	{
+#ifdef HAVE_XXHASH
+	case CSM_XXH64:
+		memcpy(state, xxh64_state, sizeof(XXH64_state_t));
+		break;
+
+	case CSM_XXH128:
+		memcpy(state, xxh128_state, sizeof(XXH3_state_t));
+		break;
+#endif
+
+	default:
+		break;
+	}
+}
+
+/// continue from a state saved by save_checksum_state() after init_checksum()
+void load_checksum_state(const void* state) {
+
+	switch(cs_mode)
+	{
+#ifdef HAVE_XXHASH
+	case CSM_XXH64:
+		memcpy(xxh64_state, state, sizeof(XXH64_state_t));
+		break;
+
+	case CSM_XXH128:
+		{
+			/// the secret pointer is only valid in the process that saved it
+			const unsigned char* secret = xxh128_state->extSecret;
+
+			memcpy(xxh128_state, state, sizeof(XXH3_state_t));
+			xxh128_state->extSecret = secret;
+		}
+		break;
+#endif
+
+	default:
+		break;
+	}
+}
+
 void release_checksum() {
 #ifdef HAVE_XXHASH
     if (xxh64_state != NULL) {
@@ -22,6 +22,9 @@ extern const char *get_checksum_str(int checksum_mode);
 extern void init_checksum(int checksum_mode, unsigned char* seed, int debug);
 extern void update_checksum(unsigned char* checksum, char* buf, int size);
 extern void finalize_checksum(unsigned char* checksum);
+extern unsigned get_checksum_state_size(void);
+extern void save_checksum_state(void* state);
+extern void load_checksum_state(const void* state);
 extern void release_checksum();
 char* format_checksum(const unsigned char* data, unsigned int size);
 
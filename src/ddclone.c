@@ -10,18 +10,148 @@
  * (at your option) any later version.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include "partclone.h"
+#include "progress.h"
 
 #define MAX_DD_TOTAL_BLOCKS (1ULL << 50) // Max total blocks (approx 1 Exabyte @ 512B/block) to prevent memory exhaustion
 
 extern cmd_opt opt;
 
+/// clear the blocks lying completely inside the byte range [start, end)
+static void clear_hole(unsigned long long start, unsigned long long end, file_system_info* fs_info, unsigned long* bitmap)
+{
+	unsigned long long first = (start + fs_info->block_size - 1) / fs_info->block_size;
+	unsigned long long last = end / fs_info->block_size;
+
+	/// a hole up to the end of the device covers the partial last block too
+	if (end >= fs_info->device_size || last > fs_info->totalblock)
+		last = fs_info->totalblock;
+	if (first >= last)
+		return;
+
+	log_mesg(3, 0, 0, opt.debug, "%s: hole at block %llu, %llu blocks\n", __FILE__, first, last - first);
+	pc_clear_range(first, last - first, bitmap, fs_info->totalblock);
+}
+
+/**
+ * Walk the data and hole extents of a sparse file with SEEK_DATA/SEEK_HOLE.
+ * Returns -1 when the file system of the source does not support it.
+ */
+static int scan_file_holes(int src, file_system_info* fs_info, unsigned long* bitmap)
+{
+	off_t pos = 0, data, hole;
+	const off_t size = fs_info->device_size;
+
+	while (pos < size) {
+		data = lseek(src, pos, SEEK_DATA);
+		if (data == (off_t)-1) {
+			if (errno == ENXIO) {
+				/// no more data up to the end of the file
+				clear_hole(pos, size, fs_info, bitmap);
+				break;
+			}
+			log_mesg(1, 0, 0, opt.debug, "%s: SEEK_DATA not supported: %s\n", __FILE__, strerror(errno));
+			return -1;
+		}
+		clear_hole(pos, data, fs_info, bitmap);
+		if (data >= size)
+			break;
+
+		hole = lseek(src, data, SEEK_HOLE);
+		if (hole == (off_t)-1) {
+			log_mesg(1, 0, 0, opt.debug, "%s: SEEK_HOLE not supported: %s\n", __FILE__, strerror(errno));
+			return -1;
+		}
+		pos = hole;
+	}
+
+	return 0;
+}
+
+/// read the whole device and mark the blocks filled with zeros as unused
+static void scan_zero_blocks(int src, file_system_info* fs_info, unsigned long* bitmap)
+{
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1;
+	unsigned long long block = 0, zero_blocks = 0, read_size;
+	unsigned int i, blocks, size;
+	char *buffer;
+	ssize_t r_size;
+	progress_bar prog;
+
+	buffer = malloc((size_t)buffer_capacity * block_size);
+	if (buffer == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	progress_init(&prog, 0, fs_info->totalblock, fs_info->totalblock, BITMAP, block_size);
+
+	while (block < fs_info->totalblock) {
+		blocks = fs_info->totalblock - block < buffer_capacity ? fs_info->totalblock - block : buffer_capacity;
+		read_size = cnv_blocks_to_device_bytes(block, blocks, block_size, fs_info->device_size);
+		r_size = pread(src, buffer, read_size, (off_t)(block * block_size));
+		if (r_size <= 0) {
+			/// keep the rest as used and let the copy report the read error
+			log_mesg(1, 0, 0, opt.debug, "%s: zero scan stopped at block %llu: %s\n", __FILE__, block, strerror(errno));
+			break;
+		}
+		/// only whole blocks, unless the read reached the end of the device
+		if ((unsigned long long)r_size < read_size)
+			blocks = r_size / block_size;
+		if (!blocks)
+			break;
+
+		for (i = 0; i < blocks; i++) {
+			const char *b = buffer + (size_t)i * block_size;
+			size = r_size - (size_t)i * block_size < block_size ? r_size - (size_t)i * block_size : block_size;
+			if (b[0] == 0 && !memcmp(b, b + 1, size - 1)) {
+				pc_clear_bit(block + i, bitmap, fs_info->totalblock);
+				zero_blocks++;
+			}
+		}
+		block += blocks;
+		update_pui(&prog, block, block, 0);
+	}
+
+	update_pui(&prog, 1, 1, 1);
+	log_mesg(1, 0, 0, opt.debug, "%s: %llu zero blocks found\n", __FILE__, zero_blocks);
+	free(buffer);
+}
+
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
+	struct stat st;
+	int src;
+
 	/// initial image bitmap as 1 (all block are used)
 	pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
+
+	/// a stream can't be scanned ahead of the copy
+	if (strcmp(device, "-") == 0)
+		return;
+
+	/// plain buffered reads, the scan does not honour --read-direct-io
+	if ((src = open(device, O_RDONLY)) == -1) {
+		log_mesg(1, 0, 0, opt.debug, "%s: open %s error: %s\n", __FILE__, device, strerror(errno));
+		return;
+	}
+
+	if (fstat(src, &st) == -1) {
+		log_mesg(1, 0, 0, opt.debug, "%s: fstat error: %s\n", __FILE__, strerror(errno));
+	} else if (S_ISREG(st.st_mode)) {
+		/// only the allocated extents of a sparse file hold data
+		if (scan_file_holes(src, &fs_info, bitmap) == -1)
+			pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
+	} else if (S_ISBLK(st.st_mode) && opt.sparse) {
+		scan_zero_blocks(src, &fs_info, bitmap);
+	}
+
+	close(src);
 }
 
 void read_super_blocks(char* device, file_system_info* fs_info)
@@ -32,7 +162,7 @@ void read_super_blocks(char* device, file_system_info* fs_info)
 	    return;
 	}
 	strncpy(fs_info->fs, raw_MAGIC, FS_MAGIC_SIZE);
-	fs_info->block_size  = PART_SECTOR_SIZE; // Always 512 bytes for ddclone
+	fs_info->block_size  = opt.raw_block_size;
 
 	unsigned long long initial_device_size = get_partition_size(&src); // Get size first
 	if (opt.device_size > 0){
@@ -50,12 +180,13 @@ void read_super_blocks(char* device, file_system_info* fs_info)
         return;
     }
 
-    if (PART_SECTOR_SIZE == 0) {
-        log_mesg(0, 1, 1, opt.debug, "ERROR: PART_SECTOR_SIZE is zero, cannot calculate total blocks.\n");
+    if (fs_info->block_size == 0) {
+        log_mesg(0, 1, 1, opt.debug, "ERROR: block size is zero, cannot calculate total blocks.\n");
         close(src);
         return;
     }
-    fs_info->totalblock  = fs_info->device_size / PART_SECTOR_SIZE;
+    /// the last block may be partial, it is cut at the device size on copy
+    fs_info->totalblock  = (fs_info->device_size + fs_info->block_size - 1) / fs_info->block_size;
 
     if (fs_info->totalblock == 0 || fs_info->totalblock > MAX_DD_TOTAL_BLOCKS) {
         log_mesg(0, 1, 1, opt.debug, "ERROR: Maliciously large or zero total blocks detected: %llu. Max allowed: %llu\n", fs_info->totalblock, MAX_DD_TOTAL_BLOCKS);
@@ -48,7 +48,6 @@ static void fs_close(){
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
     off_t a = 0, b = 0;
-    off_t block = 0;;
     int start = 0;
     int bit_size = 1;
 
@@ -62,12 +61,10 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
     while (exfat_find_used_sectors(&ef, &a, &b) == 0){
         log_mesg(2, 0, 0, fs_opt.debug, "%s: exfat_mount done\n", __FILE__);
-	for (block = a; block <= b; block++){
-	    pc_set_bit((uint64_t)block, bitmap, fs_info.totalblock);
-	    log_mesg(3, 0, 0, fs_opt.debug, "%s: used block %" PRId64 " \n", __FILE__, block);
-	    /// update progress
-	    update_pui(&prog, block, block, 0);
-	}
+	log_mesg(3, 0, 0, fs_opt.debug, "%s: used blocks %" PRId64 " - %" PRId64 " \n", __FILE__, a, b);
+	pc_set_range((uint64_t)a, (uint64_t)(b - a + 1), bitmap, fs_info.totalblock);
+	/// update progress
+	update_pui(&prog, b, b, 0);
     }
 
     fs_close();
@@ -12,7 +12,11 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <ext2fs/ext2fs.h>
 #include <stdlib.h>
@@ -23,7 +27,6 @@
 #include <getopt.h>
 #include <config.h>
 
-#define in_use(m, x)    (ext2fs_test_bit ((x), (m)))
 
 #include "partclone.h"
 #include "extfsclone.h"
@@ -96,32 +99,295 @@ static unsigned long long get_used_blocks(){
     return (unsigned long long)(ext2fs_blocks_count(fs->super) - ext2fs_free_blocks_count(fs->super));
 }
 
-// reference dumpe2fs
-void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui) {
+/// first block of @group
+static unsigned long long group_first_block(dgrp_t group) {
+    return fs->super->s_first_data_block + (unsigned long long)group * fs->super->s_blocks_per_group;
+}
+
+/// blocks of @group inside the file system, the last group can be short
+static unsigned long long group_block_count(dgrp_t group, unsigned long long totalblock) {
+    unsigned long long first = group_first_block(group);
+
+    if (first >= totalblock)
+	return 0;
+    if (totalblock - first < fs->super->s_blocks_per_group)
+	return totalblock - first;
+    return fs->super->s_blocks_per_group;
+}
+
+/// copy the on-disk bitmap @map of @group, NULL for a group without used blocks
+static void copy_group_bitmap(dgrp_t group, const unsigned char *map, unsigned long* bitmap, unsigned long long totalblock) {
+    unsigned long long first = group_first_block(group);
+    unsigned long long count = group_block_count(group, totalblock);
+
+    if (!count)
+	return;
+    if (!map)
+	pc_clear_range(first, count, bitmap, totalblock);
+#ifndef EXTFS_1_41
+    // For bigalloc, every bit of the group bitmap is a cluster
+    else if (fs->cluster_ratio_bits)
+	pc_spread_bits_le(first, map, (count + EXT2FS_CLUSTER_RATIO(fs) - 1) >> fs->cluster_ratio_bits,
+	    fs->cluster_ratio_bits, bitmap, totalblock);
+#endif
+    else
+	pc_copy_bits_le(first, map, count, bitmap, totalblock);
+}
+
+/// read the bitmaps with libext2fs, one group after the other
+static void read_bitmap_libext2fs(unsigned long* bitmap, unsigned long long totalblock) {
     errcode_t retval;
-    unsigned long group;
-    unsigned long long current_block, block;
-    unsigned long long lfree, gfree;
+    dgrp_t group;
     char *block_bitmap = NULL;
     int block_nbytes;
-    unsigned long long blk_itr;
+
+    // Read bitmaps from disk
+    retval = ext2fs_read_bitmaps(fs);
+    if (retval)
+        log_mesg(0, 1, 1, fs_opt.debug, "%s: Couldn't find valid filesystem bitmap.\n", __FILE__);
+
+#ifndef EXTFS_1_41
+    // For bigalloc, the group bitmap has one bit per cluster
+    block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
+#else
+    block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
+#endif
+
+    if (!fs->block_map)
+	return;
+    block_bitmap = malloc(block_nbytes);
+    if (!block_bitmap)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+    for (group = 0; group < fs->group_desc_count; group++) {
+	unsigned long long first = group_first_block(group);
+
+	if (first >= totalblock)
+	    break;
+#ifdef EXTFS_1_41
+	ext2fs_get_block_bitmap_range(fs->block_map, first, block_nbytes << 3, block_bitmap);
+#else
+	ext2fs_get_block_bitmap_range2(fs->block_map, first, block_nbytes << 3, block_bitmap);
+#endif
+	copy_group_bitmap(group, (unsigned char *)block_bitmap, bitmap, totalblock);
+    }
+    free(block_bitmap);
+}
+
+#ifndef EXTFS_1_41
+/**
+ * Parallel block bitmap loader
+ *
+ * ext2fs_read_bitmaps() reads the groups one after the other and keeps a
+ * second copy of the bitmap. Here the group bitmaps are read straight from
+ * the device by a few threads, each owning a range of groups and so a
+ * disjoint, word aligned slice of the partclone bitmap. The bitmap blocks
+ * of consecutive groups, which flex_bg keeps together, are read with one
+ * pread of up to BITMAP_BATCH blocks and checked against metadata_csum.
+ * BLOCK_UNINIT groups are rebuilt from their metadata like libext2fs does.
+ */
+#define BITMAP_THREADS_MAX 8
+#define BITMAP_BATCH 256		/// bitmap blocks read at once
+
+typedef struct {
+    int fd;
+    dgrp_t first, last;			/// groups [first, last) of this thread
+    unsigned long* bitmap;
+    unsigned long long totalblock;
+    int error;				/// errno of a failed read
+    dgrp_t bad_csum;			/// first group with a bad checksum plus one, 0 if none
+    pthread_t thread;
+} bitmap_reader;
+
+/// the bitmap of @group is not on disk, libext2fs starts from an empty one
+static int group_bitmap_uninit(dgrp_t group) {
+    if (!ext2fs_block_bitmap_loc(fs, group))
+	return 1;
+    return ext2fs_has_group_desc_csum(fs) && ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT) &&
+	ext2fs_group_desc_csum_verify(fs, group);
+}
+
+static int pread_all(int fd, char *buf, size_t size, off_t offset) {
+    ssize_t r;
+
+    while (size) {
+	r = pread(fd, buf, size, offset);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0) {
+	    if (r == 0)
+		errno = EIO;
+	    return -1;
+	}
+	buf += r;
+	size -= r;
+	offset += r;
+    }
+    return 0;
+}
+
+static void *read_bitmap_thread(void *arg) {
+    bitmap_reader *r = arg;
+    unsigned int bsize = fs->blocksize;
+    char *buf;
+    dgrp_t group = r->first, n, i;
+
+    buf = malloc((size_t)BITMAP_BATCH * bsize);
+    if (!buf) {
+	r->error = ENOMEM;
+	return NULL;
+    }
+
+    while (group < r->last) {
+	blk64_t loc = ext2fs_block_bitmap_loc(fs, group);
+
+	if (group_bitmap_uninit(group)) {
+	    copy_group_bitmap(group, NULL, r->bitmap, r->totalblock);
+	    group++;
+	    continue;
+	}
+
+	/// flex_bg places the bitmaps of a flex group one after the other
+	for (n = 1; group + n < r->last && n < BITMAP_BATCH &&
+	     !group_bitmap_uninit(group + n) && ext2fs_block_bitmap_loc(fs, group + n) == loc + n; n++);
+
+	if (pread_all(r->fd, buf, (size_t)n * bsize, (off_t)loc * bsize)) {
+	    r->error = errno;
+	    break;
+	}
+
+	for (i = 0; i < n; i++) {
+	    char *map = buf + (size_t)i * bsize;
+
+#ifdef EXT4_FEATURE_RO_COMPAT_METADATA_CSUM
+	    if ((fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) &&
+		!ext2fs_block_bitmap_csum_verify(fs, group + i, map, EXT2_CLUSTERS_PER_GROUP(fs->super) / 8)) {
+		r->bad_csum = group + i + 1;
+		break;
+	    }
+#endif
+	    copy_group_bitmap(group + i, (unsigned char *)map, r->bitmap, r->totalblock);
+	}
+	if (r->bad_csum)
+	    break;
+	group += n;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/// mark @count blocks from @blk, bigalloc allocates whole clusters
+static void mark_blocks(blk64_t blk, unsigned long long count, unsigned long* bitmap, unsigned long long totalblock) {
+    unsigned long long mask = EXT2FS_CLUSTER_RATIO(fs) - 1;
+    unsigned long long start = blk & ~mask;
+    unsigned long long end = (blk + count + mask) & ~mask;
+
+    if (start >= totalblock)
+	return;
+    if (end > totalblock)
+	end = totalblock;
+    pc_set_range(start, end - start, bitmap, totalblock);
+}
+
+/// the blocks mark_uninit_bg_group_blocks() of libext2fs marks for a BLOCK_UNINIT group
+static void mark_uninit_group(dgrp_t group, unsigned long* bitmap, unsigned long long totalblock) {
+    blk64_t super_blk, old_desc_blk, new_desc_blk;
+    unsigned long long old_desc_blocks;
+
+    ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc_blk, &new_desc_blk, NULL);
+    if (fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+	old_desc_blocks = fs->super->s_first_meta_bg;
+    else
+	old_desc_blocks = fs->desc_blocks + fs->super->s_reserved_gdt_blocks;
+
+    if (super_blk || group == 0)
+	mark_blocks(super_blk, 1, bitmap, totalblock);
+    if (old_desc_blk)
+	mark_blocks(old_desc_blk, old_desc_blocks, bitmap, totalblock);
+    if (new_desc_blk)
+	mark_blocks(new_desc_blk, 1, bitmap, totalblock);
+    if (ext2fs_inode_table_loc(fs, group))
+	mark_blocks(ext2fs_inode_table_loc(fs, group), fs->inode_blocks_per_group, bitmap, totalblock);
+    if (ext2fs_block_bitmap_loc(fs, group))
+	mark_blocks(ext2fs_block_bitmap_loc(fs, group), 1, bitmap, totalblock);
+    if (ext2fs_inode_bitmap_loc(fs, group))
+	mark_blocks(ext2fs_inode_bitmap_loc(fs, group), 1, bitmap, totalblock);
+}
+
+/// read the bitmaps with threads, returns 0 when libext2fs has to do it
+static int read_bitmap_parallel(char* device, unsigned long* bitmap, unsigned long long totalblock) {
+    bitmap_reader readers[BITMAP_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    dgrp_t group, per_thread;
+    int fd, t, threads;
+
+    if (EXT2_CLUSTERS_PER_GROUP(fs->super) / 8 > fs->blocksize)
+	return 0;
+
+    fd = open(device, O_RDONLY);
+    if (fd == -1)
+	return 0;
+
+    threads = cpus > 1 ? (cpus < BITMAP_THREADS_MAX ? cpus : BITMAP_THREADS_MAX) : 1;
+    /// small file systems are not worth a thread
+    if ((dgrp_t)threads > fs->group_desc_count / BITMAP_BATCH + 1)
+	threads = fs->group_desc_count / BITMAP_BATCH + 1;
+    /// threads own whole words only when every group starts on a word
+    if ((fs->super->s_first_data_block | fs->super->s_blocks_per_group) % PART_BITS_PER_LONG)
+	threads = 1;
+    per_thread = (fs->group_desc_count + threads - 1) / threads;
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: read %u group bitmaps with %i threads\n", __FILE__, fs->group_desc_count, threads);
+
+    for (t = 0; t < threads; t++) {
+	readers[t].fd = fd;
+	readers[t].first = t * per_thread;
+	readers[t].last = readers[t].first + per_thread < fs->group_desc_count ?
+	    readers[t].first + per_thread : fs->group_desc_count;
+	readers[t].bitmap = bitmap;
+	readers[t].totalblock = totalblock;
+	readers[t].error = 0;
+	readers[t].bad_csum = 0;
+	if (pthread_create(&readers[t].thread, NULL, read_bitmap_thread, &readers[t]))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+    }
+    for (t = 0; t < threads; t++) {
+	if (pthread_join(readers[t].thread, NULL))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+    }
+    close(fd);
+
+    for (t = 0; t < threads; t++) {
+	if (readers[t].error)
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: read block bitmap error: %s\n", __FILE__, strerror(readers[t].error));
+	if (readers[t].bad_csum)
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: block bitmap checksum error at %u group.\n", __FILE__, readers[t].bad_csum - 1);
+    }
+
+    for (group = 0; group < fs->group_desc_count; group++)
+	if (ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
+	    mark_uninit_group(group, bitmap, totalblock);
+
+    return 1;
+}
+#endif
+
+// reference dumpe2fs
+void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui) {
+    dgrp_t group;
+    unsigned long long group_blocks;
+    unsigned long long lfree, gfree;
     int bg_flags = 0;
     int start = 0;
     int bit_size = 1;
     int B_UN_INIT = 0;
     int ext4_gfree_mismatch = 0;
-    ext2fs_block_bitmap working_bitmap = NULL;
     int allocated_subcluster = 0;
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s: read_bitmap %p\n", __FILE__, bitmap);
 
     fs_open(device);
 
-    // Read bitmaps from disk
-    retval = ext2fs_read_bitmaps(fs);
-    if (retval)
-        log_mesg(0, 1, 1, fs_opt.debug, "%s: Couldn't find valid filesystem bitmap.\n", __FILE__);
-
 #ifndef EXTFS_1_41
     // e2fsprogs 1.42+: Check for bigalloc filesystems
     if (fs->cluster_ratio_bits) {
@@ -129,27 +395,19 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
         log_mesg(1, 0, 0, fs_opt.debug,
                  "%s: Bigalloc filesystem detected (cluster_ratio=%d blocks/cluster)\n",
                  __FILE__, 1 << fs->cluster_ratio_bits);
-        // For bigalloc, use appropriate buffer size (clusters, not blocks)
-        block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
         allocated_subcluster = 1;  // Mark that we're using cluster bitmap
-    } else {
-#endif
-        // Non-bigalloc: use blocks per group
-        block_nbytes = EXT2_BLOCKS_PER_GROUP(fs->super) / 8;
-#ifndef EXTFS_1_41
     }
 #endif
 
-    working_bitmap = fs->block_map;
-    if (working_bitmap)
-	block_bitmap = malloc(block_nbytes);
-
     /// initial image bitmap as 1 (all block are used)
     pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
 
+#ifndef EXTFS_1_41
+    if (!read_bitmap_parallel(device, bitmap, fs_info.totalblock))
+#endif
+	read_bitmap_libext2fs(bitmap, fs_info.totalblock);
+
     lfree = 0;
-    current_block = 0;
-    blk_itr = fs->super->s_first_data_block;
 
     /// init progress
     progress_bar	prog;		/// progress_bar structure defined in progress.h
@@ -158,60 +416,26 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     /// each group
     for (group = 0; group < fs->group_desc_count; group++) {
 
-	gfree = 0;
 	B_UN_INIT = 0;
 
-	if (block_bitmap) {
-#ifdef EXTFS_1_41
-	    ext2fs_get_block_bitmap_range(working_bitmap, blk_itr, block_nbytes << 3, block_bitmap);
-#else
-	    ext2fs_get_block_bitmap_range2(working_bitmap, blk_itr, block_nbytes << 3, block_bitmap);
-#endif
+	group_blocks = group_block_count(group, fs_info.totalblock);
+	gfree = group_blocks - pc_count_bits(group_first_block(group), group_blocks, bitmap, fs_info.totalblock);
+	lfree += gfree;
 
-	    if (fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM){
+	if (fs->super->s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_GDT_CSUM){
 #ifdef EXTFS_1_41
-		    bg_flags = fs->group_desc[group].bg_flags;
-#else
-		    bg_flags = ext2fs_bg_flags(fs, group);
-#endif
-		    if (bg_flags&EXT2_BG_BLOCK_UNINIT){
-			log_mesg(1, 0, 0, fs_opt.debug, "%s: BLOCK_UNINIT for group %lu\n", __FILE__, group);
-			B_UN_INIT = 1;
-		    } else {
-			log_mesg(2, 0, 0, fs_opt.debug, "%s: BLOCK_INIT for group %lu\n", __FILE__, group);
-		    }
-	    }
-	    /// each block in group
-	    for (block = 0; ((block < fs->super->s_blocks_per_group) && (current_block < (fs_info.totalblock-1))); block++) {
-		current_block = block + blk_itr;
-
-#ifndef EXTFS_1_41
-		// For bigalloc, map block to cluster
-		int bit_to_test = block;
-		if (allocated_subcluster && fs->cluster_ratio_bits) {
-		    // Convert block number to cluster number for bitmap lookup
-		    bit_to_test = block >> fs->cluster_ratio_bits;
-		}
-
-		if (in_use (block_bitmap, bit_to_test)){
+		bg_flags = fs->group_desc[group].bg_flags;
 #else
-		if (in_use (block_bitmap, block)){
+		bg_flags = ext2fs_bg_flags(fs, group);
 #endif
-			pc_set_bit(current_block, bitmap, fs_info.totalblock);
-			log_mesg(3, 0, 0, fs_opt.debug, "%s: used block %llu at group %lu\n", __FILE__, current_block, group);
+		if (bg_flags&EXT2_BG_BLOCK_UNINIT){
+		    log_mesg(1, 0, 0, fs_opt.debug, "%s: BLOCK_UNINIT for group %lu\n", __FILE__, (unsigned long)group);
+		    B_UN_INIT = 1;
 		} else {
-		    lfree++;
-		    gfree++;
-		    pc_clear_bit(current_block, bitmap, fs_info.totalblock);
-		    log_mesg(3, 0, 0, fs_opt.debug, "%s: free block %llu at group %lu init %i\n", __FILE__, current_block, group, (int)B_UN_INIT);
+		    log_mesg(2, 0, 0, fs_opt.debug, "%s: BLOCK_INIT for group %lu\n", __FILE__, (unsigned long)group);
 		}
-
-		/// update progress
-		update_pui(&prog, current_block, current_block, 0);//keep update
-	    }
-	    blk_itr += fs->super->s_blocks_per_group;
 	}
-	log_mesg(2, 0, 0, fs_opt.debug, "%s: free bitmap (gfree = %lli, bg_blocks_count = %lli)at %lu group.\n", __FILE__, gfree, ext2fs_bg_free_blocks_count(fs, group), group);
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: free bitmap (gfree = %lli, bg_blocks_count = %lli)at %lu group.\n", __FILE__, gfree, ext2fs_bg_free_blocks_count(fs, group), (unsigned long)group);
 
 #ifndef EXTFS_1_41
 	// Skip validation for bigalloc - we count blocks but metadata tracks clusters
@@ -224,13 +448,17 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 	    if (gfree != ext2fs_bg_free_blocks_count(fs, group)){
 #endif
 		if (!B_UN_INIT)
-		    log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap error at %lu group.\n", __FILE__, group);
+		    log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap error at %lu group.\n", __FILE__, (unsigned long)group);
 		else
 		    ext4_gfree_mismatch = 1;
 	    }
 #ifndef EXTFS_1_41
 	}
 #endif
+
+	/// update progress
+	if (group_blocks)
+	    update_pui(&prog, group_first_block(group) + group_blocks - 1, group_first_block(group) + group_blocks - 1, 0);//keep update
     }
 
 #ifndef EXTFS_1_41
@@ -253,7 +481,6 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     fs_close();
     /// update progress
     update_pui(&prog, 1, 1, 1);//finish
-    free(block_bitmap);
 }
 
 /// get extfs type
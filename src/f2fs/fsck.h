@@ -219,6 +219,10 @@ extern int fsck_verify(struct f2fs_sb_info *);
 extern void fsck_free(struct f2fs_sb_info *);
 extern int f2fs_ra_meta_pages(struct f2fs_sb_info *, block_t, int, int);
 extern int f2fs_do_mount(struct f2fs_sb_info *);
+extern int validate_super_block(struct f2fs_sb_info *, enum SB_ADDR);
+extern int init_sb_info(struct f2fs_sb_info *);
+extern int get_valid_checkpoint(struct f2fs_sb_info *);
+extern int sanity_check_ckpt(struct f2fs_sb_info *);
 extern void f2fs_do_umount(struct f2fs_sb_info *);
 extern int f2fs_sparse_initialize_meta(struct f2fs_sb_info *);
 
@@ -25,10 +25,10 @@
 struct f2fs_fsck gfsck;
 struct f2fs_sb_info *sbi;
 
-/// open device
-static void fs_open(char* device){
+#define SIT_READ_BLOCKS 256 // SIT blocks fetched by one read
 
-    int ret = 0;
+/// open device, only the super block and the current checkpoint are loaded
+static void fs_open(char* device){
 
     f2fs_init_configuration();
     c.devices[0].path = device;
@@ -54,26 +54,68 @@ static void fs_open(char* device){
     if (f2fs_get_device_info() < 0)
 	log_mesg(0, 1, 1, fs_opt.debug, "%s: f2fs_get_device_info fail\n", __FILE__);
 
-    if (f2fs_do_mount(sbi) < 0)
-	log_mesg(0, 1, 1, fs_opt.debug, "%s: f2fs_do_mount fail\n", __FILE__);
+    /*
+     * The full f2fs_do_mount() and fsck_init() also build the node manager
+     * and the fsck NAT tables, none of which the bitmap needs.
+     */
+    if (validate_super_block(sbi, SB0_ADDR) && validate_super_block(sbi, SB1_ADDR))
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: can't find a valid f2fs super block\n", __FILE__);
+
+    init_sb_info(sbi);
 
-    fsck_init(sbi);
-    if (ret < 0)
-	log_mesg(0, 1, 1, fs_opt.debug, "%s: fsck_init init fail\n", __FILE__);
+    if (get_valid_checkpoint(sbi))
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: can't find a valid checkpoint\n", __FILE__);
+
+    if (sanity_check_ckpt(sbi))
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: checkpoint is polluted\n", __FILE__);
 }
 
 /// close device
 static void fs_close(){
-    f2fs_do_umount(sbi);
-    fsck_free(sbi);
+    free(sbi->ckpt);
+    free(sbi->raw_super);
+    sbi->ckpt = NULL;
+    sbi->raw_super = NULL;
+}
+
+/// load the SIT journal kept in the cold data summary of the checkpoint
+static void read_sit_journal(struct f2fs_journal *journal){
+
+    struct f2fs_checkpoint *cp = F2FS_CKPT(sbi);
+    char buf[F2FS_BLKSIZE];
+    block_t blk_addr;
+
+    if (is_set_ckpt_flags(cp, CP_COMPACT_SUM_FLAG)) {
+	/// compacted summaries start with the NAT journal, then the SIT journal
+	if (dev_read_block(buf, start_sum_block(sbi)))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: read compacted summary fail\n", __FILE__);
+	memcpy(journal, buf + SUM_JOURNAL_SIZE, SUM_JOURNAL_SIZE);
+    } else {
+	if (is_set_ckpt_flags(cp, CP_UMOUNT_FLAG))
+	    blk_addr = sum_blk_addr(sbi, NR_CURSEG_TYPE, CURSEG_COLD_DATA);
+	else
+	    blk_addr = sum_blk_addr(sbi, NR_CURSEG_DATA_TYPE, CURSEG_COLD_DATA);
+	if (dev_read_block(buf, blk_addr))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: read cold data summary fail\n", __FILE__);
+	memcpy(journal, &((struct f2fs_summary_block *)buf)->journal, sizeof(*journal));
+    }
+
+    if (sits_in_cursum(journal) > SIT_JOURNAL_ENTRIES) {
+	log_mesg(1, 0, 0, fs_opt.debug, "%s: truncate SIT journal from %u entries\n", __FILE__, sits_in_cursum(journal));
+	journal->n_sits = cpu_to_le16(SIT_JOURNAL_ENTRIES);
+    }
 }
 
 ///  readbitmap - read bitmap
 extern void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
-    off_t block = 0;;
     int start = 0;
     int bit_size = 1;
+    struct f2fs_journal journal, *jnl = &journal;
+    struct f2fs_sit_block *sit_blks;
+    char *sit_bitmap;
+    unsigned int sit_blk_cnt, main_segs, blk, n, i, segno;
+    unsigned long long main_blkaddr, main_end, sit_base, sit_blocks, sit_used = 0;
 
     fs_open(device);
     struct f2fs_super_block *sb = F2FS_RAW_SUPER(sbi);
@@ -82,32 +124,65 @@ extern void read_bitmap(char* device, file_system_info fs_info, unsigned long* b
     progress_bar   prog;	/// progress_bar structure defined in progress.h
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
 
-    /// bitmap test
-    log_mesg(1, 0, 0, fs_opt.debug, "%s: start f2fs bitmap dump\n", __FILE__);
-    struct f2fs_fsck *fsck = F2FS_FSCK(sbi);
-    log_mesg(1, 0, 0, fs_opt.debug, "%s: start fsck sit\n", __FILE__);
-    for ( block = 0; block <= sb->main_blkaddr ; block++ ){
-
-	    log_mesg(2, 0, 0, fs_opt.debug, "%s: test SIT bitmap is 0x1. blk_addr[0x%x] %i\n", __FILE__, block, block);
-	    pc_set_bit(block, bitmap, fs_info.totalblock);
-	    log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is used %llu", __FILE__, block);
-    }
-
-    for ( block = sb->main_blkaddr ; block < sb->block_count ; block++ ){
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block = %i\n", __FILE__, block);
-	if (f2fs_test_bit(BLKOFF_FROM_MAIN(sbi, block), fsck->sit_area_bitmap) == 0x0) {
-	    log_mesg(2, 0, 0, fs_opt.debug, "%s: test SIT bitmap is 0x0. blk_addr[0x%x] %i\n", __FILE__, block, block);
-	    pc_clear_bit(block, bitmap, fs_info.totalblock);
-	    log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is free %llu", __FILE__, block);
-	}else{
-	    log_mesg(2, 0, 0, fs_opt.debug, "%s: test SIT bitmap is 0x1. blk_addr[0x%x] %i\n", __FILE__, block, block);
-	    pc_set_bit(block, bitmap, fs_info.totalblock);
-	    log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is used %llu", __FILE__, block);
+    main_blkaddr = get_sb(main_blkaddr);
+    main_segs = get_sb(segment_count_main);
+    main_end = main_blkaddr + ((unsigned long long)main_segs << sbi->log_blocks_per_seg);
+    if (main_blkaddr > fs_info.totalblock || main_end > fs_info.totalblock)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: main area %llu-%llu is out of the device (%llu blocks)\n", __FILE__, main_blkaddr, main_end, fs_info.totalblock);
 
+    /// everything below the main area is metadata, anything after it is unused
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: start f2fs bitmap dump\n", __FILE__);
+    pc_set_range(0, main_blkaddr, bitmap, fs_info.totalblock);
+    pc_clear_range(main_end, fs_info.totalblock - main_end, bitmap, fs_info.totalblock);
+
+    /*
+     * Each SIT block exists twice, the checkpoint SIT bitmap tells which
+     * copy is current. Runs of blocks in the same copy are read at once.
+     */
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: start reading sit\n", __FILE__);
+    sit_bitmap = __bitmap_ptr(sbi, SIT_BITMAP);
+    sit_base = get_sb(sit_blkaddr);
+    sit_blocks = (unsigned long long)(get_sb(segment_count_sit) >> 1) << sbi->log_blocks_per_seg;
+    sit_blk_cnt = (main_segs + SIT_ENTRY_PER_BLOCK - 1) / SIT_ENTRY_PER_BLOCK;
+
+    sit_blks = malloc(SIT_READ_BLOCKS * F2FS_BLKSIZE);
+    if (!sit_blks)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s: malloc sit blocks error: %s\n", __FILE__, strerror(errno));
+
+    for (blk = 0; blk < sit_blk_cnt; blk += n) {
+	int copy = f2fs_test_bit(blk, sit_bitmap);
+
+	for (n = 1; n < SIT_READ_BLOCKS && blk + n < sit_blk_cnt; n++)
+	    if (f2fs_test_bit(blk + n, sit_bitmap) != copy)
+		break;
+	if (dev_read(sit_blks, (sit_base + blk + (copy ? sit_blocks : 0)) << F2FS_BLKSIZE_BITS, (size_t)n * F2FS_BLKSIZE))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s: read sit block %u fail\n", __FILE__, blk);
+
+	segno = blk * SIT_ENTRY_PER_BLOCK;
+	for (i = 0; i < n * SIT_ENTRY_PER_BLOCK && segno < main_segs; i++, segno++) {
+	    struct f2fs_sit_entry *sit = &sit_blks[i / SIT_ENTRY_PER_BLOCK].entries[i % SIT_ENTRY_PER_BLOCK];
+	    sit_used += pc_import_bits(main_blkaddr + ((unsigned long long)segno << sbi->log_blocks_per_seg),
+		    sit->valid_map, sbi->blocks_per_seg, PC_BITS_MSB_FIRST, bitmap, fs_info.totalblock);
 	}
 
 	/// update progress
-	update_pui(&prog, block, block, 0);
+	update_pui(&prog, main_blkaddr + ((unsigned long long)segno << sbi->log_blocks_per_seg),
+		main_blkaddr + ((unsigned long long)segno << sbi->log_blocks_per_seg), 0);
+    }
+    free(sit_blks);
+    log_mesg(2, 0, 0, fs_opt.debug, "%s: %llu valid blocks in sit blocks\n", __FILE__, sit_used);
+
+    /// journaled entries are newer than the SIT blocks
+    read_sit_journal(jnl);
+    for (i = 0; i < sits_in_cursum(jnl); i++) {
+	segno = le32_to_cpu(segno_in_journal(jnl, i));
+	if (segno >= main_segs) {
+	    log_mesg(1, 0, 0, fs_opt.debug, "%s: invalid segno %u in sit journal\n", __FILE__, segno);
+	    continue;
+	}
+	log_mesg(2, 0, 0, fs_opt.debug, "%s: sit journal segno %u\n", __FILE__, segno);
+	pc_import_bits(main_blkaddr + ((unsigned long long)segno << sbi->log_blocks_per_seg),
+		sit_in_journal(jnl, i).valid_map, sbi->blocks_per_seg, PC_BITS_MSB_FIRST, bitmap, fs_info.totalblock);
     }
 
     fs_close();
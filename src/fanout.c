@@ -0,0 +1,281 @@
+/**
+ * fanout.c - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * write one restore stream to several targets
+ *
+ * The restore loop reads and verifies the image once and queues each buffer
+ * in a ring of slots. Every target has its own writer thread that writes the
+ * slots in order at their absolute offsets. A slot is reused only after all
+ * the writers still alive went past it, so a slow target throttles the others
+ * only once it is a whole ring behind. A target that fails is dropped and the
+ * error is returned when the queue is closed, or by the next write once no
+ * target is left.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "partclone.h"
+#include "fanout.h"
+
+typedef struct {
+	char *buffer;
+	unsigned long long size;
+	unsigned long long offset;
+	int zero;			/// zero the range instead of writing the buffer
+} fanout_slot;
+
+typedef struct {
+	fanout *fan;
+	int fd;
+	char *name;
+	unsigned long long next;	/// sequence number of the next slot to write
+	int failed;
+	pthread_t thread;
+} fanout_target;
+
+struct fanout {
+	fanout_slot *slots;
+	unsigned int slot_count;
+	unsigned int buffer_size;
+	fanout_target *targets;
+	int target_count;
+	int alive;			/// targets not dropped yet
+	unsigned long long head;	/// sequence number of the next slot to fill
+	int closing;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	cmd_opt *opt;
+};
+
+/// write a whole slot to one target, returns 0 on success
+static int write_slot(fanout_target *t, const fanout_slot *slot, cmd_opt *opt) {
+	unsigned long long done = 0;
+	ssize_t w;
+
+	if (slot->zero) {
+		if (lseek(t->fd, slot->offset, SEEK_SET) == (off_t)-1)
+			return -1;
+		return zero_bytes(&t->fd, slot->size, opt) == (long long)slot->size ? 0 : -1;
+	}
+
+	while (done < slot->size) {
+		pc_count(write_calls[pc_size_bucket(slot->size - done)], 1);
+		w = pwrite(t->fd, slot->buffer + done, slot->size - done, slot->offset + done);
+		if (w < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		if (w == 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if (w < slot->size - done)
+			pc_count(short_calls, 1);
+		done += w;
+		pc_count(bytes_written, w);
+	}
+	return 0;
+}
+
+static void *fanout_writer(void *arg) {
+	fanout_target *t = arg;
+	fanout *fan = t->fan;
+	cmd_opt *opt = fan->opt;
+	fanout_slot *slot;
+
+	pthread_mutex_lock(&fan->lock);
+	while (1) {
+		while (t->next == fan->head && !fan->closing)
+			pthread_cond_wait(&fan->filled, &fan->lock);
+		if (t->next == fan->head)
+			break;
+		slot = &fan->slots[t->next % fan->slot_count];
+		pthread_mutex_unlock(&fan->lock);
+
+		if (write_slot(t, slot, opt)) {
+			if (opt->skip_write_error) {
+				log_mesg(0, 0, 1, opt->debug, "skip write error on target %s at offset %llu:%s\n",
+					t->name, slot->offset, strerror(errno));
+			} else {
+				log_mesg(0, 0, 1, opt->debug, "target %s write ERROR at offset %llu:%s, dropping it\n",
+					t->name, slot->offset, strerror(errno));
+				pthread_mutex_lock(&fan->lock);
+				t->failed = 1;
+				fan->alive--;
+				pthread_cond_broadcast(&fan->drained);
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&fan->lock);
+		t->next++;
+		pthread_cond_broadcast(&fan->drained);
+	}
+	pthread_mutex_unlock(&fan->lock);
+
+	return NULL;
+}
+
+/// sequence number of the oldest slot still being written, call with the lock held
+static unsigned long long fanout_tail(fanout *fan) {
+	unsigned long long tail = fan->head;
+	int i;
+
+	for (i = 0; i < fan->target_count; i++)
+		if (!fan->targets[i].failed && fan->targets[i].next < tail)
+			tail = fan->targets[i].next;
+	return tail;
+}
+
+/// wait until the slowest target leaves a slot free and return it, NULL when every target failed
+static fanout_slot *fanout_get_slot(fanout *fan) {
+	pthread_mutex_lock(&fan->lock);
+	while (fan->alive && fan->head - fanout_tail(fan) >= fan->slot_count)
+		pthread_cond_wait(&fan->drained, &fan->lock);
+	if (!fan->alive) {
+		pthread_mutex_unlock(&fan->lock);
+		errno = EIO;
+		return NULL;
+	}
+	pthread_mutex_unlock(&fan->lock);
+
+	return &fan->slots[fan->head % fan->slot_count];
+}
+
+static void fanout_push(fanout *fan) {
+	pthread_mutex_lock(&fan->lock);
+	fan->head++;
+	pthread_cond_broadcast(&fan->filled);
+	pthread_mutex_unlock(&fan->lock);
+}
+
+fanout* fanout_open(int *fds, char **names, int count, unsigned int buffer_size, unsigned int lag, cmd_opt *opt) {
+	fanout *fan;
+	unsigned int i;
+	int t;
+
+	fan = calloc(1, sizeof(fanout));
+	if (fan == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	fan->slot_count = lag ? lag : 1;
+	fan->buffer_size = buffer_size;
+	fan->target_count = count;
+	fan->alive = count;
+	fan->opt = opt;
+	pthread_mutex_init(&fan->lock, NULL);
+	pthread_cond_init(&fan->filled, NULL);
+	pthread_cond_init(&fan->drained, NULL);
+
+	fan->slots = calloc(fan->slot_count, sizeof(fanout_slot));
+	fan->targets = calloc(count, sizeof(fanout_target));
+	if (fan->slots == NULL || fan->targets == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < fan->slot_count; i++) {
+		/// aligned for --write-direct-io
+		if (posix_memalign((void **)&fan->slots[i].buffer, BSIZE, buffer_size))
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+
+	log_mesg(1, 0, 0, opt->debug, "fanout: %i targets, %u slots of %u bytes\n", count, fan->slot_count, buffer_size);
+	for (t = 0; t < count; t++) {
+		fan->targets[t].fan = fan;
+		fan->targets[t].fd = fds[t];
+		fan->targets[t].name = names[t];
+		if (pthread_create(&fan->targets[t].thread, NULL, fanout_writer, &fan->targets[t]))
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+
+	return fan;
+}
+
+int fanout_write(fanout *fan, const char *buffer, unsigned long long size, unsigned long long offset) {
+	fanout_slot *slot;
+	unsigned long long chunk;
+
+	while (size) {
+		chunk = size < fan->buffer_size ? size : fan->buffer_size;
+		slot = fanout_get_slot(fan);
+		if (slot == NULL)
+			return -1;
+		memcpy(slot->buffer, buffer, chunk);
+		slot->size = chunk;
+		slot->offset = offset;
+		slot->zero = 0;
+		fanout_push(fan);
+
+		buffer += chunk;
+		offset += chunk;
+		size -= chunk;
+	}
+	return 0;
+}
+
+int fanout_zero(fanout *fan, unsigned long long size, unsigned long long offset) {
+	fanout_slot *slot;
+
+	if (!size)
+		return 0;
+	slot = fanout_get_slot(fan);
+	if (slot == NULL)
+		return -1;
+	slot->size = size;
+	slot->offset = offset;
+	slot->zero = 1;
+	fanout_push(fan);
+	return 0;
+}
+
+int fanout_close(fanout *fan) {
+	cmd_opt *opt = fan->opt;
+	unsigned int i;
+	int t, failed = 0;
+
+	pthread_mutex_lock(&fan->lock);
+	fan->closing = 1;
+	pthread_cond_broadcast(&fan->filled);
+	pthread_mutex_unlock(&fan->lock);
+
+	for (t = 0; t < fan->target_count; t++) {
+		fanout_target *target = &fan->targets[t];
+
+		if (pthread_join(target->thread, NULL))
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, thread join error\n", __func__, __LINE__);
+
+		if (!target->failed && fsync(target->fd) && errno != EINVAL) {
+			log_mesg(0, 0, 1, opt->debug, "target %s fsync ERROR:%s\n", target->name, strerror(errno));
+			target->failed = 1;
+		}
+		if (target->failed)
+			failed++;
+	}
+
+	for (i = 0; i < fan->slot_count; i++)
+		free(fan->slots[i].buffer);
+	free(fan->slots);
+	free(fan->targets);
+	pthread_mutex_destroy(&fan->lock);
+	pthread_cond_destroy(&fan->filled);
+	pthread_cond_destroy(&fan->drained);
+	free(fan);
+
+	return failed;
+}
@@ -0,0 +1,38 @@
+/**
+ * fanout.h - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * write one restore stream to several targets
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+typedef struct fanout fanout;
+
+/**
+ * Start one writer thread for each of the @count targets. Every target may
+ * fall @lag buffers of @buffer_size bytes behind the fastest one before it
+ * throttles the reader.
+ */
+extern fanout* fanout_open(int *fds, char **names, int count, unsigned int buffer_size, unsigned int lag, cmd_opt *opt);
+
+/// queue @size bytes of @buffer to be written at @offset of every target, -1 when every target failed
+extern int fanout_write(fanout *fan, const char *buffer, unsigned long long size, unsigned long long offset);
+
+/// queue @size bytes at @offset of every target to be zeroed, -1 when every target failed
+extern int fanout_zero(fanout *fan, unsigned long long size, unsigned long long offset);
+
+/**
+ * Wait until the writers have emptied the queue, sync the targets and free
+ * @fan. Returns the number of targets dropped because of an error.
+ */
+extern int fanout_close(fanout *fan);
+
+#endif /* FANOUT_H_ */
@@ -244,8 +244,6 @@ int check_fat_status() {
 /// mark reserved sectors as used
 static unsigned long long mark_reserved_sectors(unsigned long* fat_bitmap, unsigned long long block)
 {
-    unsigned long long i = 0;
-    unsigned long long j = 0;
     unsigned long long sec_per_fat = 0;
     unsigned long long root_sec = 0;
     sec_per_fat = get_sec_per_fat();
@@ -253,18 +251,17 @@ static unsigned long long mark_reserved_sectors(unsigned long* fat_bitmap, unsig
     root_sec = get_root_sec();
 
     /// A) the reserved sectors are used
-    for (i=0; i < fat_sb.reserved; i++,block++)
-        pc_set_bit(block, fat_bitmap, total_block);
+    pc_set_range(block, fat_sb.reserved, fat_bitmap, total_block);
+    block += fat_sb.reserved;
 
     /// B) the FAT tables are on used sectors
-    for (j=0; j < fat_sb.fats; j++)
-        for (i=0; i < sec_per_fat ; i++,block++)
-            pc_set_bit(block, fat_bitmap, total_block);
+    pc_set_range(block, fat_sb.fats * sec_per_fat, fat_bitmap, total_block);
+    block += fat_sb.fats * sec_per_fat;
 
     /// C) The rootdirectory is on used sectors
     if (root_sec > 0) /// no rootdir sectors on FAT32
-        for (i=0; i < root_sec; i++,block++)
-            pc_set_bit(block, fat_bitmap, total_block);
+        pc_set_range(block, root_sec, fat_bitmap, total_block);
+    block += root_sec;
     return block;
 }
 
@@ -302,84 +299,124 @@ static void fs_close()
     close(ret);
 }
 
-/// check per FAT32 entry
-unsigned long long check_fat32_entry(unsigned long* fat_bitmap, unsigned long long block, unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters)
-{
-    uint32_t Fat32_Entry = 0;
-    int rd = 0;
-    unsigned long long i = 0;
-
-    rd = read(ret, &Fat32_Entry, sizeof(Fat32_Entry));
-    if (rd == -1)
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat32_Entry error\n", __FILE__);
-    if (Fat32_Entry  == 0x0FFFFFF7) { /// bad FAT32 cluster
-        DamagedClusters++;
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else if (Fat32_Entry == 0x0000){ /// free
-        bfree++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else {
-        bused++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_set_bit(block, fat_bitmap, total_block);
-    }
+#define CLUSTER_FREE 0
+#define CLUSTER_USED 1
+#define CLUSTER_BAD  2
+#define FAT_CHUNK_ENTRIES (1ULL << 20)	/// FAT entries read at once, even for FAT12
 
-    return block;
-}
-
-/// check per FAT16 entry
-unsigned long long check_fat16_entry(unsigned long* fat_bitmap, unsigned long long block, unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters)
+/// set or clear the sectors of clusters [first, end) and count them
+static void mark_clusters(unsigned long* fat_bitmap, unsigned long long block, int state,
+	unsigned long long first, unsigned long long end,
+	unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters)
 {
-    uint16_t Fat16_Entry = 0;
-    int rd = 0;
-    unsigned long long i = 0;
-    rd = read(ret, &Fat16_Entry, sizeof(Fat16_Entry));
-    if (rd == -1)
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat16_Entry error\n", __FILE__);
-    if (Fat16_Entry  == 0xFFF7) { /// bad FAT16 cluster
-        DamagedClusters++;
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else if (Fat16_Entry == 0x0000){ /// free
-        bfree++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else {
-        bused++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_set_bit(block, fat_bitmap, total_block);
+    unsigned long long start = block + first * fat_sb.cluster_size;
+    unsigned long long count = (end - first) * fat_sb.cluster_size;
+
+    if (first >= end)
+        return;
+    if (state == CLUSTER_USED) {
+        *bused += end - first;
+        pc_set_range(start, count, fat_bitmap, total_block);
+        return;
     }
-    return block;
+    if (state == CLUSTER_BAD) {
+        *DamagedClusters += end - first;
+        log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, start);
+    } else
+        *bfree += end - first;
+    pc_clear_range(start, count, fat_bitmap, total_block);
 }
 
-/// check per FAT12 entry
-unsigned long long check_fat12_entry(unsigned long* fat_bitmap, unsigned long long block, unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters)
+/**
+ * Mark the sectors of the @cluster_count clusters starting at sector @block.
+ * The FAT is read FAT_CHUNK_ENTRIES entries at a time and each run of
+ * clusters in the same state becomes one range. On FAT16 and FAT32, free
+ * entries are skipped a whole word at a time. When the FAT can't be read,
+ * the error is logged and the clusters from there on are marked as used.
+ * Returns the sector after the last cluster.
+ */
+static unsigned long long scan_fat(unsigned long* fat_bitmap, unsigned long long block, unsigned long long cluster_count,
+	unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters, progress_bar* prog)
 {
-    uint16_t Fat12_Entry = 0;
-    int rd = 0;
-    unsigned long long i = 0;
-    rd = read12(&Fat12_Entry);
-    if (rd == -1)
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: read Fat12_Entry error\n", __FILE__);
-    if (Fat12_Entry == 0xFF7) { /// bad FAT12 cluster
-        DamagedClusters++;
-        log_mesg(2, 0, 0, fs_opt.debug, "%s: bad sec %llu\n", __FILE__, block);
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else if (Fat12_Entry == 0x000) { /// free
-        bfree++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_clear_bit(block, fat_bitmap, total_block);
-    } else {
-        bused++;
-        for (i=0; i < fat_sb.cluster_size; i++,block++)
-            pc_set_bit(block, fat_bitmap, total_block);
+    unsigned long long fat_start = (unsigned long long)fat_sb.sector_size * fat_sb.reserved;
+    unsigned long long first, n, i, run_start = 0, offset;
+    unsigned int entry_size = FS == FAT_32 ? 4 : 2;	/// FAT12 packs two entries in 3 bytes
+    unsigned int per_word = sizeof(uint64_t) / entry_size;
+    uint32_t entry, bad;
+    uint64_t word;
+    unsigned char* buf;
+    size_t bytes, done;
+    ssize_t rd;
+    int run_state = CLUSTER_USED, state;
+
+    bad = FS == FAT_32 ? 0x0FFFFFF7 : FS == FAT_16 ? 0xFFF7 : 0xFF7;
+    buf = malloc(FAT_CHUNK_ENTRIES * entry_size);
+    if (buf == NULL)
+        log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+    /// the first cluster is FAT entry 2
+    for (first = 0; first < cluster_count; first += n) {
+        n = cluster_count - first;
+        if (n > FAT_CHUNK_ENTRIES)
+            n = FAT_CHUNK_ENTRIES;
+        if (FS == FAT_12) {
+            offset = (first + 2) * 3 / 2;
+            bytes = (n * 3 + 1) / 2;
+        } else {
+            offset = (first + 2) * entry_size;
+            bytes = n * entry_size;
+        }
+        for (done = 0; done < bytes; done += rd) {
+            rd = pread(ret, buf + done, bytes - done, fat_start + offset + done);
+            if (rd <= 0) {
+                log_mesg(2, 0, 0, fs_opt.debug, "%s: read FAT error at entry %llu\n", __FILE__, first + 2);
+                break;
+            }
+        }
+        if (done < bytes) {
+            /// the FAT can't tell the state of the remaining clusters, copy them
+            mark_clusters(fat_bitmap, block, run_state, run_start, first, bfree, bused, DamagedClusters);
+            run_state = CLUSTER_USED;
+            run_start = first;
+            first = cluster_count;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (run_state == CLUSTER_FREE && FS != FAT_12 && i % per_word == 0) {
+                for (; i + per_word <= n; i += per_word) {
+                    memcpy(&word, buf + i * entry_size, sizeof(word));
+                    if (word)
+                        break;
+                }
+                if (i >= n)
+                    break;
+            }
+            if (FS == FAT_32)
+                entry = (uint32_t)buf[i * 4] | (uint32_t)buf[i * 4 + 1] << 8 |
+                    (uint32_t)buf[i * 4 + 2] << 16 | (uint32_t)buf[i * 4 + 3] << 24;
+            else if (FS == FAT_16)
+                entry = (uint32_t)buf[i * 2] | (uint32_t)buf[i * 2 + 1] << 8;
+            else {
+                /// chunks start on an even entry, so i tells the nibble
+                entry = (uint32_t)buf[i * 3 / 2] | (uint32_t)buf[i * 3 / 2 + 1] << 8;
+                entry = (i & 1) ? entry >> 4 : entry & 0xFFF;
+            }
+            state = entry == 0 ? CLUSTER_FREE : entry == bad ? CLUSTER_BAD : CLUSTER_USED;
+            if (state != run_state) {
+                mark_clusters(fat_bitmap, block, run_state, run_start, first + i, bfree, bused, DamagedClusters);
+                run_state = state;
+                run_start = first + i;
+            }
+        }
+        /// update progress
+        if (prog)
+            update_pui(prog, first + n, first + n, 0);
     }
-    return block;
+    mark_clusters(fat_bitmap, block, run_state, run_start, first, bfree, bused, DamagedClusters);
+    free(buf);
+
+    return block + cluster_count * fat_sb.cluster_size;
 }
 
 void read_super_blocks(char* device, file_system_info* fs_info)
@@ -415,7 +452,6 @@ void read_super_blocks(char* device, file_system_info* fs_info)
 
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
-    unsigned long long i = 0;
     int fat_stat = 0;
     unsigned long long block = 0, bfree = 0, bused = 0, DamagedClusters = 0;
     unsigned long long cluster_count = 0;
@@ -466,21 +502,8 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
             log_mesg(0, 1, 1, fs_opt.debug, "%s: I/O error! %X\n", __FILE__);
     }
 
-    for (i=0; i < cluster_count; i++){
-	if (block >= total_sector)
-            log_mesg(1, 0, 0, fs_opt.debug, "%s: error block too large\n", __FILE__);
-        /// If FAT16
-        if(FS == FAT_16){
-            block = check_fat16_entry(bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else if (FS == FAT_32){ /// FAT32
-            block = check_fat32_entry(bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else if (FS == FAT_12){ /// FAT12
-            block = check_fat12_entry(bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else 
-            log_mesg(2, 0, 0, fs_opt.debug, "%s: error fs\n", __FILE__);
-        /// update progress
-        update_pui(&prog, i, i, 0);//keep update
-    }
+    block = scan_fat(bitmap, block, cluster_count, &bfree, &bused, &DamagedClusters, &prog);
+    log_mesg(2, 0, 0, fs_opt.debug, "%s: used clusters %llu, free clusters %llu, bad clusters %llu\n", __FILE__, bused, bfree, DamagedClusters);
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s: done\n", __FILE__);
     fs_close();
@@ -492,7 +515,6 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 /// get_used_block - get FAT used blocks
 static unsigned long long get_used_block()
 {
-    unsigned long long i = 0;
     int fat_stat = 0;
     unsigned long long block = 0, bfree = 0, bused = 0, DamagedClusters = 0;
     unsigned long long cluster_count = 0, total_sector = 0;
@@ -527,32 +549,12 @@ static unsigned long long get_used_block()
     else if (fat_stat == 2)
         log_mesg(0, 1, 1, fs_opt.debug, "%s: I/O error! %X\n", __FILE__);
 
-    for (i=0; i < cluster_count; i++){
-	if (block >= total_sector)
-            log_mesg(1, 0, 0, fs_opt.debug, "%s: error block too large\n", __FILE__);
-        /// If FAT16
-        if(FS == FAT_16){
-            block = check_fat16_entry(fat_bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else if (FS == FAT_32){ /// FAT32
-            block = check_fat32_entry(fat_bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else if (FS == FAT_12){ /// FAT12
-            block = check_fat12_entry(fat_bitmap, block, &bfree, &bused, &DamagedClusters);
-        } else 
-            log_mesg(2, 0, 0, fs_opt.debug, "%s: error fs\n", __FILE__);
-    }
-
-    while(block < total_sector){
-        pc_set_bit(block, fat_bitmap, total_block);
-        block++;
-    }
+    block = scan_fat(fat_bitmap, block, cluster_count, &bfree, &bused, &DamagedClusters, NULL);
 
+    if (block < total_sector)
+        pc_set_range(block, total_sector - block, fat_bitmap, total_block);
 
-    for (block = 0; block < total_sector; block++)
-    {
-        if (pc_test_bit(block, fat_bitmap, total_block)) {
-            real_back_block++;
-        }
-    }
+    real_back_block = pc_count_bits(0, total_sector, fat_bitmap, total_block);
     free(fat_bitmap);
     log_mesg(2, 0, 0, fs_opt.debug, "%s: get_used_block down\n", __FILE__);
 
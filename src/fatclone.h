@@ -100,9 +100,3 @@ unsigned long long get_cluster_count();
 /// check fat statu
 extern int check_fat_status();
 
-/// check per FAT32 entry
-unsigned long long check_fat32_entry(unsigned long* fat_bitmap, unsigned long long block, unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters);
-
-
-/// check per FAT16 entry
-unsigned long long check_fat16_entry(unsigned long* fat_bitmap, unsigned long long block, unsigned long long* bfree, unsigned long long* bused, unsigned long long* DamagedClusters);
@@ -31,6 +31,7 @@
 
 #define MAX_HFSPLUS_TOTAL_BLOCKS (1ULL << 40) // Max total blocks (approx 512TB @ 512B/block) to prevent DoS/memory exhaustion
 #define MAX_HFSPLUS_ALLOC_FILE_SIZE (1ULL << 30) // Max allocation file size (1GB) to prevent memory exhaustion
+#define ALLOCATION_CHUNK (1ULL << 20) // bytes of the allocation file read at once
 
 struct HFSPlusVolumeHeader sb;
 static struct HFSVolumeHeader hsb;
@@ -176,48 +177,56 @@ static void fs_close(){
 
 }
 
-// Set/clear multiple bits, for when a single HFS+ block corresponds to multiple partclone blocks
-static void pc_set_bit_many(UInt32 block_offset, UInt32 block, unsigned long* bitmap, UInt32 total_block, int bits_per_block) {
-    int i;
-    // This should never overflow:
-    // On a regular HFS+ volume, bits_per_block will be one.
-    // On a wrapped volume, the HFS wrapper is limited to 2 TB.
-    unsigned long int start = (block_offset + block) * bits_per_block;
-    for (i = 0; i < bits_per_block; i++) {
-        pc_set_bit(start + i, bitmap, total_block);
-    }
-}
-static void pc_clear_bit_many(UInt32 block_offset, UInt32 block, unsigned long* bitmap, UInt32 total_block, int bits_per_block) {
-    int i;
-    unsigned long int start = (block_offset + block) * bits_per_block;
-    for (i = 0; i < bits_per_block; i++) {
-        pc_clear_bit(start + i, bitmap, total_block);
+// Set/clear multiple bits, for when a single HFS+ block corresponds to a number of partclone blocks
+// that is not a power of two. Returns how many of the @count allocation blocks are used.
+static UInt32 spread_blocks_many(unsigned long long start, UInt8* allocation, UInt32 count, unsigned long* bitmap, unsigned long long total_block, int bits_per_block) {
+    UInt32 block, used = 0;
+
+    for (block = 0; block < count; block++, start += bits_per_block) {
+        if (IsAllocationBlockUsed(block, allocation)) {
+            used++;
+            pc_set_range(start, bits_per_block, bitmap, total_block);
+        } else {
+            pc_clear_range(start, bits_per_block, bitmap, total_block);
+        }
     }
+    return used;
 }
 
 // Device should already be open, bitmap allocated, and progress_bar initialized
 // block_offset = how many HFS+ blocks from the start of the device does the HFS+ volume start
 void read_allocation_file(file_system_info *fs_info, unsigned long *bitmap, progress_bar *prog, UInt32 block_offset, int bits_per_block) {
 
-    int IsUsed = 0;
     UInt8 *extent_bitmap;
     UInt32 block_size = 0;
-    UInt32 bused = 0, bfree = 0, mused = 0;
-    UInt32 block = 0, extent_block = 0, tb = 0;
+    UInt32 bused = 0, bfree = 0, mused = 0, used = 0;
+    UInt32 block = 0, count = 0, tb = 0;
     int allocation_exten = 0;
+    int shift = -1;
     UInt64 allocation_start_block, byte_offset, allocation_block_physical;
-    UInt64 allocation_block_size;
+    UInt64 allocation_block_size, done, bytes;
+    unsigned long long start;
 
     tb = be32toh(sb.totalBlocks);
     block_size = be32toh(sb.blockSize);
     byte_offset = (UInt64)block_offset * block_size;
 
+    // On a wrapped volume one HFS+ block is usually a power of two partclone blocks
+    if (bits_per_block > 0 && (bits_per_block & (bits_per_block - 1)) == 0)
+        shift = __builtin_ctz(bits_per_block);
+
+    extent_bitmap = (UInt8*)malloc(ALLOCATION_CHUNK);
+    if (!extent_bitmap) {
+        log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for extent_bitmap: %s\n", __FILE__, strerror(errno));
+        return;
+    }
+
     for (allocation_exten = 0; allocation_exten <= 7; allocation_exten++){
         allocation_start_block = (UInt64)block_size*be32toh(sb.allocationFile.extents[allocation_exten].startBlock);
         allocation_block_size = (UInt64)block_size*be32toh(sb.allocationFile.extents[allocation_exten].blockCount);
 
         log_mesg(2, 0, 0, 2, "%s: tb = %u\n", __FILE__, tb);
-        log_mesg(2, 0, 0, 2, "%s: extent_block = %u\n", __FILE__, extent_block);
+        log_mesg(2, 0, 0, 2, "%s: block = %u\n", __FILE__, block);
         log_mesg(2, 0, 0, 2, "%s: allocation_exten = %i\n", __FILE__, allocation_exten);
         log_mesg(2, 0, 0, 2, "%s: allocation_start_block = %llu\n", __FILE__, allocation_start_block);
         log_mesg(2, 0, 0, 2, "%s: allocation_block_size = %llu\n", __FILE__, allocation_block_size);
@@ -229,54 +238,50 @@ void read_allocation_file(file_system_info *fs_info, unsigned long *bitmap, prog
         if (allocation_block_size > MAX_HFSPLUS_ALLOC_FILE_SIZE) {
             log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Maliciously large allocation_block_size detected: %llu. Max allowed: %llu\n",
                      allocation_block_size, MAX_HFSPLUS_ALLOC_FILE_SIZE);
+            free(extent_bitmap);
             return; // Abort
         }
 
         allocation_block_physical = byte_offset + allocation_start_block;
-        if(lseek(ret, allocation_block_physical, SEEK_SET) != (off_t)allocation_block_physical) {
-	     log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: start_block %llu seek fail: %s\n", __FILE__, allocation_block_physical, strerror(errno));
-             return;
-        }
-        extent_bitmap = (UInt8*)malloc(allocation_block_size);
-        if (!extent_bitmap) {
-            log_mesg(0, 1, 1, fs_opt.debug, "%s: ERROR: malloc error for extent_bitmap: %s\n", __FILE__, strerror(errno));
-            return;
-        }
-        ssize_t read_size = read(ret, extent_bitmap, allocation_block_size);
-        if(read_size != (ssize_t)allocation_block_size) {
-	    log_mesg(0, 0, 1, fs_opt.debug, "%s: ERROR: read hfsp bitmap fail (read %zd, expected %llu): %s\n", __FILE__, read_size, allocation_block_size, strerror(errno));
-            free(extent_bitmap);
-            return;
-        }
-        for(extent_block = 0 ; (extent_block < allocation_block_size*8) && (block< tb); extent_block++){
-            IsUsed = IsAllocationBlockUsed(extent_block, extent_bitmap);
-            if (IsUsed){
-                bused++;
-                pc_set_bit_many(block_offset, block, bitmap, fs_info->totalblock, bits_per_block);
-                log_mesg(3, 0, 0, fs_opt.debug, "%s: used block= %u\n", __FILE__, block);
-            } else {
-                bfree++;
-                pc_clear_bit_many(block_offset, block, bitmap, fs_info->totalblock, bits_per_block);
-                log_mesg(3, 0, 0, fs_opt.debug, "%s: free block= %u\n", __FILE__, block);
+        for (done = 0; (done < allocation_block_size) && (block < tb); done += bytes) {
+            bytes = allocation_block_size - done;
+            if (bytes > ALLOCATION_CHUNK)
+                bytes = ALLOCATION_CHUNK;
+            ssize_t read_size = pread(ret, extent_bitmap, bytes, allocation_block_physical + done);
+            if(read_size != (ssize_t)bytes) {
+                log_mesg(0, 0, 1, fs_opt.debug, "%s: ERROR: read hfsp bitmap fail at %llu (read %zd, expected %llu): %s\n", __FILE__, allocation_block_physical + done, read_size, bytes, strerror(errno));
+                free(extent_bitmap);
+                return;
             }
-            block++;
+
+            count = tb - block;
+            if (count > bytes * 8)
+                count = bytes * 8;
+            // The allocation file numbers its bits from the most significant one of each byte
+            start = ((unsigned long long)block_offset + block) * bits_per_block;
+            if (bits_per_block == 1)
+                used = pc_import_bits(start, extent_bitmap, count, PC_BITS_MSB_FIRST, bitmap, fs_info->totalblock);
+            else if (shift > 0)
+                used = pc_spread_bits(start, extent_bitmap, count, shift, PC_BITS_MSB_FIRST, bitmap, fs_info->totalblock) >> shift;
+            else
+                used = spread_blocks_many(start, extent_bitmap, count, bitmap, fs_info->totalblock, bits_per_block);
+            bused += used;
+            bfree += count - used;
+            block += count;
             /// update progress
             update_pui(prog, block, block, 0);
-
         }
         log_mesg(2, 0, 0, 2, "%s: next exten\n", __FILE__);
-        log_mesg(2, 0, 0, 2, "%s: extent_bitmap:%p\n", __FILE__, extent_bitmap);
-        free(extent_bitmap);
         log_mesg(2, 0, 0, 2, "%s: bfree:%u\n", __FILE__, bfree);
         log_mesg(2, 0, 0, 2, "%s: bused:%u\n", __FILE__, bused);
     }
+    free(extent_bitmap);
     mused = (be32toh(sb.totalBlocks) - be32toh(sb.freeBlocks));
     if(bused != mused)
         log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap count error, used:%lu, mbitmap:%lu\n", __FILE__, bused, mused);
 }
 
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui) {
-    int i = 0;
     int bits_per_block = 1;
     UInt64 embed_offset = 0, embed_end = 0;
     UInt32 allocation_blocks = 0, block_size = 0, block_offset = 0;
@@ -300,10 +305,10 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
         bits_per_block = block_size / fs_info.block_size;
 
         // Initialize the bitmap with wrapper blocks (start + end)
-        for (i = 0; i < embed_offset / fs_info.block_size; i++)
-            pc_set_bit(i, bitmap, fs_info.totalblock);
-        for (i = embed_end; i < fs_info.totalblock; i++)
-            pc_set_bit(i, bitmap, fs_info.totalblock);
+        if (embed_offset / fs_info.block_size < fs_info.totalblock)
+            pc_set_range(0, embed_offset / fs_info.block_size, bitmap, fs_info.totalblock);
+        if (embed_end / fs_info.block_size < fs_info.totalblock)
+            pc_set_range(embed_end / fs_info.block_size, fs_info.totalblock - embed_end / fs_info.block_size, bitmap, fs_info.totalblock);
     }
 
     read_allocation_file(&fs_info, bitmap, &prog, block_offset, bits_per_block);
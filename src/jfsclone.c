@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <endian.h>
 #include <linux/types.h>
 
 #include <jfs/jfs_types.h>
@@ -72,7 +73,6 @@ static int decode_pagenum(int64_t page, int *l1, int *l0, int *dmap);
 static int find_iag(unsigned iagnum, unsigned which_table, int64_t * address);
 static int find_inode(unsigned inum, unsigned which_table, int64_t * address);
 static int xRead(int64_t, unsigned, char *);
-static int jfs_bit_inuse(unsigned *bitmap, uint64_t block);
 static int get_all_used_blocks(uint64_t *total_blocks, uint64_t *used_blocks);
 
 struct superblock sb;
@@ -141,7 +141,8 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     int dmap_l2bpp;
     int64_t d_address;
     struct dmap d_map;
-    int dmap_i, l0, l1;
+    uint32_t wmap[LPERDMAP];
+    int dmap_i, l0, l1, w;
     int next = 1;
     uint64_t tub=0;
     int64_t tb=0;
@@ -265,25 +266,18 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
 	/// display bitmap  
 
-	block_used = 0;
-	for (pb = 0; (pb < d_map.nblocks) && (tb < dn_mapsize); pb++){
-
-	    if (tb > dn_mapsize)
-		break;
-
-	    if (jfs_bit_inuse(d_map.wmap, pb) == 1){
-		block_used++;
-		log_mesg(3, 0, 0, fs_opt.debug, "%s: used pb = %lli tb = %lli\n", __FILE__, pb, tb);
-		pc_set_bit(tb, bitmap, fs_info.totalblock);
-	    } else {
-		block_free++;
-		log_mesg(3, 0, 0, fs_opt.debug, "%s: free pb = %lli tb = %lli\n", __FILE__, pb, tb);
-		pc_clear_bit(tb, bitmap, fs_info.totalblock);
-	    }
-	    tb++;
-	    update_pui(&prog, tb, tb, 0);//keep update
-
-	}
+	/// wmap bit pb is bit (31 - pb % 32) of word pb / 32, make it a MSB first byte stream
+	pb = d_map.nblocks;
+	if (pb > BPERDMAP)
+	    pb = BPERDMAP;
+	if (pb > dn_mapsize - tb)
+	    pb = dn_mapsize - tb;
+	for (w = 0; w < LPERDMAP; w++)
+	    wmap[w] = htobe32(d_map.wmap[w]);
+	block_used = pc_import_bits(tb, (unsigned char *)wmap, pb, PC_BITS_MSB_FIRST, bitmap, fs_info.totalblock);
+	block_free = pb - block_used;
+	tb += pb;
+	update_pui(&prog, tb, tb, 0);//keep update
 
 	log_mesg(2, 0, 0, fs_opt.debug, "%s:block_used %lli block_free %lli\n", __FILE__, block_used, block_free);
 	tub += block_used;
@@ -295,16 +289,15 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     /// log
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s:%llu log %llu\n", __FILE__, logloc, (logloc+logsize));
-    for (;tb < fs_info.totalblock; tb++){
-
-	if ((tb >= logloc) && (tb < (logloc+logsize))){
-	    pc_set_bit(tb, bitmap, fs_info.totalblock);
-	    block_used++;
-	    log_mesg(3, 0, 0, fs_opt.debug, "%s: log used tb = %llu\n", __FILE__, tb);
-	}
-	update_pui(&prog, tb, tb, 0);//keep update
+    /// the blocks past the map are left used, count the log among them
+    if (logloc + logsize > (uint64_t)tb && logloc < fs_info.totalblock) {
+	uint64_t log_start = logloc > (uint64_t)tb ? logloc : (uint64_t)tb;
+	uint64_t log_end = logloc + logsize < fs_info.totalblock ? logloc + logsize : fs_info.totalblock;
 
+	pc_set_range(log_start, log_end - log_start, bitmap, fs_info.totalblock);
+	block_used = log_end - log_start;
     }
+    update_pui(&prog, fs_info.totalblock, fs_info.totalblock, 0);//keep update
 
     log_mesg(2, 0, 0, fs_opt.debug, "%s:log_used = %llu\n", __FILE__, block_used);
     log_mesg(1, 0, 0, fs_opt.debug, "%s:total_used = %llu\n", __FILE__, tub+block_used);
@@ -560,18 +553,5 @@ descend:
     return 1;
 }
 
-int jfs_bit_inuse(unsigned *bitmap, uint64_t block){
-    uint64_t byte = 0;
-    int bit = 0;
-
-    byte = block/32;
-    bit  = 31 - (block%32);
-    log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap = %08x\n", __FILE__, bitmap[byte]);	
-
-    if(bitmap[byte] & (1<<bit))
-	return 1;
-    else
-	return 0;
-}
 
 
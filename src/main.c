@@ -50,6 +50,9 @@ progress_bar prog;
 unsigned long long copied;
 unsigned long long block_id;
 int done;
+/// wakes the progress thread when the copy is done
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
 
 #include "partclone.h"
 
@@ -57,6 +60,10 @@ int done;
 cmd_opt opt;
 
 #include "checksum.h"
+#include "fanout.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "tune.h"
 
 /// fs option
 #include "fs_common.h"
@@ -105,6 +112,14 @@ int main(int argc, char **argv) {
 	image_options    img_opt;
 
 	int target_stdout = 0;
+	int raw_zero_fill = 0;			/// holes of raw images are zeroed on the target
+	int target_fds[MAX_TARGETS];		/// every target when restoring to several
+#ifndef CHKIMG
+	fanout *fan = NULL;
+#endif
+	checkpoint cp;				/// where an interrupted copy resumes
+	source_readahead ra;			/// page cache hints of the source
+	int i;
 
 	init_fs_info(&fs_info);
 	init_image_options(&img_opt);
@@ -184,10 +199,21 @@ int main(int argc, char **argv) {
 	if (strcmp(target, "-") == 0) {
 		target_stdout = 1;
 	}
+	target_fds[0] = dfw;
+	for (i = 1; i < opt.target_count; i++) {
+		target_fds[i] = open_target(opt.targets[i], &opt);
+		if (target_fds[i] == -1) {
+			log_mesg(0, 1, 1, debug, "Error exit\n");
+		}
+	}
 #else
 	dfw = -1;
 #endif
 
+	/// before the buffer size sets the blocks per checksum of the image
+	if (opt.auto_tune)
+		auto_tune(dfr, target_fds, dfw == -1 ? 0 : opt.target_count, &opt);
+
 	/**
 	 * get partition information like super block, bitmap from device or image file.
 	 */
@@ -289,11 +315,14 @@ int main(int argc, char **argv) {
 		/// check the dest partition size.
 		if (target_stdout)
 			;
-		else if (opt.restore_raw_file)
-			check_free_space(target, fs_info.device_size);
-		else if ((opt.check) && (opt.blockfile == 0))
-			check_size(&dfw, fs_info.device_size);
-		else if (opt.blockfile == 1 && opt.torrent_only == 0)
+		else if (opt.restore_raw_file) {
+			for (i = 0; i < opt.target_count; i++)
+				check_free_space(opt.targets[i], fs_info.device_size);
+		}
+		else if ((opt.check) && (opt.blockfile == 0)) {
+			for (i = 0; i < opt.target_count; i++)
+				check_size(&target_fds[i], fs_info.device_size);
+		} else if (opt.blockfile == 1 && opt.torrent_only == 0)
 			check_free_space(target, fs_info.usedblocks*fs_info.block_size);
 #endif
 
@@ -410,6 +439,15 @@ int main(int argc, char **argv) {
 
 	print_file_system_info(fs_info, opt);
 
+#ifndef CHKIMG
+	/**
+	 * a raw image has no file system to tell which blocks are free, the blocks
+	 * it leaves out are holes and have to read back as zeros
+	 */
+	if (strcmp(fs_info.fs, raw_MAGIC) == 0 && !target_stdout && opt.blockfile == 0)
+		raw_zero_fill = 1;
+#endif
+
 	/**
 	 * initial progress bar
 	 */
@@ -427,6 +465,7 @@ int main(int argc, char **argv) {
         if (opt.prog_second)
             strncpy(prog.time_unit, "sec", 4);
 	copied = 0;				/// initial number is 0
+	metrics_open(&fs_info, &opt);
 
 	/**
 	 * thread to print progress
@@ -490,12 +529,38 @@ int main(int argc, char **argv) {
 		}
 
 		block_id = 0;
+		if (opt.checkpoint) {
+			checkpoint_init(&cp, 'c', &fs_info, &img_opt, bitmap, &opt);
+			if (opt.resume) {
+				if (checkpoint_load(&cp, checksum, &opt)) {
+					block_id = cp.block_id;
+					copied = cp.copied;
+					blocks_in_cs = cp.blocks_in_cs;
+					if (lseek(dfw, cp.image_offset, SEEK_SET) == (off_t)-1)
+						log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+				}
+				/// drop what was written after the checkpoint
+				if (ftruncate(dfw, lseek(dfw, 0, SEEK_CUR)) == -1)
+					log_mesg(0, 1, 1, debug, "ftruncate ERROR:%s\n", strerror(errno));
+			}
+		}
+
+		readahead_init(&ra, dfr, bitmap, blocks_total, block_size, buffer_capacity, block_id, &opt);
+		metrics_stage_start();
 		do {
 			/// scan bitmap
-			unsigned long long i, blocks_skip, blocks_read;
+			unsigned long long i, blocks_skip, blocks_read, read_size;
 			unsigned int cs_added = 0, write_offset = 0;
 			off_t offset;
 
+			if (opt.checkpoint && checkpoint_due(&opt)) {
+				cp.block_id = block_id;
+				cp.copied = copied;
+				cp.blocks_in_cs = blocks_in_cs;
+				cp.image_offset = lseek(dfw, 0, SEEK_CUR);
+				checkpoint_save(&cp, dfw, checksum, &opt);
+			}
+
 			/// skip unused blocks
 			for (blocks_skip = 0;
 			     block_id + blocks_skip < blocks_total &&
@@ -515,22 +580,31 @@ int main(int argc, char **argv) {
 			if (!blocks_read)
 				break;
 
+			readahead_next(&ra, block_id);
 			offset = (off_t)(block_id * block_size);
 			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
 				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
 
-			r_size = read_all(&dfr, read_buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
+			/// the last block of a raw device can be partial, pad it with zeros
+			read_size = cnv_blocks_to_device_bytes(block_id, blocks_read, block_size, fs_info.device_size);
+			if (read_size < blocks_read * block_size)
+				memset(read_buffer + read_size, 0, blocks_read * block_size - read_size);
+			metrics_stage(STAGE_SCAN);
+
+			r_size = read_all(&dfr, read_buffer, read_size, &opt);
+			if (r_size != (int)read_size) {
 				if ((r_size == -1) && (errno == EIO)) {
 					if (opt.rescue) {
 						memset(read_buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, read_buffer + r_size, &opt);
+						rescue_range(&dfr, offset, read_buffer, read_size, &opt);
 					} else
 						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 				} else
 					log_mesg(0, 1, 1, debug, "read error: %s\n", strerror(errno));
 			}
+			r_size = blocks_read * block_size;
+			readahead_done(&ra, block_id + blocks_read);
+			metrics_stage(STAGE_READ);
 
 			log_mesg(2, 0, 0, debug, "blocks_read = %i\n", blocks_read);
 
@@ -540,6 +614,7 @@ int main(int argc, char **argv) {
 
 					memcpy(write_buffer + write_offset,
 						read_buffer + i * block_size, block_size);
+					metrics_stage(STAGE_MEMCPY);
 
 					write_offset += block_size;
 
@@ -560,6 +635,7 @@ int main(int argc, char **argv) {
 						if (cs_reseed)
 							init_checksum(img_opt.checksum_mode, checksum, debug);
 					}
+					metrics_stage(STAGE_CHECKSUM);
 				}
 			}
 
@@ -567,16 +643,19 @@ int main(int argc, char **argv) {
 			if (opt.blockfile == 1) {
 				update_bt_info(&bt, block_id * block_size, read_buffer,
 					       blocks_read * block_size);
+				metrics_stage(STAGE_CHECKSUM);
 
 				if (opt.torrent_only == 1) {
 					w_size = blocks_read * block_size;
 				} else {
 					w_size = write_block_file(target, read_buffer, blocks_read * block_size, block_id * block_size, &opt);
 				}
+				metrics_stage(STAGE_WRITE);
 			} else {
 				w_size = write_all(&dfw, write_buffer, write_offset, &opt);
 				if (w_size != write_offset)
 					log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
+				metrics_stage(opt.compresscmd ? STAGE_PIPE : STAGE_WRITE);
 			}
 
 			/// count copied block
@@ -706,6 +785,27 @@ int main(int argc, char **argv) {
 		}
 
 		block_id = 0;
+#ifndef CHKIMG
+		/// the image is read and verified once and written by one thread per target
+		if (opt.target_count > 1)
+			fan = fanout_open(target_fds, opt.targets, opt.target_count,
+				buffer_capacity * block_size, opt.target_lag, &opt);
+
+		if (opt.checkpoint) {
+			checkpoint_init(&cp, 'r', &fs_info, &img_opt, bitmap, &opt);
+			if (opt.resume && checkpoint_load(&cp, checksum, &opt)) {
+				block_id = cp.block_id;
+				copied = cp.copied;
+				blocks_in_cs = cp.blocks_in_cs;
+				if (lseek(dfr, cp.image_offset, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+				if (lseek(dfw, opt.offset + block_id * block_size, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+			}
+		}
+#endif
+
+		metrics_stage_start();
 		do {
 			unsigned int i;
 			unsigned long long blocks_written, blocks_skip;
@@ -715,6 +815,16 @@ int main(int argc, char **argv) {
 				buffer_capacity : blocks_used - copied;
 			if (!blocks_read)
 			    break;
+
+#ifndef CHKIMG
+			if (opt.checkpoint && checkpoint_due(&opt)) {
+				cp.block_id = block_id;
+				cp.copied = copied;
+				cp.blocks_in_cs = blocks_in_cs;
+				cp.image_offset = lseek(dfr, 0, SEEK_CUR);
+				checkpoint_save(&cp, dfw, checksum, &opt);
+			}
+#endif
 			if (blocks_read < 0)
 			    log_mesg(0, 1, 1, debug, "blocks_read ERROR: impossible size of blocks_read\n");
 
@@ -735,6 +845,7 @@ int main(int argc, char **argv) {
 			r_size = read_all(&dfr, read_buffer, read_size, &opt);
 			if (r_size != read_size)
 				log_mesg(0, 1, 1, debug, "read ERROR:%s\n", strerror(errno));
+			metrics_stage(STAGE_READ);
 
 			// read buffer is the follows:
 			// <blocks_per_cs><cs1><blocks_per_cs><cs2>...
@@ -747,6 +858,7 @@ int main(int argc, char **argv) {
 
 				memcpy(write_buffer + i * block_size,
 					read_buffer + read_offset, block_size);
+				metrics_stage(STAGE_MEMCPY);
 
 				if (opt.ignore_crc) {
 					read_offset += block_size;
@@ -771,6 +883,7 @@ int main(int argc, char **argv) {
 				    free(checksum_str);
 				    free(checksum_orig_str);
 					if (memcmp(read_buffer + read_offset + block_size, checksum, cs_size)) {
+					    pc_count(checksum_errors, 1);
 					    log_mesg(0, 1, 1, debug, "checksum error, block_id=%llu...\n ", block_id + i);
 					}
 
@@ -782,6 +895,7 @@ int main(int argc, char **argv) {
 				}
 
 				read_offset += block_size;
+				metrics_stage(STAGE_CHECKSUM);
 			}
 			if (!opt.ignore_crc && blocks_in_cs && blocks_per_cs && blocks_read < buffer_capacity &&
 					(blocks_read % blocks_per_cs)) {
@@ -797,9 +911,10 @@ int main(int argc, char **argv) {
 				log_mesg(1, 0, 0, debug, "checksum_code.orig = %s \n", checksum_orig_str);
 				free(checksum_str);
 				free(checksum_orig_str);
+				pc_count(checksum_errors, 1);
 				log_mesg(0, 1, 1, debug, "checksum error, block_id=%llu...\n ", block_id + i);
 			    }
-
+			    metrics_stage(STAGE_CHECKSUM);
 			}
 
 
@@ -816,7 +931,15 @@ int main(int argc, char **argv) {
 #ifndef CHKIMG
 				/// skip empty blocks
 				if (blocks_write == 0) {
-				    if (opt.blockfile == 0 && blocks_skip > 0 && skip_blocks(&dfw, empty_buffer, block_size, blocks_skip, &opt, &block_id) < 0) {
+				    if (fan && blocks_skip > 0) {
+					if (raw_zero_fill && fanout_zero(fan, blocks_skip * block_size, opt.offset + block_id * block_size) < 0)
+					    log_mesg(0, 1, 1, debug, "all %i targets failed, see the messages above\n", opt.target_count);
+					block_id += blocks_skip;
+				    } else if (opt.blockfile == 0 && blocks_skip > 0 && raw_zero_fill) {
+					if (zero_bytes(&dfw, blocks_skip * block_size, &opt) < 0)
+					    log_mesg(0, 1, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+					block_id += blocks_skip;
+				    } else if (opt.blockfile == 0 && blocks_skip > 0 && skip_blocks(&dfw, empty_buffer, block_size, blocks_skip, &opt, &block_id) < 0) {
 					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 				    } else if (opt.blockfile == 1 && blocks_skip > 0) 
                                         block_id += blocks_skip; 
@@ -832,10 +955,15 @@ int main(int argc, char **argv) {
 				     blocks_written + blocks_write < blocks_read &&
 				     pc_test_bit(block_id + blocks_write, bitmap, fs_info.totalblock);
 				     blocks_write++);
+				metrics_stage(STAGE_SCAN);
 
 #ifndef CHKIMG
 				// write blocks
 				if (blocks_write > 0) {
+					/// the last block of a raw image is cut at the device size
+					unsigned long long write_size = opt.blockfile == 1 ? blocks_write * block_size :
+						cnv_blocks_to_device_bytes(block_id, blocks_write, block_size, fs_info.device_size);
+
 				        if (opt.blockfile == 1){
 					    update_bt_info(&bt,
 							   block_id * block_size,
@@ -851,16 +979,22 @@ int main(int argc, char **argv) {
 					    	w_size = write_block_file(target, write_buffer + blocks_written * block_size,
 							blocks_write * block_size, (block_id*block_size), &opt);
 					    }
+					} else if (fan) {
+					    if (fanout_write(fan, write_buffer + blocks_written * block_size,
+						    write_size, opt.offset + block_id * block_size) < 0)
+						log_mesg(0, 1, 1, debug, "all %i targets failed, see the messages above\n", opt.target_count);
+					    w_size = write_size;
 					}else{
 					    w_size = write_all(&dfw, write_buffer + blocks_written * block_size,
-						    blocks_write * block_size, &opt);
+						    write_size, &opt);
 					}
-					if (w_size != blocks_write * block_size) {
+					if (w_size != write_size) {
 						if (!opt.skip_write_error)
 							log_mesg(0, 1, 1, debug, "write block %llu ERROR:%s\n", block_id + blocks_written, strerror(errno));
 						else
 							log_mesg(0, 0, 1, debug, "skip write block %llu error:%s\n", block_id + blocks_written, strerror(errno));
 					}
+					metrics_stage(STAGE_WRITE);
 				}
 #endif
 
@@ -878,20 +1012,38 @@ int main(int argc, char **argv) {
 		free(read_buffer);
 		free(write_buffer);
 		if (empty_buffer) {
-		    if (block_id < blocks_total && skip_blocks(&dfw, empty_buffer, block_size, blocks_total - block_id, &opt, &block_id) < 0) {
-			log_mesg(0, 0, 1, debug, "target seek ERROR:%s\n", strerror(errno));
-		    }
 		    if (block_id * block_size < fs_info.device_size && skip_bytes(&dfw, empty_buffer, block_size, fs_info.device_size - block_id * block_size, &opt) != fs_info.device_size - block_id * block_size) {
 			log_mesg(0, 0, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 		    }
+		    block_id = blocks_total;
 		    free(empty_buffer);
 		}
 
 #ifndef CHKIMG
+		/// zero the holes after the last used block of a raw image
+		if (raw_zero_fill && block_id * block_size < fs_info.device_size) {
+		    if (fan) {
+			if (fanout_zero(fan, fs_info.device_size - block_id * block_size, opt.offset + block_id * block_size) < 0)
+			    log_mesg(0, 1, 1, debug, "all %i targets failed, see the messages above\n", opt.target_count);
+		    } else if (zero_bytes(&dfw, fs_info.device_size - block_id * block_size, &opt) < 0)
+			log_mesg(0, 0, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+		    block_id = blocks_total;
+		}
+
+		if (fan) {
+		    int failed = fanout_close(fan);
+
+		    fan = NULL;
+		    if (failed)
+			log_mesg(0, 1, 1, debug, "%i of %i targets failed, see the messages above\n", failed, opt.target_count);
+		}
+
 		/// restore_raw_file option
 		if (opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
-		    if (ftruncate(dfw, (off_t)fs_info.device_size) == -1){
-			log_mesg(0, 0, 1, debug, "ftruncate ERROR:%s\n", strerror(errno));
+		    for (i = 0; i < opt.target_count; i++) {
+			if (ftruncate(target_fds[i], (off_t)fs_info.device_size) == -1){
+			    log_mesg(0, 0, 1, debug, "ftruncate ERROR:%s\n", strerror(errno));
+			}
 		    }
 		    log_mesg(1, 0, 0, debug, "ftruncate:%llu\n", (off_t)fs_info.device_size);
 		}
@@ -937,13 +1089,31 @@ int main(int argc, char **argv) {
 
 		log_mesg(0, 0, 0, debug, "Total block %llu\n", blocks_total);
 
+		if (opt.checkpoint) {
+			checkpoint_init(&cp, 'b', &fs_info, &img_opt, bitmap, &opt);
+			if (opt.resume && checkpoint_load(&cp, NULL, &opt)) {
+				block_id = cp.block_id;
+				copied = cp.copied;
+				if (lseek(dfw, opt.offset + block_id * block_size, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+			}
+		}
+
 		/// start clone partition to partition
 		log_mesg(1, 0, 0, debug, "start backup data device-to-device...\n");
+		readahead_init(&ra, dfr, bitmap, blocks_total, block_size, buffer_capacity, block_id, &opt);
+		metrics_stage_start();
 		do {
 			/// scan bitmap
-			unsigned long long blocks_skip, blocks_read;
+			unsigned long long blocks_skip, blocks_read, read_size;
 			off_t offset;
 
+			if (opt.checkpoint && checkpoint_due(&opt)) {
+				cp.block_id = block_id;
+				cp.copied = copied;
+				checkpoint_save(&cp, dfw, NULL, &opt);
+			}
+
 			/// skip unused blocks
 			for (blocks_skip = 0;
 			     block_id + blocks_skip < blocks_total &&
@@ -953,7 +1123,12 @@ int main(int argc, char **argv) {
 			if (block_id + blocks_skip == blocks_total)
 				break;
 
-			if (blocks_skip) {
+			if (blocks_skip && raw_zero_fill) {
+				if (zero_bytes(&dfw, blocks_skip * block_size, &opt) < 0) {
+					log_mesg(0, 1, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+				}
+				block_id += blocks_skip;
+			} else if (blocks_skip) {
 				if (skip_blocks(&dfw, empty_buffer, block_size, blocks_skip, &opt, &block_id) < 0) {
 					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 				}
@@ -968,31 +1143,38 @@ int main(int argc, char **argv) {
 			if (!blocks_read)
 				break;
 
+			readahead_next(&ra, block_id);
 			offset = (off_t)(block_id * block_size);
 			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
 				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
 
-			r_size = read_all(&dfr, buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
+			/// the last block of a raw device can be partial
+			read_size = cnv_blocks_to_device_bytes(block_id, blocks_read, block_size, fs_info.device_size);
+			metrics_stage(STAGE_SCAN);
+
+			r_size = read_all(&dfr, buffer, read_size, &opt);
+			if (r_size != (int)read_size) {
 				if ((r_size == -1) && (errno == EIO)) {
 					if (opt.rescue) {
-						memset(buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, buffer + r_size, &opt);
+						rescue_range(&dfr, offset, buffer, read_size, &opt);
+						r_size = read_size;
 					} else
 						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 				} else
 					log_mesg(0, 1, 1, debug, "source read ERROR %s\n", strerror(errno));
 			}
+			readahead_done(&ra, block_id + blocks_read);
+			metrics_stage(STAGE_READ);
 
 			/// write buffer to target
-			w_size = write_all(&dfw, buffer, blocks_read * block_size, &opt);
-			if (w_size != (int)(blocks_read * block_size)) {
+			w_size = write_all(&dfw, buffer, read_size, &opt);
+			if (w_size != (int)read_size) {
 				if (opt.skip_write_error)
 					log_mesg(0, 0, 1, debug, "skip write block %lli error:%s\n", block_id, strerror(errno));
 				else
 					log_mesg(0, 1, 1, debug, "write block %lli ERROR:%s\n", block_id, strerror(errno));
 			}
+			metrics_stage(STAGE_WRITE);
 
 			/// count copied block
 			copied += blocks_read;
@@ -1011,15 +1193,20 @@ int main(int argc, char **argv) {
 
 		free(buffer);
 		if (empty_buffer) {
-			if (block_id < blocks_total && skip_blocks(&dfw, empty_buffer, block_size, blocks_total - block_id, &opt, &block_id) < 0) {
-				log_mesg(0, 0, 1, debug, "write empty ERROR:%s\n", strerror(errno));
-			}
 			if (block_id * block_size < fs_info.device_size && skip_bytes(&dfw, empty_buffer, block_size, fs_info.device_size - block_id * block_size, &opt) != fs_info.device_size - block_id * block_size) {
 				log_mesg(0, 0, 1, debug, "write empty ERROR:%s\n", strerror(errno));
 			}
+			block_id = blocks_total;
 			free(empty_buffer);
 		}
 
+		/// zero the holes after the last used block of a raw image
+		if (raw_zero_fill && block_id * block_size < fs_info.device_size) {
+			if (zero_bytes(&dfw, fs_info.device_size - block_id * block_size, &opt) < 0)
+				log_mesg(0, 0, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+			block_id = blocks_total;
+		}
+
 		/// restore_raw_file option
 		if (opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
 		    if (ftruncate(dfw, (off_t)fs_info.device_size) == -1){
@@ -1063,6 +1250,7 @@ int main(int argc, char **argv) {
 	} else if (opt.ddd) {
 
 		char *buffer = NULL;
+		char *empty_buffer = NULL;
 		int block_size = fs_info.block_size;
 		unsigned long long blocks_total = fs_info.totalblock;
 		int blocks_in_buffer = block_size < opt.buffer_size ? opt.buffer_size / block_size : 1;
@@ -1083,6 +1271,14 @@ int main(int argc, char **argv) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 		}
 
+		if (target_stdout) {
+			empty_buffer = malloc(block_size);
+			if (empty_buffer == NULL) {
+				log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+			}
+			memset(empty_buffer, 0, block_size);
+		}
+
 		block_id = 0;
 
 		// init SHA1 for torrent info
@@ -1094,9 +1290,32 @@ int main(int argc, char **argv) {
 
 		/// start clone partition to partition
 		log_mesg(1, 0, 0, debug, "start backup data device-to-device...\n");
+		readahead_init(&ra, dfr, bitmap, blocks_total, block_size, blocks_in_buffer, block_id, &opt);
+		metrics_stage_start();
 		do {
 			/// scan bitmap
-			unsigned long long blocks_read;
+			unsigned long long blocks_skip, blocks_read, read_size;
+
+			/// skip unused blocks, the holes of a sparse source
+			for (blocks_skip = 0;
+			     block_id + blocks_skip < blocks_total &&
+			     !pc_test_bit(block_id + blocks_skip, bitmap, fs_info.totalblock);
+			     blocks_skip++);
+
+			if (blocks_skip) {
+				if (lseek(dfr, (off_t)(blocks_skip * block_size), SEEK_CUR) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+
+				if (opt.blockfile == 1) {
+					block_id += blocks_skip;
+				} else if (raw_zero_fill) {
+					if (zero_bytes(&dfw, blocks_skip * block_size, &opt) < 0)
+						log_mesg(0, 1, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+					block_id += blocks_skip;
+				} else if (skip_blocks(&dfw, empty_buffer, block_size, blocks_skip, &opt, &block_id) < 0) {
+					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+				}
+			}
 
 			/// read chunk from source
 			for (blocks_read = 0;
@@ -1107,27 +1326,34 @@ int main(int argc, char **argv) {
 			if (!blocks_read)
 				break;
 
-			r_size = read_all(&dfr, buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
+			readahead_next(&ra, block_id);
+			/// the last block of a raw device can be partial
+			read_size = cnv_blocks_to_device_bytes(block_id, blocks_read, block_size, fs_info.device_size);
+			metrics_stage(STAGE_SCAN);
+
+			r_size = read_all(&dfr, buffer, read_size, &opt);
+			if (r_size != (int)read_size) {
 				if ((r_size == -1) && (errno == EIO)) {
 					if (opt.rescue) {
                         assert(buffer != NULL);
-						memset(buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, r_size, buffer + r_size, &opt);
+						/// the source is read in sequence, go on after the chunk
+						rescue_range(&dfr, block_id * block_size, buffer, read_size, &opt);
+						if (lseek(dfr, (off_t)(block_id * block_size + read_size), SEEK_SET) == (off_t)-1)
+							log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+						r_size = read_size;
 					} else
 						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 				} else if (r_size == 0){ // done for ddd
 				    /// write buffer to target
                                                                         if (opt.blockfile == 1){
                                     					update_bt_info(&bt,
-                                    						       copied * block_size,
+                                    						       block_id * block_size,
                                     						       buffer, rescue_write_size);
                                     
                                     					if (opt.torrent_only == 1) {
                                     						w_size = rescue_write_size;
                                     					} else {
-                                                                            w_size = write_block_file(target, buffer, rescue_write_size, copied*block_size, &opt);
+                                                                            w_size = write_block_file(target, buffer, rescue_write_size, block_id*block_size, &opt);
                                     					}
                                                                         } else {                                        w_size = write_all(&dfw, buffer, rescue_write_size, &opt);
                                     }
@@ -1135,26 +1361,30 @@ int main(int argc, char **argv) {
 				} else
 					log_mesg(0, 1, 1, debug, "source read ERROR %s\n", strerror(errno));
 			}
+			readahead_done(&ra, block_id + blocks_read);
+			metrics_stage(STAGE_READ);
 
 			/// write buffer to target
 			if (opt.blockfile == 1){
-				update_bt_info(&bt, copied * block_size, buffer,
-					       blocks_read * block_size);
+				update_bt_info(&bt, block_id * block_size, buffer,
+					       read_size);
+				metrics_stage(STAGE_CHECKSUM);
 
 			    if (opt.torrent_only == 1) {
-				    w_size = blocks_read * block_size;
+				    w_size = read_size;
 			    } else {
-			 	w_size = write_block_file(target, buffer, blocks_read * block_size, copied*block_size, &opt);
+			 	w_size = write_block_file(target, buffer, read_size, block_id*block_size, &opt);
 			    }
 			} else {
-			    w_size = write_all(&dfw, buffer, blocks_read * block_size, &opt);
+			    w_size = write_all(&dfw, buffer, read_size, &opt);
 			}
-			if (w_size != (int)(blocks_read * block_size)) {
+			if (w_size != (int)read_size) {
 				if (opt.skip_write_error)
 					log_mesg(0, 0, 1, debug, "skip write block %lli error:%s\n", block_id, strerror(errno));
 				else
 					log_mesg(0, 1, 1, debug, "write block %lli ERROR:%s\n", block_id, strerror(errno));
 			}
+			metrics_stage(STAGE_WRITE);
 
 			/// count copied block
 			copied += blocks_read;
@@ -1177,6 +1407,20 @@ int main(int argc, char **argv) {
 		}
 
 		free(buffer);
+		if (empty_buffer) {
+			if (block_id < blocks_total && skip_bytes(&dfw, empty_buffer, block_size, fs_info.device_size - block_id * block_size, &opt) != fs_info.device_size - block_id * block_size) {
+				log_mesg(0, 0, 1, debug, "write empty ERROR:%s\n", strerror(errno));
+			}
+			block_id = blocks_total;
+			free(empty_buffer);
+		}
+
+		/// zero the holes after the last used block of a raw image
+		if (raw_zero_fill && block_id < blocks_total) {
+			if (zero_bytes(&dfw, fs_info.device_size - block_id * block_size, &opt) < 0)
+				log_mesg(0, 0, 1, debug, "target zero ERROR:%s\n", strerror(errno));
+			block_id = blocks_total;
+		}
 
 		/// restore_raw_file option
 		if (opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
@@ -1190,21 +1434,39 @@ int main(int argc, char **argv) {
 
 	}
 
+	if (opt.rescue) {
+		/// the retry pass rewrites the sectors it recovers on the target device
+		if (opt.rescue_retry && opt.dd && !target_stdout)
+			rescue_retry(&dfr, &dfw, opt.offset, &opt);
+		if (opt.rescue_mapfile)
+			rescue_map_write(opt.rescue_mapfile, fs_info.device_size, &opt);
+	}
+
+	pthread_mutex_lock(&done_lock);
 	done = 1;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
 	pres = pthread_join(prog_thread, &p_result);
 	if(pres)
 	    log_mesg(0, 1, 1, debug, "%s, %i, thread join error\n", __func__, __LINE__);
 	update_pui(&prog, copied, block_id, done);
 #ifndef CHKIMG
 	sync_data(dfw, &opt);
+	if (opt.checkpoint)
+		checkpoint_remove(&opt);
 #endif
+	metrics_update(copied, block_id, done);
+	metrics_close();
 	print_finish_info(opt);
+	metrics_summary(&opt);
 
 	/// close source
 	close(dfr);
 	/// close target
 	if (dfw != -1)
 		close_target(dfw);
+	for (i = 1; i < opt.target_count; i++)
+		close(target_fds[i]);
 	/// free bitmp
 	free(bitmap);
 	close_pui(pui);
@@ -1226,11 +1488,21 @@ int main(int argc, char **argv) {
 }
 
 void *thread_update_pui(void *arg) {
+	struct timespec wake;
 
+	pthread_mutex_lock(&done_lock);
 	while (!done) {
+		pthread_mutex_unlock(&done_lock);
 		if (!opt.quiet)
 			update_pui(&prog, copied, block_id, done);
-		sleep(opt.fresh);
+		metrics_update(copied, block_id, done);
+		pthread_mutex_lock(&done_lock);
+
+		/// sleep --UI-fresh seconds, or until the copy is done
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += opt.fresh;
+		while (!done && pthread_cond_timedwait(&done_cond, &done_lock, &wake) != ETIMEDOUT);
 	}
+	pthread_mutex_unlock(&done_lock);
 	pthread_exit("exit");
 }
@@ -0,0 +1,422 @@
+/**
+ * metrics.c - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * machine readable progress for --progress-fd and --progress-file
+ *
+ * The copy loops only bump the lock-free pc_counters in io_all() and the
+ * blocks copied, the progress thread turns them into a record every
+ * --UI-fresh seconds. A record is one JSON object per line or a Prometheus
+ * text exposition. It goes to --progress-fd with a single write(2), so an
+ * orchestrator reading the pipe never sees half a record, and replaces
+ * --progress-file by a rename, which is what the node exporter textfile
+ * collector expects. The throughput is given for the read and the write
+ * side over the last interval and on average. The stall time adds up the
+ * intervals in which nothing was read, written or copied. The calls and the
+ * time of every copy stage are given too, the bytes of a stage divided by
+ * its time is the throughput of that stage alone.
+ *
+ * The copy loops also call metrics_stage() at the end of each stage, which
+ * charges the time since the previous call to that stage and counts it in a
+ * log2 histogram of microseconds. The clock is CLOCK_MONOTONIC_COARSE, read
+ * from the vDSO for a few nanoseconds, so the timing stays on. Its ticks are
+ * a few milliseconds: a short stage mostly measures 0 and now and then a
+ * whole tick, which makes the totals right over many buffers while the
+ * latencies of short stages are only known to be under one tick.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "partclone.h"
+#include "metrics.h"
+
+#define METRICS_RECORD_SIZE 4096
+#define STAGE_BUCKETS 26		/// up to 2^24 us, 16 seconds
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define STAGE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define STAGE_CLOCK CLOCK_MONOTONIC
+#endif
+
+static struct {
+	int fd;				/// --progress-fd, -1 when not used
+	char *file;			/// --progress-file
+	int format;
+	int debug;
+	const char *mode;
+	char fs[FS_MAGIC_SIZE + 1];
+	unsigned int block_size;
+	unsigned long long totalblock;
+	unsigned long long usedblocks;
+
+	double start;
+	double last;			/// time of the previous record
+	unsigned long long last_read, last_written, last_copied;
+	double stall;
+} m = { .fd = -1 };
+
+static const char *stage_names[STAGE_COUNT] = {
+	"scan", "read", "checksum", "memcpy", "pipe", "write"
+};
+
+/// calls and ns are also read by the progress thread
+static struct {
+	unsigned long long calls;
+	unsigned long long ns;
+	unsigned long long max_ns;
+	unsigned long long hist[STAGE_BUCKETS];	/// [0] under 1 us, [i] under 2^i us
+} stages[STAGE_COUNT];
+static unsigned long long stage_last;
+
+static double now_seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void metrics_open(const file_system_info *fs_info, cmd_opt *opt) {
+	if (opt->progress_fd < 0 && !opt->progress_file)
+		return;
+
+	if (opt->progress_fd >= 0 && fcntl(opt->progress_fd, F_GETFD) == -1)
+		log_mesg(0, 1, 1, opt->debug, "progress fd %i error: %s\n", opt->progress_fd, strerror(errno));
+
+	m.fd = opt->progress_fd;
+	m.file = opt->progress_file;
+	m.format = opt->progress_format;
+	m.debug = opt->debug;
+	if (opt->chkimg)
+		m.mode = "chkimg";
+	else if (opt->clone)
+		m.mode = "clone";
+	else if (opt->restore)
+		m.mode = "restore";
+	else if (opt->dd || opt->ddd)
+		m.mode = "dd";
+	else
+		m.mode = "domain";
+	snprintf(m.fs, sizeof(m.fs), "%s", fs_info->fs);
+	m.block_size = fs_info->block_size;
+	m.totalblock = fs_info->totalblock;
+	m.usedblocks = fs_info->usedblocks;
+
+	m.start = m.last = now_seconds();
+	m.last_read = m.last_written = m.last_copied = 0;
+	m.stall = 0;
+}
+
+/// the calls and seconds of every stage as a JSON object, returns the length
+static int format_json_stages(char *buf, size_t size) {
+	int i, len = 0;
+
+	len += snprintf(buf + len, size - len, "{");
+	for (i = 0; i < STAGE_COUNT && len < (int)size; i++)
+		len += snprintf(buf + len, size - len, "%s\"%s\":{\"calls\":%llu,\"seconds\":%.3f}",
+			i ? "," : "", stage_names[i],
+			__atomic_load_n(&stages[i].calls, __ATOMIC_RELAXED),
+			__atomic_load_n(&stages[i].ns, __ATOMIC_RELAXED) / 1e9);
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len, "}");
+	return len;
+}
+
+/// the calls and seconds of every stage as Prometheus samples labelled by stage
+static int format_prom_stages(char *buf, size_t size) {
+	int i, len = 0;
+
+	len += snprintf(buf + len, size - len,
+		"# HELP partclone_stage_calls_total Times a copy stage ran.\n"
+		"# TYPE partclone_stage_calls_total counter\n");
+	for (i = 0; i < STAGE_COUNT && len < (int)size; i++)
+		len += snprintf(buf + len, size - len, "partclone_stage_calls_total{mode=\"%s\",fs=\"%s\",stage=\"%s\"} %llu\n",
+			m.mode, m.fs, stage_names[i], __atomic_load_n(&stages[i].calls, __ATOMIC_RELAXED));
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len,
+			"# HELP partclone_stage_seconds_total Time spent in a copy stage.\n"
+			"# TYPE partclone_stage_seconds_total counter\n");
+	for (i = 0; i < STAGE_COUNT && len < (int)size; i++)
+		len += snprintf(buf + len, size - len, "partclone_stage_seconds_total{mode=\"%s\",fs=\"%s\",stage=\"%s\"} %.3f\n",
+			m.mode, m.fs, stage_names[i], __atomic_load_n(&stages[i].ns, __ATOMIC_RELAXED) / 1e9);
+	return len;
+}
+
+static int format_json(char *buf, size_t size, unsigned long long copied, unsigned long long current,
+		int done, double elapsed, unsigned long long rd, unsigned long long wr,
+		double rd_rate, double wr_rate, unsigned long long cs_errors) {
+	char stage_str[METRICS_RECORD_SIZE / 2];
+
+	if (format_json_stages(stage_str, sizeof(stage_str)) >= (int)sizeof(stage_str))
+		return -1;
+	return snprintf(buf, size,
+		"{\"mode\":\"%s\",\"fs\":\"%s\",\"elapsed\":%.3f,\"block_size\":%u,"
+		"\"blocks_total\":%llu,\"blocks_used\":%llu,\"blocks_copied\":%llu,\"current_block\":%llu,"
+		"\"bytes_read\":%llu,\"bytes_written\":%llu,"
+		"\"read_rate\":%.0f,\"write_rate\":%.0f,\"read_rate_avg\":%.0f,\"write_rate_avg\":%.0f,"
+		"\"stall_seconds\":%.3f,\"checksum_errors\":%llu,\"stages\":%s,\"done\":%s}\n",
+		m.mode, m.fs, elapsed, m.block_size,
+		m.totalblock, m.usedblocks, copied, current,
+		rd, wr,
+		rd_rate, wr_rate, elapsed > 0 ? rd / elapsed : 0, elapsed > 0 ? wr / elapsed : 0,
+		m.stall, cs_errors, stage_str, done ? "true" : "false");
+}
+
+static int format_prom(char *buf, size_t size, unsigned long long copied, unsigned long long current,
+		int done, double elapsed, unsigned long long rd, unsigned long long wr,
+		double rd_rate, double wr_rate, unsigned long long cs_errors) {
+	char labels[64 + FS_MAGIC_SIZE];
+	char stage_str[METRICS_RECORD_SIZE / 2];
+
+	if (format_prom_stages(stage_str, sizeof(stage_str)) >= (int)sizeof(stage_str))
+		return -1;
+	snprintf(labels, sizeof(labels), "{mode=\"%s\",fs=\"%s\"}", m.mode, m.fs);
+	return snprintf(buf, size,
+		"# HELP partclone_elapsed_seconds Time since the copy started.\n"
+		"# TYPE partclone_elapsed_seconds gauge\n"
+		"partclone_elapsed_seconds%s %.3f\n"
+		"# HELP partclone_block_size_bytes Size of a block.\n"
+		"# TYPE partclone_block_size_bytes gauge\n"
+		"partclone_block_size_bytes%s %u\n"
+		"# HELP partclone_blocks Blocks of the file system.\n"
+		"# TYPE partclone_blocks gauge\n"
+		"partclone_blocks%s %llu\n"
+		"# HELP partclone_used_blocks Used blocks to copy.\n"
+		"# TYPE partclone_used_blocks gauge\n"
+		"partclone_used_blocks%s %llu\n"
+		"# HELP partclone_copied_blocks_total Blocks copied so far.\n"
+		"# TYPE partclone_copied_blocks_total counter\n"
+		"partclone_copied_blocks_total%s %llu\n"
+		"# HELP partclone_current_block Block the copy is at.\n"
+		"# TYPE partclone_current_block gauge\n"
+		"partclone_current_block%s %llu\n"
+		"# HELP partclone_read_bytes_total Bytes read from the source.\n"
+		"# TYPE partclone_read_bytes_total counter\n"
+		"partclone_read_bytes_total%s %llu\n"
+		"# HELP partclone_written_bytes_total Bytes written to the targets.\n"
+		"# TYPE partclone_written_bytes_total counter\n"
+		"partclone_written_bytes_total%s %llu\n"
+		"# HELP partclone_read_bytes_per_second Read throughput over the last interval.\n"
+		"# TYPE partclone_read_bytes_per_second gauge\n"
+		"partclone_read_bytes_per_second%s %.0f\n"
+		"# HELP partclone_write_bytes_per_second Write throughput over the last interval.\n"
+		"# TYPE partclone_write_bytes_per_second gauge\n"
+		"partclone_write_bytes_per_second%s %.0f\n"
+		"# HELP partclone_stall_seconds_total Time nothing was read, written or copied.\n"
+		"# TYPE partclone_stall_seconds_total counter\n"
+		"partclone_stall_seconds_total%s %.3f\n"
+		"# HELP partclone_checksum_errors_total Checksum errors found in the image.\n"
+		"# TYPE partclone_checksum_errors_total counter\n"
+		"partclone_checksum_errors_total%s %llu\n"
+		"%s"
+		"# HELP partclone_done Whether the copy is complete.\n"
+		"# TYPE partclone_done gauge\n"
+		"partclone_done%s %d\n",
+		labels, elapsed, labels, m.block_size, labels, m.totalblock, labels, m.usedblocks,
+		labels, copied, labels, current, labels, rd, labels, wr,
+		labels, rd_rate, labels, wr_rate, labels, m.stall, labels, cs_errors, stage_str, labels, done ? 1 : 0);
+}
+
+/// write the whole record, returns -1 on error
+static int write_record(int fd, const char *buf, size_t len) {
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static void save_record(const char *buf, size_t len) {
+	size_t name_len = strlen(m.file);
+	char tmp[name_len + 5];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", m.file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		log_mesg(1, 0, 0, m.debug, "open progress file %s error: %s\n", tmp, strerror(errno));
+		return;
+	}
+	if (write_record(fd, buf, len) == -1) {
+		log_mesg(1, 0, 0, m.debug, "write progress file %s error: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	if (rename(tmp, m.file) == -1) {
+		log_mesg(1, 0, 0, m.debug, "rename progress file %s error: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+void metrics_update(unsigned long long copied, unsigned long long current, int done) {
+	char buf[METRICS_RECORD_SIZE];
+	unsigned long long rd, wr, cs_errors;
+	double t, interval, rd_rate = 0, wr_rate = 0;
+	int len;
+
+	if (m.fd < 0 && !m.file)
+		return;
+
+	rd = __atomic_load_n(&pc_counters.bytes_read, __ATOMIC_RELAXED);
+	wr = __atomic_load_n(&pc_counters.bytes_written, __ATOMIC_RELAXED);
+	cs_errors = __atomic_load_n(&pc_counters.checksum_errors, __ATOMIC_RELAXED);
+
+	t = now_seconds();
+	interval = t - m.last;
+	if (interval > 0) {
+		rd_rate = (rd - m.last_read) / interval;
+		wr_rate = (wr - m.last_written) / interval;
+	}
+	if (!done && rd == m.last_read && wr == m.last_written && copied == m.last_copied)
+		m.stall += interval;
+	m.last = t;
+	m.last_read = rd;
+	m.last_written = wr;
+	m.last_copied = copied;
+
+	if (m.format == PROGRESS_PROM)
+		len = format_prom(buf, sizeof(buf), copied, current, done, t - m.start, rd, wr, rd_rate, wr_rate, cs_errors);
+	else
+		len = format_json(buf, sizeof(buf), copied, current, done, t - m.start, rd, wr, rd_rate, wr_rate, cs_errors);
+	if (len < 0 || len >= (int)sizeof(buf))
+		return;
+
+	if (m.fd >= 0 && write_record(m.fd, buf, len) == -1) {
+		/// a broken sink must not stop the copy
+		log_mesg(0, 0, 1, m.debug, "write progress fd %i error: %s, progress records stopped\n", m.fd, strerror(errno));
+		m.fd = -1;
+	}
+	if (m.file)
+		save_record(buf, len);
+}
+
+void metrics_close(void) {
+	m.fd = -1;
+	m.file = NULL;
+}
+
+static unsigned long long stage_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(STAGE_CLOCK, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_stage_start(void) {
+	stage_last = stage_clock();
+}
+
+void metrics_stage(int stage) {
+	unsigned long long now = stage_clock();
+	unsigned long long ns = now - stage_last;
+	unsigned long long us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	stage_last = now;
+	__atomic_store_n(&stages[stage].calls, stages[stage].calls + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stages[stage].ns, stages[stage].ns + ns, __ATOMIC_RELAXED);
+	if (ns > stages[stage].max_ns)
+		stages[stage].max_ns = ns;
+	stages[stage].hist[bucket < STAGE_BUCKETS ? bucket : STAGE_BUCKETS - 1]++;
+}
+
+/// upper bound in us of the bucket holding the @permille of the calls of @stage
+static unsigned long long stage_percentile(int stage, unsigned int permille) {
+	unsigned long long want = (stages[stage].calls * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < STAGE_BUCKETS; i++) {
+		seen += stages[stage].hist[i];
+		if (seen >= want)
+			break;
+	}
+	return 1ULL << (i < STAGE_BUCKETS ? i : STAGE_BUCKETS - 1);
+}
+
+/// 4096 as "4K", the sizes are powers of two
+static void format_size(unsigned long long size, char *str, size_t len) {
+	if (size >= (1ULL << 30))
+		snprintf(str, len, "%lluG", size >> 30);
+	else if (size >= (1ULL << 20))
+		snprintf(str, len, "%lluM", size >> 20);
+	else if (size >= (1ULL << 10))
+		snprintf(str, len, "%lluK", size >> 10);
+	else
+		snprintf(str, len, "%llu", size);
+}
+
+static void syscall_summary(const char *name, const unsigned long long *calls, unsigned long long bytes, int debug) {
+	unsigned long long total = 0;
+	char sizes[256] = "", size[16];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < IO_SIZE_BUCKETS; i++) {
+		unsigned long long n = __atomic_load_n(&calls[i], __ATOMIC_RELAXED);
+
+		if (!n)
+			continue;
+		total += n;
+		format_size(1ULL << i, size, sizeof(size));
+		if (len < sizeof(sizes))
+			len += snprintf(sizes + len, sizeof(sizes) - len, " %s%s:%llu", i == IO_SIZE_BUCKETS - 1 ? ">=" : "", size, n);
+	}
+	if (!total)
+		return;
+	log_mesg(0, 0, 1, debug, "%-8s %10llu %15llu %10llu %s\n", name, total, bytes, bytes / total, sizes);
+}
+
+void metrics_summary(cmd_opt *opt) {
+	unsigned long long total_ns = 0;
+	struct timespec res;
+	int i;
+
+	for (i = 0; i < STAGE_COUNT; i++)
+		total_ns += stages[i].ns;
+
+	if (total_ns || stages[STAGE_READ].calls) {
+		clock_getres(STAGE_CLOCK, &res);
+		log_mesg(0, 0, 1, opt->debug, "Stage timing, clock resolution %lu us:\n",
+			(unsigned long)(res.tv_sec * 1000000 + res.tv_nsec / 1000));
+		log_mesg(0, 0, 1, opt->debug, "%-8s %10s %10s %6s %9s %9s %9s\n",
+			"stage", "calls", "time(s)", "share", "p50(us)<", "p99(us)<", "max(us)");
+		for (i = 0; i < STAGE_COUNT; i++) {
+			if (!stages[i].calls)
+				continue;
+			log_mesg(0, 0, 1, opt->debug, "%-8s %10llu %10.3f %5.1f%% %9llu %9llu %9llu\n",
+				stage_names[i], stages[i].calls, stages[i].ns / 1e9,
+				total_ns ? 100.0 * stages[i].ns / total_ns : 0.0,
+				stage_percentile(i, 500), stage_percentile(i, 990), stages[i].max_ns / 1000);
+		}
+	}
+
+	log_mesg(0, 0, 1, opt->debug, "Syscalls, short: %llu\n", __atomic_load_n(&pc_counters.short_calls, __ATOMIC_RELAXED));
+	log_mesg(0, 0, 1, opt->debug, "%-8s %10s %15s %10s %s\n", "syscall", "calls", "bytes", "avg size", "sizes:calls");
+	syscall_summary("read", pc_counters.read_calls, __atomic_load_n(&pc_counters.bytes_read, __ATOMIC_RELAXED), opt->debug);
+	syscall_summary("write", pc_counters.write_calls, __atomic_load_n(&pc_counters.bytes_written, __ATOMIC_RELAXED), opt->debug);
+}
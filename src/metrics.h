@@ -0,0 +1,54 @@
+/**
+ * metrics.h - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * machine readable progress for --progress-fd and --progress-file, and
+ * the timing of the copy stages
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/**
+ * Open the sinks given by --progress-fd and --progress-file for the copy of
+ * @fs_info. Does nothing when neither is set, exits when the fd is not open.
+ */
+extern void metrics_open(const file_system_info *fs_info, cmd_opt *opt);
+
+/**
+ * Emit one record with the blocks @copied so far, the @current block and the
+ * io counters. Called by the progress thread every --UI-fresh seconds and
+ * once more with @done set when the copy is complete.
+ */
+extern void metrics_update(unsigned long long copied, unsigned long long current, int done);
+
+/// close the sinks, the last record stays in --progress-file
+extern void metrics_close(void);
+
+/// stages of the copy loops, the time between two metrics_stage() calls
+enum {
+	STAGE_SCAN,		/// bitmap scan, seeks and holes
+	STAGE_READ,
+	STAGE_CHECKSUM,		/// image checksums and torrent hashes
+	STAGE_MEMCPY,
+	STAGE_PIPE,		/// write to the --compresscmd pipe
+	STAGE_WRITE,
+	STAGE_COUNT
+};
+
+/// start the stage clock before a copy loop
+extern void metrics_stage_start(void);
+
+/// charge the time since the previous call to @stage, only for the main thread
+extern void metrics_stage(int stage);
+
+/// print and log the stage latencies and the read and write syscall sizes
+extern void metrics_summary(cmd_opt *opt);
+
+#endif /* METRICS_H_ */
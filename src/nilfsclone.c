@@ -17,11 +17,16 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 
 //#include "nilfs/nilfs.h"
 //#include "nilfs/util.h"
 #include <nilfs.h>
-#define LSSU_NSEGS      512
+#define LSSU_NSEGS      8192 // segment usage entries fetched by one nilfs_get_suinfo()
+#define SUINFO_THREADS_MAX 8
+#define SUINFO_SEGS_PER_THREAD 65536 // smaller volumes are listed by one thread
 
 #include "partclone.h"
 #include "nilfsclone.h"
@@ -39,13 +44,24 @@ struct nilfs *nilfs;
 
 extern fs_cmd_opt fs_opt;
 
-static struct nilfs_suinfo suinfos[LSSU_NSEGS];
 int blocks_per_segment;
 unsigned long long total_block;
 
+/// a range of segments listed by one thread
+typedef struct {
+    __u64 start;
+    __u64 end;
+    __u64 protseq;
+    unsigned long *bitmap;
+    int status;
+} seg_slice;
+
+static progress_bar prog;
+static unsigned long long checked;
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+
 ///set useb block
 static void set_bitmap(unsigned long* bitmap, uint64_t segm, uint64_t count){
-    uint64_t block;
     uint64_t pos_block;
     uint64_t block_end;
 
@@ -56,17 +72,16 @@ static void set_bitmap(unsigned long* bitmap, uint64_t segm, uint64_t count){
     }
     pos_block = segm*blocks_per_segment;
     block_end = (segm+1)*blocks_per_segment;
+    if (block_end > total_block)
+	block_end = total_block;
 
     log_mesg(3, 0, 0, fs_opt.debug, "%s: block offset: %llu block count: %llu\n",__FILE__,  pos_block, block_end);
-
-    for(block = pos_block; block < block_end; block++){
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block %i is used\n",__FILE__,  block);
-	pc_set_bit(block, bitmap, total_block);
-    }
+    pc_set_range(pos_block, block_end - pos_block, bitmap, total_block);
 }
 
 static ssize_t lssu_print_suinfo(struct nilfs *nilfs, __u64 segnum,
 				 ssize_t nsi, __u64 protseq,
+				 struct nilfs_suinfo *suinfos,
 				 unsigned long* bitmap)
 {
     ssize_t i, n = 0;
@@ -90,11 +105,63 @@ static ssize_t lssu_print_suinfo(struct nilfs *nilfs, __u64 segnum,
     return n;
 }
 
+/// mark the segments from slice->start to slice->end, LSSU_NSEGS at a time
+static void *lssu_list_slice(void *arg)
+{
+    seg_slice *slice = arg;
+    struct nilfs_suinfo *suinfos;
+    __u64 segnum, count;
+    ssize_t nsi, n;
+
+    slice->status = 1;
+    suinfos = malloc(LSSU_NSEGS * sizeof(struct nilfs_suinfo));
+    if (!suinfos) {
+	log_mesg(0, 1, 1, fs_opt.debug, "ERROR: malloc error for suinfo: %s\n", strerror(errno));
+	return NULL;
+    }
+
+    for (segnum = slice->start; segnum < slice->end; segnum += nsi) {
+	count = min_t(__u64, slice->end - segnum, LSSU_NSEGS);
+	nsi = nilfs_get_suinfo(nilfs, segnum, suinfos, count);
+	if (nsi < 0) {
+            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Failed to get NILFS segment info for segment %llu.\n", segnum);
+	    free(suinfos);
+	    return NULL;
+        }
+        if (nsi == 0 || (__u64)nsi > count) {
+            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Invalid number of suinfo entries read: %zd. Expected between 1 and %llu.\n", nsi, count);
+	    free(suinfos);
+	    return NULL;
+        }
+
+	n = lssu_print_suinfo(nilfs, segnum, nsi, slice->protseq, suinfos, slice->bitmap);
+        if (n < 0 || n > nsi) {
+            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: lssu_print_suinfo returned %zd entries of %zd for segment %llu.\n", n, nsi, segnum);
+	    free(suinfos);
+	    return NULL;
+        }
+
+	/// update progress
+	pthread_mutex_lock(&seg_lock);
+	checked += (unsigned long long)nsi * blocks_per_segment;
+	if (checked > total_block)
+	    checked = total_block;
+	update_pui(&prog, checked, checked, 0);
+	pthread_mutex_unlock(&seg_lock);
+    }
+    free(suinfos);
+    slice->status = 0;
+    return NULL;
+}
+
 static int lssu_list_suinfo(struct nilfs *nilfs, unsigned long* bitmap)
 {
     struct nilfs_sustat sustat;
-    __u64 segnum, rest, count;
-    ssize_t nsi, n;
+    seg_slice slices[SUINFO_THREADS_MAX];
+    pthread_t list_threads[SUINFO_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    __u64 per_thread;
+    int threads, t, status = 0;
 
     if (nilfs_get_sustat(nilfs, &sustat) < 0) {
 	log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Failed to get NILFS segment usage statistics.\n");
@@ -106,34 +173,37 @@ static int lssu_list_suinfo(struct nilfs *nilfs, unsigned long* bitmap)
 	return 1;
     }
 
-    segnum = 0;
-    rest = sustat.ss_nsegs;
-
-    for ( ; rest > 0 && segnum < sustat.ss_nsegs; rest -= n) {
-	count = min_t(__u64, rest, LSSU_NSEGS);
-	nsi = nilfs_get_suinfo(nilfs, segnum, suinfos, count);
-	if (nsi < 0) {
-            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Failed to get NILFS segment info for segment %llu.\n", segnum);
-	    return 1;
-        }
-        if (nsi == 0 || nsi > LSSU_NSEGS || nsi > rest) {
-            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: Invalid number of suinfo entries read: %zd. Expected between 1 and %d, and <= remaining segments (%llu).\n", nsi, LSSU_NSEGS, rest);
-            return 1;
-        }
-
-	n = lssu_print_suinfo(nilfs, segnum, nsi, sustat.ss_prot_seq, bitmap);
-        if (n < 0) {
-            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: lssu_print_suinfo returned negative value for segment %llu.\n", segnum);
-            return 1;
-        }
-        if (n > nsi) {
-            log_mesg(0, 1, 1, fs_opt.debug, "ERROR: lssu_print_suinfo returned more entries than read for segment %llu.\n", segnum);
-            return 1;
-        }
-	segnum += nsi; // Use nsi for advancing segnum, as it's the number read.
+    /// split big volumes, segments only share bitmap words when a segment is not a whole number of words
+    threads = cpus > 1 ? (cpus < SUINFO_THREADS_MAX ? cpus : SUINFO_THREADS_MAX) : 1;
+    if ((__u64)threads > sustat.ss_nsegs / SUINFO_SEGS_PER_THREAD)
+	threads = sustat.ss_nsegs / SUINFO_SEGS_PER_THREAD;
+    if (threads < 1 || blocks_per_segment % PART_BITS_PER_LONG)
+	threads = 1;
+    per_thread = (sustat.ss_nsegs + threads - 1) / threads;
+    log_mesg(1, 0, 0, fs_opt.debug, "%s: %llu segments, listed with %i threads\n", __FILE__, sustat.ss_nsegs, threads);
+
+    for (t = 0; t < threads; t++) {
+	slices[t].start = per_thread * t;
+	slices[t].end = min_t(__u64, per_thread * (t + 1), sustat.ss_nsegs);
+	slices[t].protseq = sustat.ss_prot_seq;
+	slices[t].bitmap = bitmap;
+	slices[t].status = 0;
+    }
+    if (threads == 1) {
+	lssu_list_slice(&slices[0]);
+	return slices[0].status;
     }
 
-    return 0;
+    for (t = 0; t < threads; t++) {
+	if (pthread_create(&list_threads[t], NULL, lssu_list_slice, &slices[t]))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+    }
+    for (t = 0; t < threads; t++) {
+	if (pthread_join(list_threads[t], NULL))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+	status |= slices[t].status;
+    }
+    return status;
 }
 
 /// open device
@@ -197,8 +267,8 @@ extern void read_bitmap(char* device, file_system_info fs_info, unsigned long* b
     }
 
     /// init progress
-    progress_bar   prog;    /// progress_bar structure defined in progress.h
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
+    checked = 0;
 
     blocks_per_segment = nilfs_get_blocks_per_segment(nilfs);
 
@@ -49,6 +49,7 @@
 #include "fs_common.h"
 
 #define MAX_NTFS_CLUSTERS (8ULL * 1024 * 1024 * 1024) // Max clusters (approx 32TB @ 4KB/cluster) to prevent DoS from maliciously large cluster count
+#define BITMAP_CHUNK (1ULL << 24) // clusters copied between two progress updates
 
 /// define mount flag
 #ifdef NTFS_MNT_RDONLY
@@ -224,7 +225,7 @@ static void fs_close(){
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
     unsigned char	*ntfs_bitmap;
-    unsigned long long	current_block, used_block, free_block, pos;
+    unsigned long long	current_block, used_block, free_block, pos, chunk;
     long long int	count;
     unsigned long	bitmap_size;
     int start = 0;
@@ -262,23 +263,22 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 	log_mesg(0, 1, 1, fs_opt.debug, "%s: the readed size of ntfs_attr not expected: %s\n", __FILE__, strerror(errno));
     }
 
-    for (current_block = 0; current_block < ntfs->nr_clusters; current_block++)
+    /// the $Bitmap bit order is the one of the partclone bitmap, copy it a word at a time
+    for (current_block = 0; current_block < (unsigned long long)ntfs->nr_clusters; current_block += chunk)
     {
-        char bit;
-        bit = ntfs_bit_get(ntfs_bitmap, current_block);
-        if (bit == -1){                                     // Return -1 on error
-	    log_mesg(0, 1, 1, fs_opt.debug, "%s: check bitmap error\n", __FILE__); 
-	}else if(bit == 1){				    // The value of the bit (0 or 1)
-            pc_set_bit(current_block, bitmap, fs_info.totalblock);
-            used_block++;
-        } else {
-            pc_clear_bit(current_block, bitmap, fs_info.totalblock);
-            free_block++;
-        }
-        /// update progress
-        update_pui(&prog, current_block, current_block, 0);
+        chunk = ntfs->nr_clusters - current_block;
+        if (chunk > BITMAP_CHUNK)
+            chunk = BITMAP_CHUNK;
+        used_block += pc_copy_bits_le(current_block, ntfs_bitmap + current_block / 8, chunk, bitmap, fs_info.totalblock);
 
+        /// update progress
+        update_pui(&prog, current_block + chunk - 1, current_block + chunk - 1, 0);
     }
+    free_block = ntfs->nr_clusters - used_block;
+
+    /// the padding bits of the last word are never copied, keep them clear
+    if (fs_info.totalblock % PART_BITS_PER_LONG)
+        bitmap[fs_info.totalblock / PART_BITS_PER_LONG] &= (1UL << (fs_info.totalblock % PART_BITS_PER_LONG)) - 1;
 
 //    // Include the potential Boot Record copy located after the end of the NTFS volume
 //    pc_set_bit(fs_info.totalblock - 1, bitmap, fs_info.totalblock);
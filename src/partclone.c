@@ -40,6 +40,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
 #include "gettext.h"
 #include <linux/fs.h>
 #include <sys/types.h>
@@ -61,6 +62,7 @@ unsigned long long      rescue_write_size;
 
 FILE* msg = NULL;
 unsigned long long rescue_write_size;
+io_counters pc_counters;
 #ifdef HAVE_LIBNCURSESW
 #include <ncurses.h>
 WINDOW *log_win;
@@ -78,6 +80,19 @@ int log_y_line = 0;
 #define OPT_READ_DIRECT_IO 1002
 #define OPT_BINARY_PREFIX 1003
 #define OPT_PROG_SEC 1004
+#define OPT_SPARSE 1005
+#define OPT_BLOCK_SIZE 1006
+#define OPT_TARGET_LAG 1007
+#define OPT_RESCUE_MAP 1008
+#define OPT_RESCUE_RETRY 1009
+#define OPT_CHECKPOINT 1010
+#define OPT_CHECKPOINT_INTERVAL 1011
+#define OPT_RESUME 1012
+#define OPT_PROGRESS_FD 1013
+#define OPT_PROGRESS_FORMAT 1014
+#define OPT_PROGRESS_FILE 1015
+#define OPT_AUTO_TUNE 1016
+#define OPT_READAHEAD 1017
 //
 //enum {
 //	OPT_OFFSET_DOMAIN = 1000
@@ -231,6 +246,14 @@ void usage(void) {
 #ifndef CHKIMG
 		"    -o,  --output FILE      Output FILE\n"
 		"    -O   --overwrite FILE   Output FILE, overwriting if exists\n"
+#if !defined(DD) || defined(RESTORE)
+		"                            Repeat it to restore to several targets at once\n"
+		"         --target-lag N     Let a slow target fall N buffers behind (default: %d)\n"
+		"         --checkpoint FILE  Save in FILE where an interrupted copy can resume\n"
+		"         --checkpoint-interval SEC\n"
+		"                            Update the checkpoint every SEC seconds (default: %d)\n"
+		"         --resume           Continue from the checkpoint, keep the target content\n"
+#endif
 		"    -W   --restore_raw_file create special raw file for loop device\n"
 #endif
 		"    -s,  --source FILE      Source FILE\n"
@@ -246,6 +269,8 @@ void usage(void) {
 		"    -D,  --domain           Create ddrescue domain log from source device\n"
 		"         --offset_domain=X  Add offset X (bytes) to domain log values\n"
 		"    -R,  --rescue           Continue clone while disk read errors\n"
+		"         --rescue-map FILE  Save the unreadable areas as a ddrescue mapfile\n"
+		"         --rescue-retry     Read the unreadable areas again at the end (-b only)\n"
 		"    -aX  --checksum-mode=X  Checksum formula to use to add error detection\n"
 		"                            where X:\n"
 		"                            0: No checksum (no slowdown, smallest image)\n"
@@ -260,6 +285,11 @@ void usage(void) {
 #else
 		"    -S,  --device-size      Define device size\n"
 #endif
+#if defined(DD) || defined(IMG)
+		"         --sparse           Skip all-zero blocks of a source block device\n"
+		"         --block-size SIZE  Block size of the raw bitmap (default: %d)\n"
+#endif
+		"         --readahead N      Prefetch the next N runs of used blocks, 0: off (default: %d)\n"
 #endif
 		"    -w,  --skip_write_error Continue restore while write errors\n"
 #endif
@@ -279,7 +309,13 @@ void usage(void) {
 		"    -B,  --no_block_detail  Show progress message without block detail\n"
 		"         --binary-prefix    Show progress with bit size (default is MB, GB...)\n"
 		"         --prog-second      Show progress in seconds (default is minute)\n"
+		"         --progress-fd N    Write machine readable progress records to fd N\n"
+		"         --progress-file FILE\n"
+		"                            Keep the latest progress record in FILE\n"
+		"         --progress-format=X\n"
+		"                            Format of the progress records, X: json (default) or prom\n"
 		"    -z,  --buffer_size SIZE Read/write buffer size (default: %d)\n"
+		"         --auto-tune        Pick the buffer size and target lag for the devices\n"
 #ifndef CHKIMG
 		"    -q,  --quiet            Disable progress message\n"
 		"    -E,  --offset=X         Add offset X (bytes) to OUTPUT\n"
@@ -288,7 +324,18 @@ void usage(void) {
 #endif
 		"    -v,  --version          Display partclone version\n"
 		"    -h,  --help             Display this help\n"
-		, get_exec_name(), VERSION, get_exec_name(), DEFAULT_BUFFER_SIZE);
+		, get_exec_name(), VERSION, get_exec_name(),
+#if !defined(CHKIMG) && (!defined(DD) || defined(RESTORE))
+		DEFAULT_TARGET_LAG,
+		DEFAULT_CHECKPOINT_INTERVAL,
+#endif
+#if !defined(CHKIMG) && !defined(RESTORE) && (defined(DD) || defined(IMG))
+		DEFAULT_RAW_BLOCK_SIZE,
+#endif
+#if !defined(CHKIMG) && !defined(RESTORE)
+		DEFAULT_READAHEAD,
+#endif
+		DEFAULT_BUFFER_SIZE);
 	exit(1);
 }
 
@@ -374,8 +421,12 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "force",		no_argument,		NULL,   'F' },
 		{ "no_block_detail",	no_argument,		NULL,   'B' },
 		{ "buffer_size",	required_argument,	NULL,   'z' },
+		{ "auto-tune",		no_argument,		NULL,   OPT_AUTO_TUNE },
 		{ "binary-prefix",      no_argument,	        NULL,   OPT_BINARY_PREFIX },
 		{ "prog-second",        no_argument,	        NULL,   OPT_PROG_SEC },
+		{ "progress-fd",	required_argument,	NULL,   OPT_PROGRESS_FD },
+		{ "progress-format",	required_argument,	NULL,   OPT_PROGRESS_FORMAT },
+		{ "progress-file",	required_argument,	NULL,   OPT_PROGRESS_FILE },
 		{ "write-direct-io",	no_argument,	        NULL,   OPT_WRITE_DIRECT_IO },
 		{ "read-direct-io",	no_argument,	        NULL,   OPT_READ_DIRECT_IO },
 // not RESTORE and not CHKIMG
@@ -389,9 +440,16 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "domain",		no_argument,		NULL,   'D' },
 		{ "offset_domain",	required_argument,	NULL,   OPT_OFFSET_DOMAIN },
 		{ "rescue",		no_argument,		NULL,   'R' },
+		{ "rescue-map",		required_argument,	NULL,   OPT_RESCUE_MAP },
+		{ "rescue-retry",	no_argument,		NULL,   OPT_RESCUE_RETRY },
 #else
 		{ "device-size",	required_argument,	NULL,   'S' },
 #endif
+#if defined(DD) || defined(IMG)
+		{ "sparse",		no_argument,		NULL,   OPT_SPARSE },
+		{ "block-size",		required_argument,	NULL,   OPT_BLOCK_SIZE },
+#endif
+		{ "readahead",		required_argument,	NULL,   OPT_READAHEAD },
 		{ "checksum-mode",       required_argument, NULL, 'a' },
 		{ "blocks-per-checksum", required_argument, NULL, 'k' },
 		{ "no-reseed",           no_argument,       NULL, 'K' },
@@ -402,6 +460,12 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "output",		required_argument,	NULL,   'o' },
 		{ "overwrite",		required_argument,	NULL,   'O' },
 		{ "restore_raw_file",	no_argument,		NULL,   'W' },
+#if !defined(DD) || defined(RESTORE)
+		{ "target-lag",		required_argument,	NULL,   OPT_TARGET_LAG },
+		{ "checkpoint",		required_argument,	NULL,   OPT_CHECKPOINT },
+		{ "checkpoint-interval", required_argument,	NULL,   OPT_CHECKPOINT_INTERVAL },
+		{ "resume",		no_argument,		NULL,   OPT_RESUME },
+#endif
 		{ "skip_write_error",	no_argument,		NULL,   'w' },
 		{ "ignore_fschk",	no_argument,		NULL,   'I' },
 		{ "quiet",		no_argument,		NULL,   'q' },
@@ -419,6 +483,8 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 
 	int c;
 	int mode = 0;
+	long number;
+	char *end;
 	memset(opt, 0, sizeof(cmd_opt));
 
 	opt->debug = 0;
@@ -432,6 +498,10 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	opt->fresh = 2;
 	opt->logfile = "/var/log/partclone.log";
 	opt->buffer_size = DEFAULT_BUFFER_SIZE;
+	opt->raw_block_size = DEFAULT_RAW_BLOCK_SIZE;
+	opt->target_lag = DEFAULT_TARGET_LAG;
+	opt->readahead = DEFAULT_READAHEAD;
+	opt->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
 	opt->checksum_mode = CSM_CRC32;
 	opt->reseed_checksum = 1;
 	opt->blocks_per_checksum = 0;
@@ -440,6 +510,8 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
         opt->read_direct_io = 0;
         opt->binary_prefix = 0;
         opt->prog_second = 0;
+	opt->progress_fd = -1;
+	opt->progress_format = PROGRESS_JSON;
 
 
 #ifdef DD
@@ -476,6 +548,31 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
                         case OPT_BINARY_PREFIX:
                                 opt->binary_prefix = 1;
                                 break;
+			case OPT_PROGRESS_FD:
+				assert(optarg != NULL);
+				errno = 0;
+				number = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || errno || number < 0 || number > INT_MAX) {
+					fprintf(stderr, "Bad progress fd %s. Use --help get more info.\n", optarg);
+					exit(1);
+				}
+				opt->progress_fd = number;
+				break;
+			case OPT_PROGRESS_FORMAT:
+				assert(optarg != NULL);
+				if (!strcmp(optarg, "json"))
+					opt->progress_format = PROGRESS_JSON;
+				else if (!strcmp(optarg, "prom"))
+					opt->progress_format = PROGRESS_PROM;
+				else {
+					fprintf(stderr, "Unknown progress format %s. Use --help get more info.\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_PROGRESS_FILE:
+				assert(optarg != NULL);
+				opt->progress_file = optarg;
+				break;
                         case OPT_WRITE_DIRECT_IO:
                                 opt->write_direct_io = 1;
                                 break;
@@ -514,6 +611,9 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
                 assert(optarg != NULL);
 				opt->buffer_size = atol(optarg);
 				break;
+			case OPT_AUTO_TUNE:
+				opt->auto_tune = 1;
+				break;
 #ifndef CHKIMG
 #ifndef RESTORE
 #ifndef DD
@@ -543,12 +643,32 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 			case 'R':
 				opt->rescue++;
 				break;
+			case OPT_RESCUE_MAP:
+				assert(optarg != NULL);
+				opt->rescue_mapfile = optarg;
+				break;
+			case OPT_RESCUE_RETRY:
+				opt->rescue_retry = 1;
+				break;
 #else
 			case 'S':
 				assert(optarg != NULL);
 				opt->device_size = (off_t)strtoull(optarg, NULL, 0);
 				break;
 #endif
+#if defined(DD) || defined(IMG)
+			case OPT_SPARSE:
+				opt->sparse = 1;
+				break;
+			case OPT_BLOCK_SIZE:
+				assert(optarg != NULL);
+				opt->raw_block_size = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+#endif
+			case OPT_READAHEAD:
+				assert(optarg != NULL);
+				opt->readahead = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
 			case 'a':
 #ifdef DD
 				fprintf(stderr, "Warning: checksum-mode option is ignored in DD mode\n");
@@ -578,8 +698,31 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 			case 'O':
 				opt->overwrite++;
 			case 'o':
-				opt->target = optarg;
+				if (opt->target_count == MAX_TARGETS) {
+					fprintf(stderr, "Too many targets, at most %d. Use --help get more info.\n", MAX_TARGETS);
+					exit(1);
+				}
+				if (!opt->target)
+					opt->target = optarg;
+				opt->targets[opt->target_count++] = optarg;
+				break;
+#if !defined(DD) || defined(RESTORE)
+			case OPT_TARGET_LAG:
+				assert(optarg != NULL);
+				opt->target_lag = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			case OPT_CHECKPOINT:
+				assert(optarg != NULL);
+				opt->checkpoint = optarg;
+				break;
+			case OPT_CHECKPOINT_INTERVAL:
+				assert(optarg != NULL);
+				opt->checkpoint_interval = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+			case OPT_RESUME:
+				opt->resume = 1;
 				break;
+#endif
 			case 'W':
 				opt->restore_raw_file = 1;
 				break;
@@ -641,6 +784,54 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		exit(1);
 	}
 
+	if (opt->raw_block_size < PART_SECTOR_SIZE || opt->raw_block_size > MAX_BLOCK_SIZE ||
+	    (opt->raw_block_size & (opt->raw_block_size - 1))) {
+		fprintf(stderr, "Bad block size, it must be a power of two from %d to %d. Use --help get more info.\n",
+			PART_SECTOR_SIZE, MAX_BLOCK_SIZE);
+		exit(1);
+	}
+
+	if (opt->target_count > 1) {
+		int i;
+
+		if (!opt->restore || opt->blockfile || opt->compresscmd) {
+			fprintf(stderr, "Several targets are only supported when restoring to devices or files. Use --help get more info.\n");
+			exit(1);
+		}
+		for (i = 0; i < opt->target_count; i++) {
+			if (!strcmp(opt->targets[i], "-")) {
+				fprintf(stderr, "Several targets can't include stdout. Use --help get more info.\n");
+				exit(1);
+			}
+		}
+	}
+
+	if ((opt->rescue_mapfile || opt->rescue_retry) && !opt->rescue) {
+		fprintf(stderr, "The rescue map and retry need --rescue. Use --help get more info.\n");
+		exit(1);
+	}
+
+	if (opt->rescue_retry && !opt->dd) {
+		fprintf(stderr, "The rescue retry can only rewrite a device in --dev-to-dev mode. Use --help get more info.\n");
+		exit(1);
+	}
+
+	if (opt->target_lag == 0) {
+		fprintf(stderr, "Too small or bad target lag. Use --help get more info.\n");
+		exit(1);
+	}
+
+	if (opt->resume && !opt->checkpoint) {
+		fprintf(stderr, "Resume needs the --checkpoint file. Use --help get more info.\n");
+		exit(1);
+	}
+
+	if (opt->checkpoint && (!(opt->clone || opt->restore || opt->dd) ||
+	    opt->blockfile || opt->compresscmd || opt->target_count > 1)) {
+		fprintf(stderr, "Checkpoints are only supported when cloning, restoring or copying to one file or device. Use --help get more info.\n");
+		exit(1);
+	}
+
 	if (opt->offset < 0) {
 		fprintf(stderr, "Too small or bad offset. Use --help get more info.\n");
 		exit(1);
@@ -657,6 +848,16 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	if (!opt->source)
 		opt->source = "-";
 
+	if (opt->progress_fd == STDOUT_FILENO && !strcmp(opt->target, "-")) {
+		fprintf(stderr, "The progress records can't share stdout with the output. Use --help get more info.\n");
+		exit(1);
+	}
+
+	if (opt->checkpoint && (!strcmp(opt->source, "-") || !strcmp(opt->target, "-"))) {
+		fprintf(stderr, "Checkpoints can't be used with stdin or stdout. Use --help get more info.\n");
+		exit(1);
+	}
+
 	if (opt->clone || opt->domain) {
 		if ((!strcmp(opt->source, "-")) || (!opt->source)) {
 			fprintf(stderr, "Partclone can't %s from stdin.\nFor help, type: %s -h\n",
@@ -742,6 +943,23 @@ unsigned long long cnv_blocks_to_bytes(unsigned long long block_offset, unsigned
 	return bytes_count;
 }
 
+/**
+ * Convert a number of blocks to the bytes they cover on the device. Only the
+ * last block of a raw image can end past the device size, it is cut there.
+ */
+unsigned long long cnv_blocks_to_device_bytes(unsigned long long block_offset, unsigned long long block_count, unsigned int block_size, unsigned long long device_size) {
+
+	unsigned long long start = block_offset * block_size;
+	unsigned long long bytes_count = block_count * block_size;
+
+	if (start >= device_size)
+		return 0;
+	if (bytes_count > device_size - start)
+		bytes_count = device_size - start;
+
+	return bytes_count;
+}
+
 /**
  * Ncurses Text User Interface
  * open_ncurses	    - open text window
@@ -1038,6 +1256,10 @@ void load_image_desc_v2(file_system_info* fs_info, image_options* img_opt,
 	}
 
 	unsigned long long calculated_size = fs_info->totalblock * fs_info->block_size;
+	/// the last block of a raw image may run past the end of the device
+	if (strcmp(fs_info->fs, raw_MAGIC) == 0 && calculated_size > fs_info->device_size &&
+	    calculated_size - fs_info->device_size < fs_info->block_size)
+		calculated_size = fs_info->device_size;
 	if (calculated_size > fs_info->device_size) {
 		log_mesg(0, 1, 1, opt->debug, "Invalid image: calculated filesystem size is larger than device size.\n");
 	}
@@ -1806,8 +2028,11 @@ int open_target(char* target, cmd_opt* opt) {
 			if ((ret = fileno(stdout)) == -1)
 				log_mesg(0, 1, 1, debug, "clone: open %s(stdout) error\n", target);
 		} else {
-			flags |= O_CREAT | O_TRUNC;
-			if (!opt->overwrite)
+			/// a resumed clone keeps what was written before the checkpoint
+			flags |= O_CREAT;
+			if (!opt->resume)
+				flags |= O_TRUNC;
+			if (!opt->overwrite && !opt->resume)
 				flags |= O_EXCL;
 			if ((ret = open(target, flags, S_IRUSR|S_IWUSR)) == -1) {
 				if (errno == EEXIST) {
@@ -1837,15 +2062,14 @@ int open_target(char* target, cmd_opt* opt) {
 		}
 
 		/// check block device
-		stat(target, &st_dev);
-		if (!S_ISBLK(st_dev.st_mode)) {
-                    if ((opt->dd) && (!opt->overwrite)){
+		if ((stat(target, &st_dev) == -1) || !S_ISBLK(st_dev.st_mode)) {
+                    if ((opt->dd) && (!opt->overwrite) && (!opt->resume)){
                         log_mesg(1, 0, 1, debug, "Warning, device(%s) not exist?! Use option --overwrite if you want to CREATE special file\n", target);
 			log_mesg(0, 1, 1, debug, "error exit\n");
                     }
                     log_mesg(1, 0, 1, debug, "Warning, you are doing restore to non-block device(%s)?\n", target);
 			flags |= O_CREAT;
-			if (!opt->overwrite)
+			if (!opt->overwrite && !opt->resume)
 				flags |= O_EXCL;
 		}
 
@@ -1904,6 +2128,7 @@ int write_block_file(char* target, char *buf, unsigned long long count, unsigned
 
 	// for sync I/O buffer, when use stdin or pipe.
 	while (count > 0) {
+	    pc_count(write_calls[pc_size_bucket(count)], 1);
 	    i = write(torrent_fd, buf, count);
 
 	    if (i < 0) {
@@ -1919,8 +2144,11 @@ int write_block_file(char* target, char *buf, unsigned long long count, unsigned
 		free(block_filename);
 		return 0;
 	    } else {
+		if (i < count)
+		    pc_count(short_calls, 1);
 		count -= i;
 		buf = i + (char *) buf;
+		pc_count(bytes_written, i);
 		log_mesg(2, 0, 0, debug, "%s: %s %lli, %llu left.\n", __func__, "write block file", i, count);
 	    }
 	}
@@ -1939,8 +2167,10 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 	// for sync I/O buffer, when use stdin or pipe.
 	while (count > 0) {
 		if (do_write) {
+			pc_count(write_calls[pc_size_bucket(count)], 1);
 			i = write(*fd, buf, count);
                 } else {
+			pc_count(read_calls[pc_size_bucket(count)], 1);
 			i = read(*fd, buf, count);
                 }
 		if (i < 0) {
@@ -1954,8 +2184,14 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 			log_mesg(1, 0, 0, debug, "%s: rescue write size = %llu\n",__func__, rescue_write_size);
 			return 0;
 		} else {
+			if (i < count)
+				pc_count(short_calls, 1);
 			count -= i;
 			buf = i + (char *) buf;
+			if (do_write)
+				pc_count(bytes_written, i);
+			else
+				pc_count(bytes_read, i);
 			log_mesg(2, 0, 0, debug, "%s: %s %lli, %llu left.\n",
 				__func__, do_write ? "write" : "read", i, count);
 		}
@@ -1970,21 +2206,291 @@ void sync_data(int fd, cmd_opt* opt) {
 	log_mesg(0, 0, 1, opt->debug, "OK!\n");
 }
 
-void rescue_sector(int *fd, unsigned long long pos, char *buff, cmd_opt *opt) {
+/**
+ * Bad sector rescue
+ *
+ * When a chunk can't be read, rescue_range() splits it in halves and rereads
+ * them until the unreadable sectors are isolated, so a chunk with a single bad
+ * sector costs a few reads instead of one per sector. A run of bad sectors
+ * usually goes on, so after two bad sectors in a row the following sectors are
+ * skipped with a growing step and only marked as not tried. The unreadable and
+ * skipped ranges are kept in a list, rescue_retry() can read them again one
+ * sector at a time at the end and rescue_map_write() saves them as a GNU
+ * ddrescue mapfile.
+ */
+#define RESCUE_SKIP_MIN (64 * 1024)
+#define RESCUE_SKIP_MAX (64 * 1024 * 1024)
+
+typedef struct {
+	unsigned long long pos;
+	unsigned long long size;
+	char status;		/// '-' bad sector, '?' skipped and not tried, '+' read on retry
+} rescue_area;
+
+static rescue_area *rescue_map = NULL;
+static unsigned long rescue_map_count = 0, rescue_map_capacity = 0;
+static unsigned long long rescue_skip_end = 0;	/// end of the range being skipped
+static unsigned long long rescue_skip_size = 0;
+static int rescue_bad_run = 0;			/// consecutive bad sectors
+
+static void rescue_map_add(unsigned long long pos, unsigned long long size, char status, cmd_opt *opt) {
+	rescue_area *last = rescue_map_count ? &rescue_map[rescue_map_count - 1] : NULL;
+
+	if (last && last->status == status && last->pos + last->size == pos) {
+		last->size += size;
+		return;
+	}
+	if (rescue_map_count == rescue_map_capacity) {
+		rescue_map_capacity = rescue_map_capacity ? rescue_map_capacity * 2 : 256;
+		rescue_map = realloc(rescue_map, rescue_map_capacity * sizeof(rescue_area));
+		if (rescue_map == NULL)
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+	rescue_map[rescue_map_count].pos = pos;
+	rescue_map[rescue_map_count].size = size;
+	rescue_map[rescue_map_count].status = status;
+	rescue_map_count++;
+}
+
+/// fill the sectors that can't be read with the BADSECTOR pattern
+static void rescue_fill(char *buff, unsigned long long count) {
 	const char badsector_magic[10] = {'B', 'A', 'D', 'S', 'E', 'C', 'T', 'O', 'R', '\0'};
+	unsigned long long i;
+
+	memset(buff, '?', count);
+	for (i = 0; i + sizeof(badsector_magic) <= count; i += PART_SECTOR_SIZE)
+		memcpy(buff + i, badsector_magic, sizeof(badsector_magic));
+}
+
+static int rescue_pread(int fd, char *buff, unsigned long long count, unsigned long long pos) {
+	ssize_t r;
+
+	while (count) {
+		r = pread(fd, buff, count, pos);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r <= 0)
+			return -1;
+		buff += r;
+		pos += r;
+		count -= r;
+	}
+	return 0;
+}
+
+void rescue_range(int *fd, unsigned long long pos, char *buff, unsigned long long count, cmd_opt *opt) {
+	unsigned long long half;
 
-	if (lseek(*fd, pos, SEEK_SET) == (off_t)-1) {
-		log_mesg(0, 0, 1, opt->debug, "WARNING: lseek error at %llu\n", pos);
-		memset(buff, '?', PART_SECTOR_SIZE);
-		memcpy(buff, badsector_magic, strlen(badsector_magic)+1);
+	/// inside a run of bad sectors, don't even try
+	if (pos < rescue_skip_end) {
+		half = rescue_skip_end - pos < count ? rescue_skip_end - pos : count;
+		rescue_fill(buff, half);
+		rescue_map_add(pos, half, '?', opt);
+		if (half == count)
+			return;
+		pos += half;
+		buff += half;
+		count -= half;
+	}
+
+	if (rescue_pread(*fd, buff, count, pos) == 0) {
+		rescue_bad_run = 0;
+		rescue_skip_size = 0;
 		return;
 	}
 
-	if (io_all(fd, buff, PART_SECTOR_SIZE, 0, opt) == -1) { /// read_all
+	if (count <= PART_SECTOR_SIZE) {
 		log_mesg(0, 0, 1, opt->debug, "WARNING: Can't read sector at %llu, lost data.\n", pos);
-		memset(buff, '?', PART_SECTOR_SIZE);
-		memcpy(buff, badsector_magic, strlen(badsector_magic)+1);
+		rescue_fill(buff, count);
+		rescue_map_add(pos, count, '-', opt);
+		if (++rescue_bad_run >= 2) {
+			rescue_skip_size = rescue_skip_size ? rescue_skip_size * 2 : RESCUE_SKIP_MIN;
+			if (rescue_skip_size > RESCUE_SKIP_MAX)
+				rescue_skip_size = RESCUE_SKIP_MAX;
+			rescue_skip_end = pos + count + rescue_skip_size;
+			log_mesg(1, 0, 0, opt->debug, "%s: skip %llu bytes after bad sector at %llu\n", __func__, rescue_skip_size, pos);
+		}
+		return;
 	}
+
+	half = (count / 2 + PART_SECTOR_SIZE - 1) / PART_SECTOR_SIZE * PART_SECTOR_SIZE;
+	rescue_range(fd, pos, buff, half, opt);
+	rescue_range(fd, pos + half, buff + half, count - half, opt);
+}
+
+/// logical sector size of the block device @fd, PART_SECTOR_SIZE for anything else
+static unsigned int rescue_sector_size(int fd) {
+	int size = 0;
+
+#ifdef BLKSSZGET
+	if (ioctl(fd, BLKSSZGET, &size) == -1)
+		size = 0;
+#endif
+	return size > PART_SECTOR_SIZE ? size : PART_SECTOR_SIZE;
+}
+
+/**
+ * The retry reads and writes whole logical sectors of both devices, a 4Kn
+ * disk opened for direct io refuses anything smaller. The whole sector is
+ * written back, its readable neighbours hold the same data as the source.
+ */
+unsigned long long rescue_retry(int *fdr, int *fdw, unsigned long long target_offset, cmd_opt *opt) {
+	rescue_area *old_map = rescue_map;
+	unsigned long old_count = rescue_map_count;
+	unsigned long long recovered = 0, pos, end, size, sector_pos, len;
+	unsigned int sector, w_sector;
+	unsigned long i;
+	char *buff = NULL;
+
+	if (!old_count)
+		return 0;
+
+	sector = rescue_sector_size(*fdr);
+	w_sector = rescue_sector_size(*fdw);
+	if (w_sector > sector)
+		sector = w_sector;
+	if (target_offset % sector)
+		log_mesg(0, 0, 1, opt->debug, "WARNING: target offset %llu isn't a multiple of the sector size %u\n", target_offset, sector);
+	if (posix_memalign((void **)&buff, sector > BSIZE ? sector : BSIZE, sector))
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	log_mesg(0, 0, 1, opt->debug, "Retry the unreadable sectors, %u bytes at a time...\n", sector);
+	rescue_map = NULL;
+	rescue_map_count = rescue_map_capacity = 0;
+
+	for (i = 0; i < old_count; i++) {
+		if (old_map[i].status == '+') {
+			rescue_map_add(old_map[i].pos, old_map[i].size, '+', opt);
+			continue;
+		}
+		end = old_map[i].pos + old_map[i].size;
+		for (pos = old_map[i].pos; pos < end; pos += size) {
+			sector_pos = pos / sector * sector;
+			size = sector_pos + sector - pos;
+			if (size > end - pos)
+				size = end - pos;
+			len = sector;
+			if (sector == PART_SECTOR_SIZE) {
+				/// the tail of a file may be shorter than a sector
+				sector_pos = pos;
+				len = size;
+			}
+			if (rescue_pread(*fdr, buff, len, sector_pos) ||
+			    pwrite(*fdw, buff, len, target_offset + sector_pos) != (ssize_t)len) {
+				rescue_map_add(pos, size, '-', opt);
+				continue;
+			}
+			rescue_map_add(pos, size, '+', opt);
+			recovered += size;
+		}
+	}
+	free(old_map);
+	free(buff);
+
+	log_mesg(0, 0, 1, opt->debug, "%llu bytes recovered by the retry pass\n", recovered);
+	return recovered;
+}
+
+void rescue_map_write(const char *path, unsigned long long device_size, cmd_opt *opt) {
+	unsigned long long pos = 0, bad = 0;
+	unsigned long i;
+	FILE *map;
+
+	if ((map = fopen(path, "w")) == NULL)
+		log_mesg(0, 1, 1, opt->debug, "open rescue map %s error: %s\n", path, strerror(errno));
+
+	/// areas not listed were read or are free blocks partclone doesn't need
+	fprintf(map, "# Mapfile. Created by %s v%s\n", get_exec_name(), VERSION);
+	fprintf(map, "# current_pos  current_status  current_pass\n");
+	fprintf(map, "0x%08llX     +               1\n", device_size);
+	fprintf(map, "#      pos        size  status\n");
+	for (i = 0; i < rescue_map_count; i++) {
+		if (rescue_map[i].status == '+')
+			continue;
+		if (rescue_map[i].pos > pos)
+			fprintf(map, "0x%08llX  0x%08llX  +\n", pos, rescue_map[i].pos - pos);
+		fprintf(map, "0x%08llX  0x%08llX  %c\n", rescue_map[i].pos, rescue_map[i].size, rescue_map[i].status);
+		pos = rescue_map[i].pos + rescue_map[i].size;
+		bad += rescue_map[i].size;
+	}
+	if (pos < device_size)
+		fprintf(map, "0x%08llX  0x%08llX  +\n", pos, device_size - pos);
+
+	if (fclose(map))
+		log_mesg(0, 1, 1, opt->debug, "write rescue map %s error: %s\n", path, strerror(errno));
+	log_mesg(0, 0, 1, opt->debug, "Rescue map %s written, %llu bytes unreadable or not tried\n", path, bad);
+}
+
+#define ZERO_BUFFER_SIZE DEFAULT_BUFFER_SIZE
+static char *zero_buffer = NULL;
+static pthread_once_t zero_buffer_once = PTHREAD_ONCE_INIT;
+
+/// allocate the zeros of zero_bytes() once, the fanout writers share them
+static void alloc_zero_buffer(void) {
+	char *buffer;
+
+	if (posix_memalign((void **)&buffer, BSIZE, ZERO_BUFFER_SIZE))
+		return;
+	memset(buffer, 0, ZERO_BUFFER_SIZE);
+	zero_buffer = buffer;
+}
+
+/**
+ * Zero @count bytes of the target from its current offset and move the offset
+ * past them. The holes of a raw image must read back as zeros, so they can't
+ * simply be seeked over like the free blocks of a file system. Block devices
+ * are asked to zero the range, regular files get a hole punched or are
+ * extended; the zeros are written out when neither is possible.
+ */
+long long zero_bytes(int *fd, unsigned long long count, cmd_opt *opt) {
+	const unsigned long long zero_buffer_size = ZERO_BUFFER_SIZE;
+	unsigned long long completed = 0, size;
+	struct stat st;
+	off_t pos;
+
+	if (count == 0)
+		return 0;
+
+	pos = lseek(*fd, 0, SEEK_CUR);
+	if (pos != (off_t)-1 && fstat(*fd, &st) == 0) {
+		if (S_ISBLK(st.st_mode)) {
+#ifdef BLKZEROOUT
+			uint64_t range[2] = { pos, count };
+
+			if ((pos % PART_SECTOR_SIZE) == 0 && (count % PART_SECTOR_SIZE) == 0 &&
+			    ioctl(*fd, BLKZEROOUT, &range) == 0)
+				return lseek(*fd, pos + count, SEEK_SET) == (off_t)-1 ? -1 : (long long)count;
+#endif
+		} else if (S_ISREG(st.st_mode)) {
+			unsigned long long end = pos + count;
+			int zeroed = 1;
+
+			if (pos < st.st_size) {
+				size = end < (unsigned long long)st.st_size ? count : st.st_size - pos;
+#ifdef FALLOC_FL_PUNCH_HOLE
+				zeroed = fallocate(*fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size) == 0;
+#else
+				zeroed = 0;
+#endif
+			}
+			if (zeroed && end > (unsigned long long)st.st_size && ftruncate(*fd, end) == -1)
+				zeroed = 0;
+			if (zeroed)
+				return lseek(*fd, end, SEEK_SET) == (off_t)-1 ? -1 : (long long)count;
+		}
+		log_mesg(2, 0, 0, opt->debug, "%s: write %llu zero bytes at %llu\n", __func__, count, (unsigned long long)pos);
+	}
+
+	pthread_once(&zero_buffer_once, alloc_zero_buffer);
+	if (zero_buffer == NULL)
+		return -1;
+	while (completed < count) {
+		size = count - completed < zero_buffer_size ? count - completed : zero_buffer_size;
+		if (write_all(fd, zero_buffer, size, opt) != (int)size)
+			return -1;
+		completed += size;
+	}
+	return completed;
 }
 
 long long skip_bytes(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt) {
@@ -2037,6 +2543,79 @@ int skip_blocks(int *fd, char *empty_buffer, unsigned long long empty_buffer_siz
 	return 0;
 }
 
+/**
+ * Readahead of the used blocks
+ *
+ * The copy loops seek over the free blocks and read a run of used blocks at
+ * a time. The kernel readahead sees forward reads with gaps, it reads the
+ * gaps too or gives up, and the page cache keeps data that is never read
+ * again. readahead_next() gives the next --readahead runs to
+ * POSIX_FADV_WILLNEED before the loop needs them, cut the same way as the
+ * loop cuts them, and readahead_done() gives what is behind the cursor to
+ * POSIX_FADV_DONTNEED. Nothing is hinted with --read-direct-io, which doesn't
+ * use the page cache, or when the source is a pipe.
+ */
+void readahead_init(source_readahead *ra, int fd, unsigned long *bitmap, unsigned long long totalblock,
+		    unsigned int block_size, unsigned int run_max, unsigned long long block_id, cmd_opt *opt) {
+	struct stat st;
+
+	memset(ra, 0, sizeof(source_readahead));
+	ra->fd = -1;
+	if (!opt->readahead || opt->read_direct_io || fstat(fd, &st) == -1 ||
+	    !(S_ISBLK(st.st_mode) || S_ISREG(st.st_mode)))
+		return;
+
+	ra->fd = fd;
+	ra->bitmap = bitmap;
+	ra->totalblock = totalblock;
+	ra->block_size = block_size;
+	ra->run_max = run_max ? run_max : 1;
+	ra->runs = opt->readahead;
+	ra->hinted = block_id;
+	ra->dropped = block_id;
+	log_mesg(1, 0, 0, opt->debug, "readahead: %u runs of up to %u blocks from block %llu\n",
+		 ra->runs, ra->run_max, block_id);
+}
+
+/// prefetch the runs up to --readahead ahead of the run at @block_id the loop reads now
+void readahead_next(source_readahead *ra, unsigned long long block_id) {
+	unsigned long long start, count;
+
+	if (ra->fd < 0)
+		return;
+
+	if (block_id >= ra->hinted) {
+		/// the loop got ahead of the hints, start over from it
+		ra->hinted = block_id;
+		ra->ahead = 0;
+	} else if (ra->ahead)
+		ra->ahead--;
+
+	while (ra->ahead < ra->runs) {
+		for (start = ra->hinted; start < ra->totalblock &&
+		     !pc_test_bit(start, ra->bitmap, ra->totalblock); start++);
+		if (start == ra->totalblock)
+			break;
+		for (count = 0; start + count < ra->totalblock && count < ra->run_max &&
+		     pc_test_bit(start + count, ra->bitmap, ra->totalblock); count++);
+
+		posix_fadvise(ra->fd, (off_t)(start * ra->block_size), (off_t)(count * ra->block_size), POSIX_FADV_WILLNEED);
+		ra->hinted = start + count;
+		ra->ahead++;
+	}
+}
+
+/// drop the page cache of the source up to @block_end, the loop has read it
+void readahead_done(source_readahead *ra, unsigned long long block_end) {
+
+	if (ra->fd < 0 || block_end <= ra->dropped)
+		return;
+
+	posix_fadvise(ra->fd, (off_t)(ra->dropped * ra->block_size),
+		      (off_t)((block_end - ra->dropped) * ra->block_size), POSIX_FADV_DONTNEED);
+	ra->dropped = block_end;
+}
+
 void init_bt_info(bt_info_t * bt, char *target,
 			 unsigned int block_size,
 			 unsigned long long blocks_total)
@@ -2077,11 +2656,19 @@ void print_opt(cmd_opt opt) {
 	log_mesg(1, 0, 0, debug, "TARGET: %s\n", opt.target);
 	log_mesg(1, 0, 0, debug, "OVERWRITE: %i\n", opt.overwrite);
 	log_mesg(1, 0, 0, debug, "RESCUE: %i\n", opt.rescue);
+	log_mesg(1, 0, 0, debug, "RESCUE_MAP: %s, RETRY: %i\n", opt.rescue_mapfile ? opt.rescue_mapfile : "", opt.rescue_retry);
 	log_mesg(1, 0, 0, debug, "CHECK: %i\n", opt.check);
 	log_mesg(1, 0, 0, debug, "QUIET: %i\n", opt.quiet);
 	log_mesg(1, 0, 0, debug, "FRESH: %i\n", opt.fresh);
+	log_mesg(1, 0, 0, debug, "PROGRESS FD: %i, FILE: %s, FORMAT: %s\n", opt.progress_fd,
+		opt.progress_file ? opt.progress_file : "", opt.progress_format == PROGRESS_PROM ? "prom" : "json");
+	log_mesg(1, 0, 0, debug, "AUTO TUNE: %i\n", opt.auto_tune);
+	log_mesg(1, 0, 0, debug, "READAHEAD: %u\n", opt.readahead);
 	log_mesg(1, 0, 0, debug, "FORCE: %i\n", opt.force);
 	log_mesg(1, 0, 0, debug, "BTFILES: %i\n", opt.blockfile);
+	log_mesg(1, 0, 0, debug, "SPARSE: %i\n", opt.sparse);
+	log_mesg(1, 0, 0, debug, "RAW_BLOCK_SIZE: %u\n", opt.raw_block_size);
+	log_mesg(1, 0, 0, debug, "TARGETS: %i, LAG: %u\n", opt.target_count, opt.target_count > 1 ? opt.target_lag : 0);
 #ifdef HAVE_LIBNCURSESW
 	log_mesg(1, 0, 0, debug, "NCURSES: %i\n", opt.ncurses);
 #endif
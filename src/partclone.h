@@ -68,6 +68,15 @@ typedef struct {
 #define NOTE_SIZE 128
 #define BSIZE 512
 #define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define DEFAULT_RAW_BLOCK_SIZE 4096
+#define MAX_TARGETS 64
+#define DEFAULT_TARGET_LAG 16
+#define DEFAULT_READAHEAD 8
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+
+// --progress-format
+#define PROGRESS_JSON 0
+#define PROGRESS_PROM 1
 
 // Reference: ntfsclone.c
 #define KBYTE (1000)
@@ -94,6 +103,26 @@ const char* get_exec_name();
 #define partclone
 extern char *EXECNAME;
 extern unsigned long long rescue_write_size;
+
+/**
+ * bytes moved by io_all() and the target threads and the checksum errors
+ * found, read by the --progress-fd reporter. They are bumped without a lock,
+ * use pc_count() to add and __atomic_load_n() to read them. The read and
+ * write syscalls are counted by the log2 of the size asked.
+ */
+#define IO_SIZE_BUCKETS 32
+typedef struct {
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long checksum_errors;
+    unsigned long long read_calls[IO_SIZE_BUCKETS];
+    unsigned long long write_calls[IO_SIZE_BUCKETS];
+    unsigned long long short_calls;	/// moved less than asked
+} io_counters;
+extern io_counters pc_counters;
+#define pc_count(field, n) __atomic_fetch_add(&pc_counters.field, (n), __ATOMIC_RELAXED)
+#define pc_size_bucket(n) ((n) >= (1ULL << (IO_SIZE_BUCKETS - 1)) ? IO_SIZE_BUCKETS - 1 : \
+	(n) ? 63 - __builtin_clzll(n) : 0)
 #endif
 
 /**
@@ -135,6 +164,8 @@ struct cmd_opt
     int binary_prefix;
     int prog_second;
     unsigned int buffer_size;
+    int auto_tune;
+    unsigned int readahead;
     off_t offset;
     unsigned long fresh;
     off_t offset_domain;
@@ -143,6 +174,19 @@ struct cmd_opt
     int reseed_checksum;
     unsigned long blocks_per_checksum;
     unsigned long device_size;
+    int sparse;
+    unsigned int raw_block_size;
+    char* targets[MAX_TARGETS];
+    int target_count;
+    unsigned int target_lag;
+    char* rescue_mapfile;
+    int rescue_retry;
+    char* checkpoint;
+    unsigned int checkpoint_interval;
+    int resume;
+    int progress_fd;
+    int progress_format;
+    char* progress_file;
 };
 typedef struct cmd_opt cmd_opt;
 
@@ -300,11 +344,35 @@ extern void log_mesg(int lerrno, int lexit, int only_debug, int debug, const cha
 extern void close_log();
 extern int io_all(int *fd, char *buffer, unsigned long long count, int do_write, cmd_opt *opt);
 extern void sync_data(int fd, cmd_opt* opt);
-extern void rescue_sector(int *fd, unsigned long long pos, char *buff, cmd_opt *opt);
+extern void rescue_range(int *fd, unsigned long long pos, char *buff, unsigned long long count, cmd_opt *opt);
+extern unsigned long long rescue_retry(int *fdr, int *fdw, unsigned long long target_offset, cmd_opt *opt);
+extern void rescue_map_write(const char *path, unsigned long long device_size, cmd_opt *opt);
+extern long long zero_bytes(int *fd, unsigned long long count, cmd_opt *opt);
 extern long long skip_bytes(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt);
 extern int skip_blocks(int *fd, char *empty_buffer, unsigned long long empty_buffer_size, unsigned long long empty_count, cmd_opt *opt, unsigned long long *block_id);
 
+/**
+ * Page cache hints of the source, the runs of used blocks the copy loops
+ * read in one go are prefetched and what is behind them dropped.
+ */
+typedef struct {
+	int fd;				/// -1 when the hints are off
+	unsigned long *bitmap;
+	unsigned long long totalblock;
+	unsigned int block_size;
+	unsigned int run_max;		/// blocks of a run, the buffer capacity
+	unsigned int runs;		/// --readahead, runs prefetched ahead
+	unsigned int ahead;		/// runs prefetched and not read yet
+	unsigned long long hinted;	/// end of the last run prefetched
+	unsigned long long dropped;	/// the blocks before it are dropped
+} source_readahead;
+extern void readahead_init(source_readahead *ra, int fd, unsigned long *bitmap, unsigned long long totalblock,
+			   unsigned int block_size, unsigned int run_max, unsigned long long block_id, cmd_opt *opt);
+extern void readahead_next(source_readahead *ra, unsigned long long block_id);
+extern void readahead_done(source_readahead *ra, unsigned long long block_end);
+
 extern unsigned long long cnv_blocks_to_bytes(unsigned long long block_offset, unsigned int block_count, unsigned int block_size, const image_options* img_opt);
+extern unsigned long long cnv_blocks_to_device_bytes(unsigned long long block_offset, unsigned long long block_count, unsigned int block_size, unsigned long long device_size);
 extern unsigned long long get_bitmap_size_on_disk(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
 extern unsigned long get_checksum_count(unsigned long long block_count, const image_options *img_opt);
 extern void update_used_blocks_count(file_system_info* fs_info, unsigned long* bitmap);
@@ -313,6 +381,7 @@ extern void init_fs_info(file_system_info* fs_info);
 extern void init_image_options(image_options* img_opt);
 extern void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_system_info* fs_info, image_options* img_opt);
 extern void load_image_bitmap(int* ret, cmd_opt opt, file_system_info fs_info, image_options img_opt, unsigned long* bitmap);
+extern void load_image_bitmap_bytes(int* ret, cmd_opt opt, file_system_info fs_info, unsigned long* bitmap);
 extern void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt);
 extern void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt);
 
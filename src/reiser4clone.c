@@ -37,6 +37,7 @@
 #define MAX_REISER4_TOTAL_BLOCKS (1ULL << 40) // Max total blocks (approx 512TB @ 512B/block) to prevent DoS/memory exhaustion
 #define MIN_REISER4_BLOCK_SIZE 512 // Smallest supported Reiser4 block size
 #define MAX_REISER4_BLOCK_SIZE 65536 // Largest supported Reiser4 block size (64KB)
+#define BITMAP_CHUNK (1ULL << 24) // blocks imported between two progress updates
 
 aal_device_t           *fs_device;
 reiser4_fs_t           *fs = NULL;
@@ -110,7 +111,7 @@ static void fs_close(){
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
     reiser4_bitmap_t       *fs_bitmap = NULL;
-    unsigned long long     bit, block, bused = 0, bfree = 0;
+    unsigned long long     bit, chunk, bused = 0, bfree = 0;
     int start = 0;
     int bit_size = 1;
 
@@ -148,21 +149,16 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
 
 
-    for(bit = 0; bit < total_blocks_from_format; bit++){
-        block = bit ;
-        if(reiser4_bitmap_test(fs_bitmap, bit)){
-            bused++;
-            pc_set_bit(block, bitmap, fs_info.totalblock);
-            log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is used %llu", __FILE__, block);
-        } else {
-            pc_clear_bit(block, bitmap, fs_info.totalblock);
-            bfree++;
-            log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is free %llu", __FILE__, block);
-        }
+    /// the reiser4 bitmap has the bit order of the partclone bitmap
+    for (bit = 0; bit < total_blocks_from_format; bit += chunk) {
+        chunk = total_blocks_from_format - bit;
+        if (chunk > BITMAP_CHUNK)
+            chunk = BITMAP_CHUNK;
+        bused += pc_import_bits(bit, (unsigned char *)fs_bitmap->map + bit / 8, chunk, 0, bitmap, fs_info.totalblock);
         /// update progress
-        update_pui(&prog, bit, bit, 0);
-
+        update_pui(&prog, bit + chunk - 1, bit + chunk - 1, 0);
     }
+    bfree = total_blocks_from_format - bused;
 
     if(bfree != reiser4_format_get_free(fs->format))
         log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap free count err, bfree:%llu, sfree=%llu\n", __FILE__, bfree, reiser4_format_get_free(fs->format));
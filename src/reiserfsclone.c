@@ -32,6 +32,7 @@
 
 #define MIN_REISERFS_BLOCK_SIZE 512 // Smallest supported ReiserFS block size
 #define MAX_REISERFS_BLOCK_SIZE 4096 // Largest supported ReiserFS block size
+#define BITMAP_CHUNK (1ULL << 24) // blocks imported between two progress updates
 
 dal_t		 *dal;
 reiserfs_fs_t	 *fs;
@@ -79,7 +80,7 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 {
     reiserfs_bitmap_t    *fs_bitmap;
     reiserfs_tree_t	 *tree;
-    unsigned long long	 blk = 0;
+    unsigned long long	 blk = 0, chunk = 0;
     unsigned long long 	 bused = 0, bfree = 0;
     int start = 0;
     int bit_size = 1;
@@ -116,21 +117,16 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     progress_bar   bprog;	/// progress_bar structure defined in progress.h
     progress_init(&bprog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size); // Use fs_info.totalblock for progress
 
-    for( blk = 0; blk < fs_info.totalblock; blk++ ){
-	
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block totalblock %llu\n", __FILE__, fs_info.totalblock);
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block bitmap check %llu\n", __FILE__, blk);
-	if(reiserfs_tools_test_bit(blk, fs_bitmap->bm_map)){
-	    bused++;
-	    pc_set_bit(blk, bitmap, fs_info.totalblock);
-	}else{
-	    bfree++;
-	    pc_clear_bit(blk, bitmap, fs_info.totalblock);
-	}
+    /// the reiserfs bitmap has the bit order of the partclone bitmap
+    for (blk = 0; blk < fs_info.totalblock; blk += chunk) {
+	chunk = fs_info.totalblock - blk;
+	if (chunk > BITMAP_CHUNK)
+	    chunk = BITMAP_CHUNK;
+	bused += pc_import_bits(blk, (unsigned char *)fs_bitmap->bm_map + blk / 8, chunk, 0, bitmap, fs_info.totalblock);
 	/// update progress
-	update_pui(&bprog, blk, blk, done);
-
+	update_pui(&bprog, blk + chunk - 1, blk + chunk - 1, done);
     }
+    bfree = fs_info.totalblock - bused;
 
     if(bfree != fs->super->s_v1.sb_free_blocks)
 	log_mesg(0, 1, 1, fs_opt.debug, "%s: bitmap free count err, free:%llu (from map), expected:%u (from sb)\n", __FILE__, bfree, fs->super->s_v1.sb_free_blocks);
@@ -0,0 +1,281 @@
+/**
+ * tune.c - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * --auto-tune, pick the buffer size and the target lag for the devices
+ *
+ * The hints of every side come from the kernel: the minimal and optimal io
+ * size (BLKIOMIN, BLKIOOPT), the rotational flag and the queue depth of the
+ * disk in sysfs and the file system type of a file. A pipe has none. The
+ * source is also read for a moment with every buffer size from
+ * TUNE_BUFFER_MIN to TUNE_BUFFER_MAX. The smallest buffer within 5% of the
+ * fastest one is taken, at least 4 MiB for disks and network file systems
+ * where every request costs a seek or a round trip, and rounded up to the
+ * optimal io size (the RAID stripe) of both sides. The targets are not
+ * written, they hold an image being resumed or data the copy would clobber.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+
+#include "partclone.h"
+#include "tune.h"
+
+#if defined(linux) && defined(_IO) && !defined(BLKIOMIN)
+#define BLKIOMIN	_IO(0x12,120)	/* minimal io size in bytes */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKIOOPT)
+#define BLKIOOPT	_IO(0x12,121)	/* optimal io size in bytes */
+#endif
+#if defined(linux) && defined(_IOR) && !defined(BLKGETSIZE64)
+#define BLKGETSIZE64	_IOR(0x12,114,size_t)
+#endif
+
+#define TUNE_BUFFER_MIN		(256 * 1024)
+#define TUNE_BUFFER_MAX		(16 * 1024 * 1024)
+#define TUNE_BUFFER_SEEK	(4 * 1024 * 1024)	/// least for disks and network file systems
+#define TUNE_PROBE_BYTES	(32 * 1024 * 1024)	/// read with each buffer size
+#define TUNE_PROBE_NSEC		200000000LL		/// or for at most 0.2 s
+#define TUNE_WINDOW_MIN		(16 * 1024 * 1024)	/// bytes the fanout targets may lag
+#define TUNE_WINDOW_MAX		(256 * 1024 * 1024)
+#define TUNE_LAG_MAX		64
+
+/// file system magics of statfs(2) that are network file systems
+#define NFS_SUPER_MAGIC		0x6969
+#define SMB_SUPER_MAGIC		0x517B
+#define CIFS_SUPER_MAGIC	0xFF534D42
+#define SMB2_SUPER_MAGIC	0xFE534D42
+#define CEPH_SUPER_MAGIC	0x00C36400
+#define FUSE_SUPER_MAGIC	0x65735546
+
+typedef struct {
+	const char *kind;		/// disk, ssd, file, network, pipe
+	unsigned int io_min;
+	unsigned int io_opt;
+	unsigned int nr_requests;	/// queue depth of the disk
+	unsigned int max_sectors_kb;	/// largest request of the disk
+	unsigned long long size;	/// 0 when it can't be read at will
+} tune_hint;
+
+/// read an unsigned number from the sysfs queue of the disk @dev, 0 if there is none
+static unsigned int sysfs_queue(dev_t dev, const char *name) {
+	char path[128];
+	unsigned int value = 0;
+	FILE *f;
+
+	/// a partition has no queue of its own, it is in the directory of its disk
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(dev), minor(dev), name);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(dev), minor(dev), name);
+		f = fopen(path, "r");
+	}
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%u", &value) != 1)
+		value = 0;
+	fclose(f);
+	return value;
+}
+
+static void get_hint(int fd, tune_hint *hint, cmd_opt *opt) {
+	struct stat st;
+	struct statfs sf;
+
+	memset(hint, 0, sizeof(tune_hint));
+	hint->kind = fd < 0 ? "none" : "pipe";
+	if (fd < 0 || fstat(fd, &st) == -1)
+		return;
+
+	if (S_ISBLK(st.st_mode)) {
+#ifdef BLKIOMIN
+		if (ioctl(fd, BLKIOMIN, &hint->io_min) == -1)
+			hint->io_min = 0;
+#endif
+#ifdef BLKIOOPT
+		if (ioctl(fd, BLKIOOPT, &hint->io_opt) == -1)
+			hint->io_opt = 0;
+#endif
+#ifdef BLKGETSIZE64
+		if (ioctl(fd, BLKGETSIZE64, &hint->size) == -1)
+			hint->size = 0;
+#endif
+		hint->kind = sysfs_queue(st.st_rdev, "rotational") ? "disk" : "ssd";
+		hint->nr_requests = sysfs_queue(st.st_rdev, "nr_requests");
+		hint->max_sectors_kb = sysfs_queue(st.st_rdev, "max_sectors_kb");
+	} else if (S_ISREG(st.st_mode)) {
+		hint->kind = "file";
+		hint->io_opt = st.st_blksize;
+		hint->size = st.st_size;
+		if (fstatfs(fd, &sf) == 0) {
+			switch ((unsigned long)sf.f_type) {
+			case NFS_SUPER_MAGIC:
+			case SMB_SUPER_MAGIC:
+			case CIFS_SUPER_MAGIC:
+			case SMB2_SUPER_MAGIC:
+			case CEPH_SUPER_MAGIC:
+			case FUSE_SUPER_MAGIC:
+				hint->kind = "network";
+				break;
+			}
+		}
+	}
+	log_mesg(1, 0, 0, opt->debug, "tune: fd %i is a %s, io min %u opt %u, queue %u of %u KiB, size %llu\n",
+		 fd, hint->kind, hint->io_min, hint->io_opt, hint->nr_requests, hint->max_sectors_kb, hint->size);
+}
+
+static long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Read the source with every buffer size, each from its own range so the
+ * page cache of an earlier size doesn't help. Returns the chosen size, or 0
+ * when the source can't be read at will.
+ */
+static unsigned int probe_source(int fd, const tune_hint *hint, cmd_opt *opt) {
+	unsigned long long offset = 0, done;
+	unsigned int size, best_size = 0;
+	double rate[32], best = 0;
+	long long start, ns;
+	char *buffer = NULL;
+	int i, n = 0;
+
+	if (hint->size < 2 * TUNE_PROBE_BYTES)
+		return 0;
+
+	/// aligned for --read-direct-io
+	if (posix_memalign((void **)&buffer, BSIZE, TUNE_BUFFER_MAX))
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (size = TUNE_BUFFER_MIN; size <= TUNE_BUFFER_MAX; size *= 2, n++) {
+		if (offset + TUNE_PROBE_BYTES > hint->size)
+			offset = 0;
+		posix_fadvise(fd, offset, TUNE_PROBE_BYTES, POSIX_FADV_DONTNEED);
+		done = 0;
+		start = now_ns();
+		do {
+			if (pread(fd, buffer, size, offset + done) != size) {
+				log_mesg(1, 0, 0, opt->debug, "tune: probe read of %u bytes failed: %s\n", size, strerror(errno));
+				free(buffer);
+				return 0;
+			}
+			done += size;
+			ns = now_ns() - start;
+		} while (done < TUNE_PROBE_BYTES && ns < TUNE_PROBE_NSEC);
+		offset += TUNE_PROBE_BYTES;
+
+		rate[n] = ns > 0 ? (double)done * 1000 / ns : 0;
+		if (rate[n] > best)
+			best = rate[n];
+		log_mesg(1, 0, 0, opt->debug, "tune: read %u bytes at a time: %.1f MB/s\n", size, rate[n]);
+	}
+	free(buffer);
+
+	/// smaller buffers copy as fast and give finer progress and checkpoints
+	for (i = 0, size = TUNE_BUFFER_MIN; i < n; i++, size *= 2) {
+		if (rate[i] >= best * 0.95) {
+			best_size = size;
+			break;
+		}
+	}
+	log_mesg(0, 0, 1, opt->debug, "Auto-tune: source reads %.1f MB/s at best, %u bytes at a time is within 5%%\n",
+		 best, best_size);
+	return best_size;
+}
+
+/// greatest common divisor, for the least common multiple of two io sizes
+static unsigned long long gcd(unsigned long long a, unsigned long long b) {
+	while (b) {
+		unsigned long long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static unsigned long long align_io(unsigned long long size, unsigned long long io) {
+	if (io == 0)
+		return size;
+	return (size + io - 1) / io * io;
+}
+
+void auto_tune(int src_fd, int *target_fds, int target_count, cmd_opt *opt) {
+	tune_hint src, dst[MAX_TARGETS];
+	unsigned long long buffer_size, strip = 0, window = 0, io;
+	int seek_bound = 0, t;
+	unsigned int lag;
+
+	if (opt->resume && opt->clone) {
+		/// the checksums of the image must stay in the blocks of the first run
+		log_mesg(0, 0, 1, opt->debug, "Auto-tune: keep the settings of the image to resume\n");
+		return;
+	}
+
+	get_hint(src_fd, &src, opt);
+	for (t = 0; t < target_count; t++)
+		get_hint(target_fds[t], &dst[t], opt);
+
+	/// the stripe of all the sides, their least common multiple while it stays small
+	for (t = -1; t < target_count; t++) {
+		const tune_hint *h = t < 0 ? &src : &dst[t];
+
+		if (!strcmp(h->kind, "disk") || !strcmp(h->kind, "network"))
+			seek_bound = 1;
+		if (t >= 0 && h->nr_requests && h->max_sectors_kb) {
+			io = (unsigned long long)h->nr_requests * h->max_sectors_kb * 1024;
+			if (window == 0 || io < window)
+				window = io;
+		}
+
+		io = h->io_opt > h->io_min ? h->io_opt : h->io_min;
+		if (io == 0 || (io & (PART_SECTOR_SIZE - 1)))
+			continue;
+		io = strip ? strip / gcd(strip, io) * io : io;
+		if (io <= TUNE_BUFFER_MAX)
+			strip = io;
+	}
+
+	if (opt->buffer_size == DEFAULT_BUFFER_SIZE) {
+		buffer_size = probe_source(src_fd, &src, opt);
+		if (buffer_size == 0)
+			buffer_size = DEFAULT_BUFFER_SIZE;
+		if (seek_bound && buffer_size < TUNE_BUFFER_SEEK)
+			buffer_size = TUNE_BUFFER_SEEK;
+		buffer_size = align_io(buffer_size, strip);
+		opt->buffer_size = buffer_size;
+	}
+
+	/// the targets may lag the bytes their queues hold, in whole buffers
+	if (target_count > 1 && opt->target_lag == DEFAULT_TARGET_LAG) {
+		if (window < TUNE_WINDOW_MIN)
+			window = TUNE_WINDOW_MIN;
+		if (window > TUNE_WINDOW_MAX)
+			window = TUNE_WINDOW_MAX;
+		lag = window / opt->buffer_size;
+		opt->target_lag = lag < 2 ? 2 : lag > TUNE_LAG_MAX ? TUNE_LAG_MAX : lag;
+	}
+
+	log_mesg(0, 0, 1, opt->debug, "Auto-tune: source %s, target %s, strip %llu, buffer size %u, target lag %u\n",
+		 src.kind, target_count ? dst[0].kind : "none", strip, opt->buffer_size,
+		 target_count > 1 ? opt->target_lag : 0);
+}
@@ -0,0 +1,25 @@
+/**
+ * tune.h - part of Partclone project
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * pick the buffer size and the target lag of --auto-tune
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TUNE_H_
+#define TUNE_H_
+
+/**
+ * Set --buffer_size and --target-lag from the io hints of the source @src_fd
+ * and the @target_count targets @target_fds and from a short read calibration
+ * of the source. Only the settings left at their defaults are changed, the
+ * choices are logged.
+ */
+extern void auto_tune(int src_fd, int *target_fds, int target_count, cmd_opt *opt);
+
+#endif /* TUNE_H_ */
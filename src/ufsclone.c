@@ -166,7 +166,7 @@ static void fs_close(){
 
 void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap, int pui)
 {
-    unsigned long long     block_in_cg;
+    unsigned long long     used;
     unsigned long long     bused = 0, bfree = 0;
     int                    i = 0, start = 0, bit_size = 1;
     unsigned char* p;
@@ -224,25 +224,19 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
         }
 
         uint64_t cg_base = cgstart(&afs, cg_idx);
-        for (block_in_cg = 0; block_in_cg < (unsigned long long)afs.fs_fpg; block_in_cg++){
-            uint64_t abs_frag = cg_base + block_in_cg;
-
-            // Ensure abs_frag does not exceed fs_info.totalblock
-            if (abs_frag >= fs_info.totalblock) {
-                break;
-            }
-
-            if (isset(p, block_in_cg)) {
-                pc_clear_bit(abs_frag, bitmap, fs_info.totalblock);
-                bfree++;
-                log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is free %lli (abs %lli)\n", __FILE__, block_in_cg, abs_frag);
-            } else {
-                pc_set_bit(abs_frag, bitmap, fs_info.totalblock);
-                bused++;
-                log_mesg(3, 0, 0, fs_opt.debug, "%s: bitmap is used %lli (abs %lli)\n", __FILE__, block_in_cg, abs_frag);
-            }
-            update_pui(&bprog, abs_frag, abs_frag, 0);
-        }
+        unsigned long long frags = afs.fs_fpg;
+
+        // Ensure the group does not run past fs_info.totalblock
+        if (cg_base >= fs_info.totalblock)
+            continue;
+        if (frags > fs_info.totalblock - cg_base)
+            frags = fs_info.totalblock - cg_base;
+
+        /// a set bit of the cg map is a free fragment
+        used = pc_import_bits(cg_base, p, frags, PC_BITS_INVERT, bitmap, fs_info.totalblock);
+        bused += used;
+        bfree += frags - used;
+        update_pui(&bprog, cg_base + frags - 1, cg_base + frags - 1, 0);
         log_mesg(3, 0, 0, fs_opt.debug, "%s: read bitmap done for cg %d\n", __FILE__, cg_idx);
     } // End of for loop for cylinder groups
 
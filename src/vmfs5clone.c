@@ -33,6 +33,8 @@ void *thread_update_bitmap_pui(void *arg);
 int bitmap_done = 0;
 unsigned long long total_block = 0;
 
+#define FDC_THREADS_MAX 8 // threads walking the file descriptors
+
 /* Forward declarations */
 typedef struct vmfs_dir_map vmfs_dir_map_t;
 typedef struct vmfs_blk_map vmfs_blk_map_t;
@@ -184,13 +186,12 @@ void print_pos_by_id (const vmfs_fs_t *fs, uint32_t blk_id)
 	    log_mesg(0, 0, 0, fs_opt.debug, "Unsupported block type 0x%2.2x\n", blk_type);
 	    //fprintf(stderr,"Unsupported block type 0x%2.2x\n",blk_type);
     }
-    if (checked < total_block)
-	checked++;
+    __atomic_add_fetch(&checked, 1, __ATOMIC_RELAXED);
     current = pos/vmfs_fs_get_blocksize(fs);
     if ( current > total_block )
 	log_mesg(3, 0, 0, fs_opt.debug, "total_block Error Blockid = 0x%8.8x, Type = 0x%2.2x, Pos: %llu, bitmapid: %llu, c: %llu\n", blk_id, blk_type, pos, current, checked);
     log_mesg(3, 0, 0, fs_opt.debug, "Blockid = 0x%8.8x, Type = 0x%2.2x, Pos: %llu, bitmapid: %llu, c: %llu\n", blk_id, blk_type, pos, current, checked);
-    pc_set_bit(current, blk_bitmap, total_block);
+    pc_set_bit_atomic(current, blk_bitmap, total_block);
 }
 
 
@@ -283,6 +284,49 @@ static void vmfs_dump_init(vmfs_dump_info_t *fi)
     fi->dir_map = vmfs_dir_map_alloc_root();
 }
 
+/* A range of FDC items walked by one thread, with its own block map */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    vmfs_dump_info_t dump_info;
+} fdc_slice;
+
+/* Walk the inodes of one FDC slice and mark every block they use */
+static void *scan_fdc_thread(void *arg)
+{
+    fdc_slice *slice = arg;
+    vmfs_bitmap_header_t *fdc_bmp = &fs->fdc->bmh;
+    vmfs_inode_t inode;
+    uint32_t i, entry, item;
+
+    for (i = slice->start; i < slice->end; i++) {
+        entry = i / fdc_bmp->items_per_bitmap_entry;
+        item  = i % fdc_bmp->items_per_bitmap_entry;
+
+        /* Skip undefined/deleted inodes */
+        if ((vmfs_inode_get(fs,VMFS_BLK_FD_BUILD(entry,item,0),&inode) == -1) ||
+        	!inode.nlink)
+            continue;
+
+        inode.fs = fs;
+        vmfs_dump_store_inode(fs,slice->dump_info.blk_map,&inode);
+        vmfs_inode_foreach_block(&inode,vmfs_dump_store_block,slice->dump_info.blk_map);
+    }
+    return NULL;
+}
+
+/* Mark the allocated sub-blocks, pointer blocks and file blocks */
+static void *dump_bitmaps_thread(void *arg)
+{
+    log_mesg(3, 0, 0, fs_opt.debug, "Scanning SBC\n");
+    vmfs_bitmap_foreach(fs->sbc,dump_bitmaps_sb,fs);
+    log_mesg(3, 0, 0, fs_opt.debug, "Scanning PBC\n");
+    vmfs_bitmap_foreach(fs->pbc,dump_bitmaps_pb,fs);
+    log_mesg(3, 0, 0, fs_opt.debug, "Scanning FBB\n");
+    vmfs_bitmap_foreach(fs->fbb,dump_bitmaps_fb,fs);
+    return NULL;
+}
+
 
 /// open device
 static void fs_open(char* device){
@@ -338,22 +382,20 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     int start = 0;
     int bit_size = 1;
 
-    vmfs_dump_info_t dump_info;
-    vmfs_inode_t inode;
     vmfs_bitmap_header_t *fdc_bmp;
-    vmfs_bitmap_t *fbb_bmp;
-    vmfs_bitmap_t *sbc_bmp;
-    vmfs_bitmap_t *pbc_bmp;
-    uint32_t entry,item;
     uint64_t vmfs_fsinfo_base = VMFS_FSINFO_BASE;
     uint64_t vmfs_hb_base = VMFS_HB_BASE;
     uint64_t vmfs_volinfo_base = VMFS_VOLINFO_BASE;
-    int i;
+    fdc_slice *slices;
+    pthread_t scan_threads[FDC_THREADS_MAX];
+    pthread_t dump_thread;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t per_thread;
+    int threads, t;
     int bres;
     pthread_t prog_bitmap_thread;
 
     fs_open(device);
-    vmfs_dump_init(&dump_info);
     blk_bitmap = bitmap;
 
     /// init progress
@@ -374,33 +416,34 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     pc_set_bit(vmfs_fsinfo_base/vmfs_fs_get_blocksize(fs), bitmap, fs_info.totalblock);
     pc_set_bit(vmfs_volinfo_base/vmfs_fs_get_blocksize(fs), bitmap, fs_info.totalblock);
 
-    fdc_bmp = &fs->fdc->bmh;
-    log_mesg(3, 0, 0, fs_opt.debug, "Scanning %u FDC entries...\n",fdc_bmp->total_items);
-
-    for(i=0;i<fdc_bmp->total_items;i++) {
-        entry = i / fdc_bmp->items_per_bitmap_entry;
-        item  = i % fdc_bmp->items_per_bitmap_entry;
+    /// the SBC, PBC and FBB bitmaps are dumped while the inodes are walked
+    if (pthread_create(&dump_thread, NULL, dump_bitmaps_thread, NULL))
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
 
-        /* Skip undefined/deleted inodes */
-        if ((vmfs_inode_get(fs,VMFS_BLK_FD_BUILD(entry,item,0),&inode) == -1) ||
-        	!inode.nlink)
-            continue;
-
-        inode.fs = fs;
-        vmfs_dump_store_inode(fs,dump_info.blk_map,&inode);
-        vmfs_inode_foreach_block(&inode,vmfs_dump_store_block,dump_info.blk_map);
+    fdc_bmp = &fs->fdc->bmh;
+    threads = cpus > 1 ? (cpus < FDC_THREADS_MAX ? cpus : FDC_THREADS_MAX) : 1;
+    if ((uint32_t)threads > fdc_bmp->total_items)
+	threads = fdc_bmp->total_items ? fdc_bmp->total_items : 1;
+    per_thread = (fdc_bmp->total_items + threads - 1) / threads;
+    log_mesg(3, 0, 0, fs_opt.debug, "Scanning %u FDC entries with %i threads...\n",fdc_bmp->total_items, threads);
+
+    slices = calloc(threads, sizeof(fdc_slice));
+    if (!slices)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    for (t = 0; t < threads; t++) {
+	slices[t].start = per_thread * t;
+	slices[t].end = per_thread * (t + 1) < fdc_bmp->total_items ? per_thread * (t + 1) : fdc_bmp->total_items;
+	vmfs_dump_init(&slices[t].dump_info);
+	if (pthread_create(&scan_threads[t], NULL, scan_fdc_thread, &slices[t]))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
     }
-
-
-    fbb_bmp = fs->fbb;
-    sbc_bmp = fs->sbc;
-    pbc_bmp = fs->pbc;
-    log_mesg(3, 0, 0, fs_opt.debug, "Scanning SBC\n");
-    vmfs_bitmap_foreach(sbc_bmp,dump_bitmaps_sb,fs);
-    log_mesg(3, 0, 0, fs_opt.debug, "Scanning PBC\n");
-    vmfs_bitmap_foreach(pbc_bmp,dump_bitmaps_pb,fs);
-    log_mesg(3, 0, 0, fs_opt.debug, "Scanning FBB\n");
-    vmfs_bitmap_foreach(fbb_bmp,dump_bitmaps_fb,fs);
+    for (t = 0; t < threads; t++) {
+	if (pthread_join(scan_threads[t], NULL))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+    }
+    if (pthread_join(dump_thread, NULL))
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+    free(slices);
 
     fs_close();
     bitmap_done = 1;
@@ -448,7 +491,11 @@ void read_super_blocks(char* device, file_system_info* fs_info)
 void *thread_update_bitmap_pui(void *arg){
 
     while (bitmap_done == 0) {
-	update_pui(&prog, checked, checked, 0);
+	unsigned long long done = __atomic_load_n(&checked, __ATOMIC_RELAXED);
+	/// the workers count without a cap, keep the progress within the file system
+	if (done > total_block)
+	    done = total_block;
+	update_pui(&prog, done, done, 0);
 	sleep(4);
     }
     pthread_exit("exit");
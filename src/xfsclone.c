@@ -74,17 +74,42 @@ void get_sb(xfs_sb_t *sbp, xfs_off_t off, int size, xfs_agnumber_t agno)
 }
 
 
-static void set_bitmap(unsigned long* bitmap, uint64_t start, int count)
-{
-    uint64_t block;
+/**
+ * Allocation groups are independent, so they are scanned by a few threads.
+ * Each AG owns the words of the bitmap that lie wholly inside it and clears
+ * its free extents there a range at a time. The first and the last word may
+ * be shared with the neighbouring AGs, their free bits are gathered in the
+ * slice and merged once every thread is done.
+ */
+#define AG_THREADS_MAX 8
+
+typedef struct {
+    unsigned long long start, end;	/// blocks [start, end) of the AG
+    unsigned long head, tail;		/// free bits of the first and the last word
+    unsigned long long free;		/// free blocks found in the AG
+} ag_slice;
+
+static ag_slice* slices;
+static xfs_agnumber_t next_ag;
+static pthread_mutex_t ag_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static void set_bitmap(ag_slice* slice, unsigned long long start, unsigned long long count)
+{
+    unsigned long long first = slice->start / PART_BITS_PER_LONG;
+    unsigned long long last = (slice->end - 1) / PART_BITS_PER_LONG;
+    unsigned long long end = start + count;
 
-    for (block = start; block < start+count; block++){
-	pc_clear_bit(block, bitmap, total_block);
-	log_mesg(3, 0, 0, fs_opt.debug, "%s: block %i is free\n", __FILE__, block);
-	checked++;
+    if (start < slice->start || start >= slice->end || count > slice->end - start) {
+	log_mesg(0, 0, 1, fs_opt.debug, "%s: free extent %llu+%llu is out of its ag, ignored\n", __FILE__, start, count);
+	return;
     }
+    slice->free += count;
 
+    for (; start < end && start / PART_BITS_PER_LONG == first; start++)
+	slice->head |= 1UL << (start % PART_BITS_PER_LONG);
+    for (; end > start && (end - 1) / PART_BITS_PER_LONG == last; end--)
+	slice->tail |= 1UL << ((end - 1) % PART_BITS_PER_LONG);
+    pc_clear_range(start, end - start, xfs_bitmap, total_block);
 }
 // copy from xfs_db freesp ....
 
@@ -101,6 +126,7 @@ typedef enum typnm
 
 static void
 addtohist(
+	ag_slice	*slice,
 	xfs_agnumber_t	agno,
 	xfs_agblock_t	agbno,
 	xfs_extlen_t	len)
@@ -111,13 +137,14 @@ addtohist(
 	log_mesg(1, 0, 0, fs_opt.debug, "%s: add %8d %8d %8d\n", __FILE__, agno, agbno, len);
 	
 	start_block = ((unsigned long long)agno*mp->m_sb.sb_agblocks) + agbno;
-	set_bitmap(xfs_bitmap, start_block, len);
+	set_bitmap(slice, start_block, len);
 
 }
 
 
 static void
 scan_sbtree(
+	ag_slice	*slice,
 	xfs_agf_t	*agf,
 	xfs_agblock_t	root,
 	typnm_t		typ,
@@ -125,6 +152,7 @@ scan_sbtree(
 	void		(*func)(struct xfs_btree_block	*block,
 				typnm_t			typ,
 				int			level,
+				ag_slice		*slice,
 				xfs_agf_t		*agf))
 {
 	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
@@ -147,7 +175,7 @@ scan_sbtree(
 		libxfs_buf_relse(bp);
 		return;
 	}
-	(*func)(data, typ, nlevels - 1, agf);
+	(*func)(data, typ, nlevels - 1, slice, agf);
 	libxfs_buf_relse(bp);
 	//pop_cur();
 }
@@ -158,6 +186,7 @@ scanfunc_bno(
 	struct xfs_btree_block	*block,
 	typnm_t			typ,
 	int			level,
+	ag_slice		*slice,
 	xfs_agf_t		*agf)
 {
 	int			i;
@@ -173,18 +202,19 @@ scanfunc_bno(
 	if (level == 0) {
 		rp = XFS_ALLOC_REC_ADDR(mp, block, 1);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-			addtohist(be32_to_cpu(agf->agf_seqno),
+			addtohist(slice, be32_to_cpu(agf->agf_seqno),
 					be32_to_cpu(rp[i].ar_startblock),
 					be32_to_cpu(rp[i].ar_blockcount));
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
+		scan_sbtree(slice, agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
 }
 
 static void
 scan_freelist(
+	ag_slice	*slice,
 	xfs_agf_t	*agf)
 {
 	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
@@ -215,7 +245,7 @@ scan_freelist(
 
 	for (;;) {
 		bno = be32_to_cpu(agfl_bno[i]);
-		addtohist(seqno, bno, 1);
+		addtohist(slice, seqno, bno, 1);
 		if (i == be32_to_cpu(agf->agf_fllast))
 			break;
 		if (++i == xfs_agfl_size(mp))
@@ -227,6 +257,7 @@ scan_freelist(
 
 static void
 scan_ag(
+	ag_slice	*slice,
 	xfs_agnumber_t	agno)
 {
 	xfs_agf_t	*agf;
@@ -244,14 +275,35 @@ scan_ag(
 		return;
 	}
 	agf = bp->b_addr;
-	scan_freelist(agf);
-	scan_sbtree(agf, be32_to_cpu(agf->agf_bno_root),
+	scan_freelist(slice, agf);
+	scan_sbtree(slice, agf, be32_to_cpu(agf->agf_bno_root),
 			TYP_BNOBT, be32_to_cpu(agf->agf_bno_level),
 			scanfunc_bno);
 	libxfs_buf_relse(bp);
 	//pop_cur();
 }
 
+/// take the next AG not scanned yet until there is none left
+static void *scan_ag_thread(void *arg)
+{
+    xfs_agnumber_t agno;
+
+    while (1) {
+	pthread_mutex_lock(&ag_lock);
+	agno = next_ag < mp->m_sb.sb_agcount ? next_ag++ : NULLAGNUMBER;
+	pthread_mutex_unlock(&ag_lock);
+	if (agno == NULLAGNUMBER)
+	    break;
+
+	scan_ag(&slices[agno], agno);
+
+	pthread_mutex_lock(&ag_lock);
+	checked += slices[agno].end - slices[agno].start;
+	pthread_mutex_unlock(&ag_lock);
+    }
+    return NULL;
+}
+
 
 
 static int xfs_is_open = 0;
@@ -387,6 +439,9 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
     xfs_agnumber_t  agno = 0;
     xfs_agnumber_t  num_ags;
+    pthread_t scan_threads[AG_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads, t;
 
     int start = 0;
     int bit_size = 1;
@@ -395,14 +450,12 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
 
     uint64_t bused = 0;
     uint64_t bfree = 0;
-    unsigned long long current_block = 0;
     total_block = fs_info.totalblock;
 
     xfs_bitmap = bitmap;
 
-    for(current_block = 0; current_block < fs_info.totalblock; current_block++){
-	pc_set_bit(current_block, bitmap, fs_info.totalblock);
-    }
+    /// every block is used until the free space btrees tell otherwise
+    pc_set_range(0, fs_info.totalblock, bitmap, fs_info.totalblock);
     /// init progress
     progress_init(&prog, start, fs_info.totalblock, fs_info.totalblock, BITMAP, bit_size);
     checked = 0;
@@ -417,18 +470,42 @@ void read_bitmap(char* device, file_system_info fs_info, unsigned long* bitmap,
     fs_open(device);
 
     num_ags = mp->m_sb.sb_agcount;
+    slices = calloc(num_ags, sizeof(ag_slice));
+    if (slices == NULL)
+	log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    for (agno = 0; agno < num_ags; agno++) {
+	slices[agno].start = (unsigned long long)agno * mp->m_sb.sb_agblocks;
+	slices[agno].end = slices[agno].start + mp->m_sb.sb_agblocks;
+	if (slices[agno].end > total_block)
+	    slices[agno].end = total_block;
+    }
 
-    log_mesg(1, 0, 0, fs_opt.debug, "ags = %i\n", num_ags);
-    for (agno = 0; agno < num_ags ; agno++)  {
-	/* read in first blocks of the ag */
-	scan_ag(agno);
+    threads = cpus > 1 ? (cpus < AG_THREADS_MAX ? cpus : AG_THREADS_MAX) : 1;
+    if ((xfs_agnumber_t)threads > num_ags)
+	threads = num_ags;
+    log_mesg(1, 0, 0, fs_opt.debug, "ags = %i, scanned with %i threads\n", num_ags, threads);
+
+    next_ag = 0;
+    for (t = 0; t < threads; t++) {
+	if (pthread_create(&scan_threads[t], NULL, scan_ag_thread, NULL))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
     }
-    for(current_block = 0; current_block < fs_info.totalblock; current_block++){
-	if(pc_test_bit(current_block, bitmap, fs_info.totalblock))
-	    bused++;
-	else
-	    bfree++;
+    for (t = 0; t < threads; t++) {
+	if (pthread_join(scan_threads[t], NULL))
+	    log_mesg(0, 1, 1, fs_opt.debug, "%s, %i, thread join error\n", __func__, __LINE__);
+    }
+
+    /// merge the words shared between AGs and sum up the free blocks
+    for (agno = 0; agno < num_ags; agno++) {
+	if (slices[agno].start >= slices[agno].end)
+	    continue;
+	bitmap[slices[agno].start / PART_BITS_PER_LONG] &= ~slices[agno].head;
+	bitmap[(slices[agno].end - 1) / PART_BITS_PER_LONG] &= ~slices[agno].tail;
+	bfree += slices[agno].free;
     }
+    bused = fs_info.totalblock - bfree;
+    free(slices);
+    slices = NULL;
     log_mesg(0, 0, 0, fs_opt.debug, "%s: bused = %lli, bfree = %lli\n", __FILE__, bused, bfree);
 
     fs_close();
@@ -0,0 +1,266 @@
+#!/bin/bash
+## Throughput benchmark of the clone, restore, chkimg, dd and imgfuse paths,
+## run by "make bench".
+##
+## A synthetic raw device is made of BENCH_SIZE MiB where every period has
+## U used blocks of random data and F all-zero blocks, for each U:F of
+## BENCH_PATTERNS. The zero blocks are holes of the file, or read as zeros
+## with --sparse from a loop device, so partclone.imager and partclone.dd
+## mark them free and the pattern sets the fragmentation of the bitmap.
+## Each mode runs BENCH_RUNS times and writes one JSON object per line to
+## stdout and BENCH_OUT:
+##
+##   {"bench":"clone","pattern":"16:16","block_size":4096,"size":268435456,
+##    "used":134217728,"storage":"tmpfs","run":1,"seconds":0.412,
+##    "mb_per_s":325.77,"user":0.120,"sys":0.280,"max_rss_kb":5120}
+##
+## mb_per_s counts the used bytes, the data that is really copied. user and
+## sys are the CPU seconds of the partclone process, max_rss_kb its peak
+## resident size. For imgfuse they are those of the FUSE daemon while all
+## its block files are read.
+##
+## Settings, from the environment:
+##   BENCH_SIZE        device size in MiB (256)
+##   BENCH_BLOCK_SIZE  block size of the raw bitmap (4096)
+##   BENCH_PATTERNS    U:F used and free blocks per period ("1:0 16:16 1:7")
+##   BENCH_MODES       what to run ("clone restore chkimg dd imgfuse")
+##   BENCH_RUNS        runs of each mode (1)
+##   BENCH_DIR         where the files go (/dev/shm when writable, else .)
+##   BENCH_LOOP        1 to read the source device through a loop device (root)
+##   BENCH_ARGS        more partclone options, e.g. "-a 2 -k 64"
+##   BENCH_OUT         file the records are appended to (bench.jsonl)
+##
+## Before it "make bench" runs src/partclone.bench, the microbenchmarks of the
+## checksum, bitmap and io_all primitives, with the options of
+## BENCH_MICRO_ARGS, e.g. "-n crc32,checksum -k 16,64,256".
+set -e
+
+. "$(dirname "$0")"/_common
+
+size_mb=${BENCH_SIZE:-256}
+block_size=${BENCH_BLOCK_SIZE:-4096}
+patterns=${BENCH_PATTERNS:-"1:0 16:16 1:7"}
+modes=${BENCH_MODES:-"clone restore chkimg dd imgfuse"}
+runs=${BENCH_RUNS:-1}
+use_loop=${BENCH_LOOP:-0}
+extra_args=${BENCH_ARGS:-}
+out=${BENCH_OUT:-bench.jsonl}
+if [ -n "$BENCH_DIR" ]; then
+    dir=$BENCH_DIR
+elif [ -d /dev/shm ] && [ -w /dev/shm ]; then
+    dir=/dev/shm
+else
+    dir=.
+fi
+
+ptlimager=$ptldir/partclone.imager
+ptldd=$ptldir/partclone.dd
+ptlimgfuse=$ptldir/partclone.imgfuse
+gnu_time=$(command -v /usr/bin/time || true)
+
+b_raw="$dir/$$_bench.raw"
+b_img="$dir/$$_bench.img"
+b_out="$dir/$$_bench_out.raw"
+b_period="$dir/$$_bench.period"
+b_mnt="$dir/$$_bench_mnt"
+b_time="$dir/$$_bench.time"
+b_log="$$_bench.log"
+loop_dev=""
+fuse_pid=""
+
+_cleanup(){
+    if [ -n "$fuse_pid" ]; then
+	fusermount -u $b_mnt 2>/dev/null || umount $b_mnt 2>/dev/null || true
+    fi
+    [ -n "$loop_dev" ] && losetup -d $loop_dev 2>/dev/null || true
+    rm -rf $b_raw $b_img $b_out $b_period $b_mnt $b_time $b_log $b_raw.tmp
+}
+trap _cleanup EXIT
+
+_calc(){
+    awk "BEGIN { printf \"$1\", $2 }"
+}
+
+## the raw device: U random blocks and a hole of F blocks repeated up to size_mb MiB
+_make_raw(){
+    local used=$1 free=$2
+    local size=$((size_mb * 1024 * 1024))
+
+    dd if=/dev/urandom of=$b_period bs=$block_size count=$used 2>/dev/null
+    if [ $free -gt 0 ]; then
+	dd if=/dev/zero of=$b_period bs=$block_size count=$free seek=$used 2>/dev/null
+    fi
+    cp $b_period $b_raw
+    while [ $(stat -c %s $b_raw) -lt $size ]; do
+	cat $b_raw $b_raw > $b_raw.tmp
+	mv $b_raw.tmp $b_raw
+    done
+    truncate -s $size $b_raw
+    cp --sparse=always $b_raw $b_raw.tmp
+    mv $b_raw.tmp $b_raw
+    rm -f $b_period
+}
+
+## used bytes of the pattern, a last partial period counts what it holds
+_used_bytes(){
+    local used=$1 free=$2
+    local size=$((size_mb * 1024 * 1024))
+    local period=$(((used + free) * block_size))
+    local rest=$((size % period))
+
+    [ $rest -gt $((used * block_size)) ] && rest=$((used * block_size))
+    echo $((size / period * used * block_size + rest))
+}
+
+## run a command, set seconds, user, sys and max_rss_kb
+_measure(){
+    local start end cpu_before cpu_after hwm pid
+
+    start=$(date +%s.%N)
+    if [ -n "$gnu_time" ]; then
+	$gnu_time -o $b_time -f "%U %S %M" "$@"
+	end=$(date +%s.%N)
+	read user sys max_rss_kb < $b_time
+    else
+	## no GNU time: the CPU time of the reaped children from times and
+	## the peak RSS from the last VmHWM seen before the exit
+	times > $b_time
+	cpu_before=$(tail -n 1 $b_time)
+	"$@" &
+	pid=$!
+	max_rss_kb=0
+	while kill -0 $pid 2>/dev/null; do
+	    hwm=$(awk '/^VmHWM/ { print $2 }' /proc/$pid/status 2>/dev/null || true)
+	    [ -n "$hwm" ] && max_rss_kb=$hwm
+	    sleep 0.02
+	done
+	wait $pid
+	end=$(date +%s.%N)
+	times > $b_time
+	cpu_after=$(tail -n 1 $b_time)
+	user=$(_cpu_diff "$cpu_before" "$cpu_after" 1)
+	sys=$(_cpu_diff "$cpu_before" "$cpu_after" 2)
+    fi
+    seconds=$(_calc "%.3f" "$end - $start")
+}
+
+## seconds between two "XmY.YYYs XmY.YYYs" lines of times, field $3
+_cpu_diff(){
+    echo "$1 $2" | awk -v f=$3 '
+	function sec(t) { split(t, a, /[ms]/); return a[1] * 60 + a[2] }
+	{ printf "%.3f", sec($(f + 2)) - sec($f) }'
+}
+
+## the FUSE daemon has to stay up while its files are read, its CPU time and
+## peak RSS come from /proc before it is unmounted
+_measure_imgfuse(){
+    local start end ticks stat
+
+    mkdir -p $b_mnt
+    $ptlimgfuse $b_img $b_mnt -f > /dev/null 2>&1 &
+    fuse_pid=$!
+    for i in $(seq 50); do
+	mountpoint -q $b_mnt && break
+	sleep 0.1
+    done
+    if ! mountpoint -q $b_mnt; then
+	kill $fuse_pid 2>/dev/null || true
+	fuse_pid=""
+	return 1
+    fi
+    start=$(date +%s.%N)
+    cat $b_mnt/* > /dev/null
+    end=$(date +%s.%N)
+    ticks=$(getconf CLK_TCK)
+    stat=$(cat /proc/$fuse_pid/stat)
+    stat=${stat##*) }
+    user=$(echo $stat | awk -v t=$ticks '{ printf "%.3f", $12 / t }')
+    sys=$(echo $stat | awk -v t=$ticks '{ printf "%.3f", $13 / t }')
+    max_rss_kb=$(awk '/^VmHWM/ { print $2 }' /proc/$fuse_pid/status)
+    seconds=$(_calc "%.3f" "$end - $start")
+    fusermount -u $b_mnt 2>/dev/null || umount $b_mnt
+    wait $fuse_pid || true
+    fuse_pid=""
+}
+
+_record(){
+    local bench=$1 pattern=$2 used=$3 run=$4 storage=$5
+    local rate=$(_calc "%.2f" "($seconds > 0 ? $used / 1000000 / $seconds : 0)")
+    local line="{\"bench\":\"$bench\",\"pattern\":\"$pattern\",\"block_size\":$block_size,\"size\":$((size_mb * 1024 * 1024)),\"used\":$used,\"storage\":\"$storage\",\"run\":$run,\"seconds\":$seconds,\"mb_per_s\":$rate,\"user\":$user,\"sys\":$sys,\"max_rss_kb\":${max_rss_kb:-0}}"
+
+    echo "$line"
+    echo "$line" >> $out
+}
+
+case "$(stat -f -c %T $dir)" in
+    tmpfs) storage=tmpfs ;;
+    *) storage=file ;;
+esac
+
+for pattern in $patterns; do
+    used_blocks=${pattern%%:*}
+    free_blocks=${pattern##*:}
+    if [ $used_blocks -lt 1 ] || [ $free_blocks -lt 0 ]; then
+	echo "bad pattern $pattern, it is used:free blocks like 16:16" >&2
+	exit 1
+    fi
+    _make_raw $used_blocks $free_blocks
+    used=$(_used_bytes $used_blocks $free_blocks)
+
+    source=$b_raw
+    source_storage=$storage
+    if [ "$use_loop" = 1 ]; then
+	_check_root
+	loop_dev=$(losetup -f --show $b_raw)
+	source=$loop_dev
+	source_storage=loop
+    fi
+
+    ## restore, chkimg and imgfuse need the image of the clone
+    $ptlimager -c -s $source -O $b_img --sparse --block-size $block_size $extra_args -q -F -L $b_log > /dev/null 2>&1
+
+    for run in $(seq $runs); do
+	for mode in $modes; do
+	    case $mode in
+		clone)
+		    rm -f $b_out
+		    _measure $ptlimager -c -s $source -O $b_out --sparse --block-size $block_size $extra_args -q -F -L $b_log > /dev/null 2>&1
+		    _record clone $pattern $used $run $source_storage
+		    ;;
+		restore)
+		    rm -f $b_out
+		    _measure $ptlrestore -s $b_img -O $b_out -C -q -F -L $b_log > /dev/null 2>&1
+		    _record restore $pattern $used $run $storage
+		    ;;
+		chkimg)
+		    _measure $ptlchkimg -s $b_img -F -L $b_log > /dev/null 2>&1
+		    _record chkimg $pattern $used $run $storage
+		    ;;
+		dd)
+		    rm -f $b_out
+		    _measure $ptldd -s $source -O $b_out --sparse --block-size $block_size -q -F -L $b_log > /dev/null 2>&1
+		    _record dd $pattern $used $run $source_storage
+		    ;;
+		imgfuse)
+		    if [ ! -x $ptlimgfuse ] || ! command -v fusermount > /dev/null || [ ! -c /dev/fuse ]; then
+			echo "skip imgfuse, partclone.imgfuse or FUSE is not available" >&2
+		    elif _measure_imgfuse; then
+			_record imgfuse $pattern $used $run $storage
+		    else
+			echo "skip imgfuse, $b_img can't be mounted" >&2
+		    fi
+		    ;;
+		*)
+		    echo "unknown bench mode $mode" >&2
+		    exit 1
+		    ;;
+	    esac
+	done
+    done
+    rm -f $b_out $b_img
+
+    if [ -n "$loop_dev" ]; then
+	losetup -d $loop_dev
+	loop_dev=""
+    fi
+done